@@ -111,11 +111,13 @@ HEADERS		+= src/midipp_devices.h
 HEADERS		+= src/midipp_devsel.h
 HEADERS		+= src/midipp_dialog.h
 HEADERS		+= src/midipp_element.h
+HEADERS		+= src/midipp_engine.h
 HEADERS		+= src/midipp_gpro.h
 HEADERS		+= src/midipp_groupbox.h
 HEADERS		+= src/midipp_gridlayout.h
 HEADERS		+= src/midipp_import.h
 HEADERS		+= src/midipp_instrument.h
+HEADERS		+= src/midipp_loader.h
 HEADERS		+= src/midipp_looptab.h
 HEADERS		+= src/midipp_mainwindow.h
 HEADERS		+= src/midipp_metronome.h
@@ -153,11 +155,13 @@ SOURCES		+= src/midipp_devices.cpp
 SOURCES		+= src/midipp_devsel.cpp
 SOURCES		+= src/midipp_dialog.cpp
 SOURCES		+= src/midipp_element.cpp
+SOURCES		+= src/midipp_engine.cpp
 SOURCES		+= src/midipp_gpro.cpp
 SOURCES		+= src/midipp_groupbox.cpp
 SOURCES		+= src/midipp_gridlayout.cpp
 SOURCES		+= src/midipp_import.cpp
 SOURCES		+= src/midipp_instrument.cpp
+SOURCES		+= src/midipp_loader.cpp
 SOURCES		+= src/midipp_looptab.cpp
 SOURCES		+= src/midipp_mainwindow.cpp
 SOURCES		+= src/midipp_metronome.cpp
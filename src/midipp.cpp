@@ -273,110 +273,149 @@ failure:
 	return (1);
 }
 
-static size_t
-MppSortIndex(size_t t)
+#define	MPP_SORT_INSERT_MAX 16	/* elements */
+#define	MPP_SORT_NETWORK_MAX 24	/* elements */
+
+static void
+MppSortSwap(uint8_t *pa, uint8_t *pb, size_t size)
 {
-	t ^= t >> 1;
-	t ^= t >> 2;
-	t ^= t >> 4;
-	t ^= t >> 8;
-	t ^= t >> 16;
-	if (sizeof(t) > 4)
-		t ^= t >> ((sizeof(t) > 4) ? 32 : 0);
-	return (t);
+	uint8_t temp[64];
+	size_t n;
+
+	while (size != 0) {
+		n = (size > sizeof(temp)) ? sizeof(temp) : size;
+		memcpy(temp, pa, n);
+		memcpy(pa, pb, n);
+		memcpy(pb, temp, n);
+		pa += n;
+		pb += n;
+		size -= n;
+	}
 }
 
-static int
-MppSortXform(void *ptr, size_t n, size_t lim, size_t size, MppCmp_t *fn, void *arg)
+static void
+MppSortSift(uint8_t *ptr, size_t root, size_t n, size_t size,
+    MppCmp_t *fn, void *arg)
 {
-#define	MPP_XSORT_TABLE_MAX (1 << 4)
-	size_t x, y, z;
-	size_t t, u, v;
-	size_t p[MPP_XSORT_TABLE_MAX];
-	int retval = 0;
-
-	x = n;
-	while (1) {
-		/* optimise */
-		if (x >= MPP_XSORT_TABLE_MAX)
-			v = MPP_XSORT_TABLE_MAX;
-		else if (x >= 2)
-			v = x;
-		else
-			break;
+	size_t child;
 
-		/* divide down */
-		x /= v;
-
-		/* generate ramp table */
-		for (t = 0; t != v; t++)
-			p[t] = MppSortIndex(x * (t ^ (t / 2)));
-
-		/* bitonic sort */
-		for (y = 0; y != n; y += (v * x)) {
-			for (z = 0; z != x; z++) {
-				size_t w = y + z;
-
-				/* insertion sort */
-				for (t = 1; t != v; t++) {
-					/* check for arrays which are not power of two */
-					if ((w ^ p[t]) >= lim)
-						break;
-					for (u = t; u != 0; u--) {
-						void *pa = ((uint8_t *)ptr) + (w ^ p[u - 1]) * size;
-						void *pb = ((uint8_t *)ptr) + (w ^ p[u]) * size;
-
-						if (fn(arg, pa, pb) > 0) {
-							uint8_t temp[size];
-							memcpy(temp, pa, sizeof(temp));
-							memcpy(pa, pb, sizeof(temp));
-							memcpy(pb, temp, sizeof(temp));
-							retval = 1;
-						} else {
-							break;
-						}
-					}
-				}
-			}
-		}
+	while ((child = (2 * root) + 1) < n) {
+		if (child + 1 < n &&
+		    fn(arg, ptr + child * size, ptr + (child + 1) * size) < 0)
+			child++;
+		if (fn(arg, ptr + root * size, ptr + child * size) >= 0)
+			break;
+		MppSortSwap(ptr + root * size, ptr + child * size, size);
+		root = child;
 	}
-	return (retval);
 }
 
+/*
+ * Sort using insertion sort for small arrays and heap sort for larger
+ * arrays, which is O(n log n) in the worst case and does not allocate
+ * any memory.
+ */
 Q_DECL_EXPORT void
-MppSort(void *ptr, size_t n, size_t size, MppCmp_t *fn, void *arg)
+MppSort(void *_ptr, size_t n, size_t size, MppCmp_t *fn, void *arg)
 {
-	size_t max;
+	uint8_t *ptr = (uint8_t *)_ptr;
+	size_t x;
+	size_t y;
 
 	if (n <= 1)
 		return;
 
-	for (max = 1; max < n; max <<= 1)
-		;
+	if (n <= MPP_SORT_INSERT_MAX) {
+		for (x = 1; x != n; x++) {
+			for (y = x; y != 0; y--) {
+				if (fn(arg, ptr + (y - 1) * size, ptr + y * size) <= 0)
+					break;
+				MppSortSwap(ptr + (y - 1) * size, ptr + y * size, size);
+			}
+		}
+		return;
+	}
 
-	while (MppSortXform(ptr, max, n, size, fn, arg))
-		;
+	for (x = n / 2; x-- != 0; )
+		MppSortSift(ptr, x, n, size, fn, arg);
+
+	for (x = n - 1; x != 0; x--) {
+		MppSortSwap(ptr, ptr + x * size, size);
+		MppSortSift(ptr, 0, x, size, fn, arg);
+	}
 }
 
+static int
+MppSortCompareInt(void *arg, const void *pa, const void *pb)
+{
+	const int a = *(const int *)pa;
+	const int b = *(const int *)pb;
+
+	return ((a > b) - (a < b));
+}
+
+/*
+ * Sort small integer arrays, like the keys of a chord, using the
+ * merge exchange sorting network from Knuth's TAOCP, Algorithm 5.2.2M,
+ * which works for any number of elements and has no data dependent
+ * branches.
+ */
 Q_DECL_EXPORT void
 MppSort(int *ptr, size_t num)
 {
-	size_t i, j;
-
-	for (i = 0; i != num; i++) {
-		for (j = i + 1; j != num; j++) {
-			if (ptr[i] > ptr[j]) {
-				int temp = ptr[i];
-				ptr[i] = ptr[j];
-				ptr[j] = temp;
+	size_t t;
+	size_t p;
+	size_t q;
+	size_t r;
+	size_t d;
+	size_t i;
+
+	if (num <= 1)
+		return;
+
+	if (num > MPP_SORT_NETWORK_MAX) {
+		MppSort(ptr, num, sizeof(ptr[0]), &MppSortCompareInt, 0);
+		return;
+	}
+
+	for (t = 1; ((size_t)1 << t) < num; t++)
+		;
+
+	for (p = (size_t)1 << (t - 1); p != 0; p /= 2) {
+		q = (size_t)1 << (t - 1);
+		r = 0;
+		d = p;
+
+		while (1) {
+			for (i = 0; i + d < num; i++) {
+				if ((i & p) == r) {
+					const int a = ptr[i];
+					const int b = ptr[i + d];
+
+					ptr[i] = (a < b) ? a : b;
+					ptr[i + d] = (a < b) ? b : a;
+				}
 			}
+			if (q == p)
+				break;
+			d = q - p;
+			q /= 2;
+			r = p;
 		}
 	}
 }
 
+/*
+ * Transpose the given keys by "ntrans" octaves, one key at a time,
+ * keeping the keys sorted. Only the key which moved needs to be
+ * inserted again.
+ */
 Q_DECL_EXPORT void
 MppTrans(int *ptr, size_t num, int ntrans)
 {
+	size_t x;
+	int key;
+
 	if (num == 0)
 		return;
 
@@ -384,13 +423,17 @@ MppTrans(int *ptr, size_t num, int ntrans)
 
 	if (ntrans < 0) {
 		while (ntrans++) {
-			ptr[num - 1] -= MPP_MAX_BANDS;
-			MppSort(ptr, num);
+			key = ptr[num - 1] - MPP_MAX_BANDS;
+			for (x = num - 1; x != 0 && ptr[x - 1] > key; x--)
+				ptr[x] = ptr[x - 1];
+			ptr[x] = key;
 		}
 	} else if (ntrans > 0) {
 		while (ntrans--) {
-			ptr[0] += MPP_MAX_BANDS;
-			MppSort(ptr, num);
+			key = ptr[0] + MPP_MAX_BANDS;
+			for (x = 0; x + 1 != num && ptr[x + 1] < key; x++)
+				ptr[x] = ptr[x + 1];
+			ptr[x] = key;
 		}
 	}
 }
@@ -59,6 +59,7 @@ exit(x); \
 #include <QWheelEvent>
 #include <QFile>
 #include <QFileDialog>
+#include <QSaveFile>
 #include <QLineEdit>
 #include <QSpacerItem>
 #include <QLCDNumber>
@@ -114,9 +115,9 @@ exit(x); \
 #define	MPP_MAX_BUTTON_MAP	16
 #define	MPP_MAX_VIEWS	2
 #define	MPP_MAX_TRACKS		(MPP_TRACKS_PER_VIEW * MPP_MAX_VIEWS)
-#define	MPP_MAX_LINES	8192
 #define	MPP_MAX_SCORES	32
 #define	MPP_MAX_LABELS	32
+#define	MPP_ELEMENT_SLAB 256	/* elements per allocation */
 #define	MPP_MAX_DEVS	8
 #define	MPP_MAX_BPM	32
 #define	MPP_MAX_LBUTTON	16
@@ -277,12 +278,15 @@ class MppDevices;
 class MppDevSel;
 class MppDevSelDiag;
 class MppElement;
+class MppEngine;
 class MppGPro;
 class MppGridLayout;
 class MppGroupBox;
 class MppHead;
 class MppImportTab;
 class MppInstrumentTab;
+class MppLoader;
+class MppLoaderJob;
 class MppLoopTab;
 class MppMainWindow;
 class MppMidi;
@@ -321,6 +325,21 @@ struct MppScoreEntry {
 	int8_t channelSec;
 };
 
+enum {
+	MPP_ROUTE_PLAY,
+	MPP_ROUTE_RECORD,
+	MPP_ROUTE_LOOP,
+};
+
+#define	MPP_ROUTE_MAX	(2 + MPP_LOOP_MAX)
+
+struct MppOutputRoute {
+	struct umidi20_track *track;
+	uint8_t type;
+	uint8_t loop;
+	uint8_t device_no;
+};
+
 struct MppInstr {
 	uint16_t bank;
 	uint8_t prog;
@@ -364,6 +383,11 @@ public:
 	int ndot;
 };
 
+struct MppVisualIndex {
+	int visual;
+	int dot;
+};
+
 class Mpp {
 public:
 	Mpp();
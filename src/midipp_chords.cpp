@@ -334,28 +334,31 @@ MppGetValue(const QString &str, int &off)
 Q_DECL_EXPORT void
 MppRolDownChord(MppChord_t &input, int &delta)
 {
+	int next;
+
 	if (input.test(0) == 0)
 		return;
-	input.tog(0);
-	input.tog(MPP_MAX_CHORD_BANDS);
 
-	while (input.test(0) == 0) {
-		input.shr();
-		delta++;
-	}
+	/* rotate down to the next key */
+	next = input.next_set(1);
+	if (next < 0)
+		next = MPP_MAX_CHORD_BANDS;
+	input.rotr(next);
+	delta += next;
 }
 
 Q_DECL_EXPORT void
 MppRolUpChord(MppChord_t &input, int &delta)
 {
+	int next;
+
 	if (input.test(0) == 0)
 		return;
-	while (input.test(MPP_MAX_CHORD_BANDS) == 0) {
-		input.shl();
-		delta++;
-	}
-	input.tog(0);
-	input.tog(MPP_MAX_CHORD_BANDS);
+
+	/* rotate the last key up to zero */
+	next = MPP_MAX_CHORD_BANDS - input.last_set();
+	input.rotl(next);
+	delta += next;
 }
 
 Q_DECL_EXPORT void
@@ -386,42 +389,36 @@ MppPrevChordRoot(MppChord_t &input, int step)
 		 MppFindChordRoot(input) != input);
 }
 
+/*
+ * The smallest rotation of a chord always has its lowest bit set,
+ * because the longest range of zeros must end up in the most
+ * significant bits. Only rotations starting at a set bit need to be
+ * compared.
+ */
 Q_DECL_EXPORT MppChord_t
 MppFindChordRoot(MppChord_t input, uint32_t *rots, uint32_t *steps)
 {
 	MppChord_t retval = input;
-	uint32_t tmprot = 0;
-	uint32_t tmpsteps = 0;
-	uint32_t sumbits = 0;
-
-	for (uint32_t x = 0; x != MPP_MAX_CHORD_BANDS; x++) {
-		if (input.test(x))
-			sumbits++;
-	}
+	MppChord_t temp;
+	uint32_t sumbits = input.order();
+	int x;
 
 	if (rots)
 		*rots = 0;
 	if (steps)
 		*steps = 0;
 
-	for (uint32_t x = 0; x != MPP_MAX_CHORD_BANDS; x++) {
-		if (input.test(0)) {
-			input.tog(0);
-			input.tog(MPP_MAX_CHORD_BANDS);
-			tmpsteps++;
-			tmpsteps %= sumbits;
-		}
-		input.shr();
-		tmprot++;
-		tmprot %= MPP_MAX_CHORD_BANDS;
-		if (input == retval)
+	for (x = input.next_set(1); x > 0; x = input.next_set(x + 1)) {
+		temp = input;
+		temp.rotr(x);
+		if (temp == input)
 			break;
-		if (input < retval) {
+		if (temp < retval) {
 			if (rots)
-				*rots = tmprot;
+				*rots = x;
 			if (steps)
-				*steps = tmpsteps;
-			retval = input;
+				*steps = input.order(x) % sumbits;
+			retval = temp;
 		}
 	}
 	return (retval);
@@ -480,91 +477,255 @@ MppExpandPattern12(const QString &pattern, QString &str)
 	}
 }
 
+/*
+ * The chord patterns are expanded into all possible suffixes and
+ * stored in a trie when the program starts, so that decoding a chord
+ * is a single pass over the string. Each suffix has a priority, which
+ * is the order in which the old pattern matcher would have tried it.
+ */
+struct MppChordTrie {
+	QChar ch;
+	uint16_t variant;
+	uint32_t priority;
+	int32_t child;
+	int32_t sibling;
+};
+
+#define	MPP_CHORD_TRIE_NONE 0xFFFFFFFFU
+
+static MppChordTrie *MppChordTrieNodes;
+static int32_t MppChordTrieCount;
+static int32_t MppChordTrieMax;
+
+#define	MPP_CHORD_ALT_MAX 8
+
+static QString MppChordSharp[MPP_CHORD_ALT_MAX];
+static QString MppChordFlat[MPP_CHORD_ALT_MAX];
+static const QString MppChordAdd = QString::fromUtf8("add");
+
 static bool
-MppScoreMatchPattern12(const QString &pattern, const QString &str, int &add, int t, int &u)
+MppStringMatchAt(const QString &str, int u, const QString &pat)
 {
-	while (1) {
-		if (t >= pattern.length()) {
-			/* check for add in the end */
-			if (str.indexOf("add", u) == u) {
-				const uint8_t map[14] = {
-					MPP_C0, MPP_D0, MPP_E0, MPP_F0, MPP_G0, MPP_A0, MPP_H0,
-					MPP_C0, MPP_D0, MPP_E0, MPP_F0, MPP_G0, MPP_A0, MPP_H0,
-				};
-
-				add = 0;
-				u += 3;
-				for (int x = 1; score_sharp[x]; x++) {
-					QString pat = QString::fromUtf8(score_sharp[x]);
-					if (str.indexOf(pat, u) != u)
-						continue;
-					u += pat.length();
-					add++;
-					goto add_num;
-				}
-				for (int x = 1; score_flat[x]; x++) {
-					QString pat = QString::fromUtf8(score_flat[x]);
-					if (str.indexOf(pat, u) != u)
-						continue;
-					u += pat.length();
-					add--;
-					goto add_num;
-				}
-			add_num:
-				if (u == str.length()) {
-					return (false);
-				} else if (u + 1 == str.length() || str[u + 1] == '/') {
-					if (str[u].isDigit() == 0 ||
-					    str[u].digitValue() == 0)
-						return (false);
-					add += map[str[u].digitValue() - 1];
-					u++;
-				} else if (u + 2 == str.length() || str[u + 2] == '/') {
-					if (str[u].isDigit() == 0 ||
-					    str[u].digitValue() != 1 ||
-					    str[u+1].isDigit() == 0 ||
-					    str[u+1].digitValue() > 4)
-						return (false);
-					add += map[10 + str[u+1].digitValue() - 1];
-					u += 2;
-				} else {
-					return (false);
-				}
-				add = (add + 12) % 12;
-			}
-			return (u == str.length() || str[u] == '/' || str[u] == '%');
-		} else if (pattern[t] == '$') {
-		  	int x;
-			int y;
-			for (x = 0; score_macros[x]; x++) {
-				if (score_macros[x][0][1] == pattern[t + 1])
-					break;
-			}
-			if (score_macros[x] == 0)
-				return (false);
-			for (y = 1; score_macros[x][y]; y++) {
-				QString temp = QString::fromUtf8(score_macros[x][y]);
-				if (str.indexOf(temp, u) == u) {
-					int nu = u + temp.length();
-					/* there might be more matches, need to recurse */
-					bool found = MppScoreMatchPattern12(
-					    pattern, str, add, t + 2, nu);
-					if (found) {
-						u = nu;
-						return (found);
-					}
-				}
-			}
+	if (pat.isEmpty() || pat.length() > str.length() - u)
+		return (false);
+	for (int x = 0; x != pat.length(); x++) {
+		if (str[u + x] != pat[x])
 			return (false);
-		} else if (u >= str.length()) {
+	}
+	return (true);
+}
+
+static int32_t
+MppChordTrieAlloc(QChar ch)
+{
+	MppChordTrie *pn;
+
+	if (MppChordTrieCount == MppChordTrieMax) {
+		MppChordTrieMax = MppChordTrieMax ? (2 * MppChordTrieMax) : 256;
+		MppChordTrieNodes = (MppChordTrie *)realloc(MppChordTrieNodes,
+		    sizeof(MppChordTrie) * MppChordTrieMax);
+		if (MppChordTrieNodes == 0)
+			errx(1, "Out of memory");
+	}
+	pn = &MppChordTrieNodes[MppChordTrieCount];
+	pn->ch = ch;
+	pn->variant = 0;
+	pn->priority = MPP_CHORD_TRIE_NONE;
+	pn->child = -1;
+	pn->sibling = -1;
+	return (MppChordTrieCount++);
+}
+
+static void
+MppChordTrieInsert(const QString &str, uint16_t variant, uint32_t priority)
+{
+	int32_t node = 0;
+	int32_t next;
+
+	for (int x = 0; x != str.length(); x++) {
+		for (next = MppChordTrieNodes[node].child; next != -1;
+		    next = MppChordTrieNodes[next].sibling) {
+			if (MppChordTrieNodes[next].ch == str[x])
+				break;
+		}
+		if (next == -1) {
+			next = MppChordTrieAlloc(str[x]);
+			MppChordTrieNodes[next].sibling = MppChordTrieNodes[node].child;
+			MppChordTrieNodes[node].child = next;
+		}
+		node = next;
+	}
+
+	/* keep the first pattern giving this suffix */
+	if (MppChordTrieNodes[node].priority == MPP_CHORD_TRIE_NONE) {
+		MppChordTrieNodes[node].variant = variant;
+		MppChordTrieNodes[node].priority = priority;
+	}
+}
+
+static void
+MppChordTrieExpand(const QString &pattern, int t, QString &prefix,
+    uint16_t variant, uint32_t &priority)
+{
+	int n = prefix.length();
+	int x;
+	int y;
+
+	if (t >= pattern.length()) {
+		MppChordTrieInsert(prefix, variant, priority++);
+	} else if (pattern[t] == '$') {
+		for (x = 0; score_macros[x]; x++) {
+			if (score_macros[x][0][1] == pattern[t + 1])
+				break;
+		}
+		if (score_macros[x] == 0)
+			return;
+		for (y = 1; score_macros[x][y]; y++) {
+			prefix += QString::fromUtf8(score_macros[x][y]);
+			MppChordTrieExpand(pattern, t + 2, prefix, variant, priority);
+			prefix.truncate(n);
+		}
+	} else {
+		prefix += pattern[t];
+		MppChordTrieExpand(pattern, t + 1, prefix, variant, priority);
+		prefix.truncate(n);
+	}
+}
+
+/*
+ * Hash table from chord root footprint to the variant having the
+ * shortest suffix, used when converting chords to strings.
+ */
+#define	MPP_CHORD_HASH_SIZE 1024	/* power of two */
+
+static int16_t MppChordHash[MPP_CHORD_HASH_SIZE];
+
+static uint32_t
+MppChordHashKey(const MppChord_t &mask)
+{
+	uint32_t retval = 0;
+
+	for (int x = 0; x != MPP_MAX_CHORD_BANDS / 32; x++)
+		retval = (retval ^ mask.data[x]) * 0x9E3779B1U;
+	return ((retval ^ (retval >> 16)) & (MPP_CHORD_HASH_SIZE - 1));
+}
+
+static int
+MppChordHashLookup(const MppChord_t &mask)
+{
+	uint32_t x = MppChordHashKey(mask);
+
+	while (MppChordHash[x] != -1) {
+		if (MppScoreVariants12[MppChordHash[x]].footprint[0] == mask)
+			return (MppChordHash[x]);
+		x = (x + 1) & (MPP_CHORD_HASH_SIZE - 1);
+	}
+	return (-1);
+}
+
+static void
+MppChordHashInit(void)
+{
+	const size_t num = sizeof(MppScoreVariants12) / sizeof(MppScoreVariants12[0]);
+
+	Q_STATIC_ASSERT(num < MPP_CHORD_HASH_SIZE / 2);
+
+	memset(MppChordHash, 255, sizeof(MppChordHash));
+
+	for (size_t z = 0; z != num; z++) {
+		const MppChord_t &mask = MppScoreVariants12[z].footprint[0];
+		uint32_t x = MppChordHashKey(mask);
+
+		while (MppChordHash[x] != -1) {
+			if (MppScoreVariants12[MppChordHash[x]].footprint[0] == mask)
+				break;
+			x = (x + 1) & (MPP_CHORD_HASH_SIZE - 1);
+		}
+		/* keep the first variant having the shortest suffix */
+		if (MppChordHash[x] == -1 ||
+		    strlen(MppScoreVariants12[z].pattern[0]) <
+		    strlen(MppScoreVariants12[MppChordHash[x]].pattern[0]))
+			MppChordHash[x] = z;
+	}
+}
+
+Q_DECL_EXPORT void
+MppChordTablesInit(void)
+{
+	uint32_t priority = 0;
+	QString prefix;
+	int x;
+
+	if (MppChordTrieCount != 0)
+		return;
+
+	MppChordHashInit();
+
+	for (x = 1; score_sharp[x] && x != MPP_CHORD_ALT_MAX; x++)
+		MppChordSharp[x - 1] = QString::fromUtf8(score_sharp[x]);
+	for (x = 1; score_flat[x] && x != MPP_CHORD_ALT_MAX; x++)
+		MppChordFlat[x - 1] = QString::fromUtf8(score_flat[x]);
+
+	/* root node */
+	MppChordTrieAlloc(QChar(0));
+
+	for (size_t v = 0; v != (sizeof(MppScoreVariants12) / sizeof(MppScoreVariants12[0])); v++) {
+		for (size_t z = 0; MppScoreVariants12[v].pattern[z]; z++) {
+			MppChordTrieExpand(QString::fromUtf8(MppScoreVariants12[v].pattern[z]),
+			    0, prefix, v, priority);
+		}
+	}
+}
+
+/* check what follows the chord suffix, like "add9", "/" or "%" */
+static bool
+MppScoreMatchTail(const QString &str, int &add, int &u)
+{
+	if (MppStringMatchAt(str, u, MppChordAdd)) {
+		const uint8_t map[14] = {
+			MPP_C0, MPP_D0, MPP_E0, MPP_F0, MPP_G0, MPP_A0, MPP_H0,
+			MPP_C0, MPP_D0, MPP_E0, MPP_F0, MPP_G0, MPP_A0, MPP_H0,
+		};
+
+		add = 0;
+		u += 3;
+		for (int x = 0; MppChordSharp[x].isEmpty() == false; x++) {
+			if (MppStringMatchAt(str, u, MppChordSharp[x]) == false)
+				continue;
+			u += MppChordSharp[x].length();
+			add++;
+			goto add_num;
+		}
+		for (int x = 0; MppChordFlat[x].isEmpty() == false; x++) {
+			if (MppStringMatchAt(str, u, MppChordFlat[x]) == false)
+				continue;
+			u += MppChordFlat[x].length();
+			add--;
+			goto add_num;
+		}
+	add_num:
+		if (u == str.length()) {
 			return (false);
-		} else if (pattern[t] == str[u]) {
-			t++;
+		} else if (u + 1 == str.length() || str[u + 1] == '/') {
+			if (str[u].isDigit() == 0 ||
+			    str[u].digitValue() == 0)
+				return (false);
+			add += map[str[u].digitValue() - 1];
 			u++;
+		} else if (u + 2 == str.length() || str[u + 2] == '/') {
+			if (str[u].isDigit() == 0 ||
+			    str[u].digitValue() != 1 ||
+			    str[u+1].isDigit() == 0 ||
+			    str[u+1].digitValue() > 4)
+				return (false);
+			add += map[10 + str[u+1].digitValue() - 1];
+			u += 2;
 		} else {
 			return (false);
 		}
+		add = (add + 12) % 12;
 	}
+	return (u == str.length() || str[u] == '/' || str[u] == '%');
 }
 
 static int
@@ -638,7 +799,13 @@ Q_DECL_EXPORT void
 MppStringToChordGeneric(MppChord_t &mask, uint32_t &rem, uint32_t &bass, uint32_t step, const QString &str)
 {
 	uint32_t diff;
+	uint32_t best;
+	uint16_t best_variant;
+	int32_t node;
+	int best_add;
+	int best_u;
 	int add;
+	int u;
 	int y;
 
 	if (str.isEmpty())
@@ -652,26 +819,51 @@ MppStringToChordGeneric(MppChord_t &mask, uint32_t &rem, uint32_t &bass, uint32_
 	mask.zero();
 	mask.set(0);
 
-	for (size_t x = 0; x != (sizeof(MppScoreVariants12) / sizeof(MppScoreVariants12[0])); x++) {
-	    for (size_t z = 0; MppScoreVariants12[x].pattern[z]; z++) {
-		QString pat = QString::fromUtf8(MppScoreVariants12[x].pattern[z]);
-		int nu = y;
-		add = -1;
-		if (MppScoreMatchPattern12(pat, str, add, 0, nu) == 0)
-			continue;
-		y = nu;
+	MppChordTablesInit();
+
+	/* find the best matching suffix along the path in the trie */
+	best = MPP_CHORD_TRIE_NONE;
+	best_add = -1;
+	best_u = y;
+	best_variant = 0;
+
+	for (node = 0, u = y; ; u++) {
+		const MppChordTrie *pn = &MppChordTrieNodes[node];
+
+		if (pn->priority < best) {
+			int nu = u;
+			add = -1;
+			if (MppScoreMatchTail(str, add, nu)) {
+				best = pn->priority;
+				best_add = add;
+				best_u = nu;
+				best_variant = pn->variant;
+			}
+		}
+		if (u >= str.length())
+			break;
+		for (node = pn->child; node != -1;
+		    node = MppChordTrieNodes[node].sibling) {
+			if (MppChordTrieNodes[node].ch == str[u])
+				break;
+		}
+		if (node == -1)
+			break;
+	}
+
+	if (best != MPP_CHORD_TRIE_NONE) {
+		const MppScoreVariant &var = MppScoreVariants12[best_variant];
+
+		y = best_u;
 		/* set mask */
-		mask = MppScoreVariants12[x].footprint[0];
+		mask = var.footprint[0];
 		/* check for add */
-		if (add > -1)
-			mask.set(add * (MPP_BAND_STEP_12 / MPP_BAND_STEP_CHORD));
+		if (best_add > -1)
+			mask.set(best_add * (MPP_BAND_STEP_12 / MPP_BAND_STEP_CHORD));
 		/* adjust for rotation */
-		rem = (rem +
-		    (MppScoreVariants12[x].rots[0] * MPP_BAND_STEP_CHORD)) % MPP_MAX_BANDS;
-		goto next;
-	    }
+		rem = (rem + (var.rots[0] * MPP_BAND_STEP_CHORD)) % MPP_MAX_BANDS;
 	}
-next:
+
 	while (y != str.length() && str[y] == '%') {
 		y++;
 		diff = MppStringDecodeNumeric(str, y);
@@ -707,8 +899,11 @@ MppChordToStringGeneric(MppChord_t mask, uint32_t rem, uint32_t bass, uint32_t s
 	uint32_t rots_min = MPP_MAX_CHORD_BANDS;
 	uint32_t add_min = 0;
 	size_t z = 0;
+	int x;
 
 	rem = rem % MPP_MAX_BANDS;
+
+	MppChordTablesInit();
 	bass = bass % MPP_MAX_BANDS;
 
 	/* check if conversion is valid */
@@ -728,16 +923,13 @@ MppChordToStringGeneric(MppChord_t mask, uint32_t rem, uint32_t bass, uint32_t s
 			mask.clr(add);
 
 		/* look for known chords, with shortest suffix */
-		for (size_t x = 0; x != (sizeof(MppScoreVariants12) / sizeof(MppScoreVariants12[0])); x++) {
-			if (MppScoreVariants12[x].footprint[0] != mask)
-				continue;
-			if ((rots_min == MPP_MAX_CHORD_BANDS) ||
-			    (strlen(MppScoreVariants12[x].pattern[0]) <
-			     strlen(MppScoreVariants12[z].pattern[0]))) {
-				rots_min = MppScoreVariants12[x].rots[0];
-				add_min = add;
-				z = x;
-			}
+		x = MppChordHashLookup(mask);
+		if (x > -1 && ((rots_min == MPP_MAX_CHORD_BANDS) ||
+		    (strlen(MppScoreVariants12[x].pattern[0]) <
+		     strlen(MppScoreVariants12[z].pattern[0])))) {
+			rots_min = MppScoreVariants12[x].rots[0];
+			add_min = add;
+			z = x;
 		}
 
 		if (add != 0)
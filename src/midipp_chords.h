@@ -37,12 +37,56 @@ struct MppChord {
 	bool test(size_t x) const { return ((data[x / 32] >> (x % 32)) & 1); };
 	uint32_t order() const {
 		uint32_t retval = 0;
-		for (int x = 0; x != MPP_MAX_CHORD_BANDS; x++) {
-			if (test(x))
-				retval++;
-		}
+		for (int x = 0; x != MPP_MAX_CHORD_BANDS / 32; x++)
+			retval += qPopulationCount(data[x]);
 		return (retval);
 	};
+	/* number of bits set below the given bit */
+	uint32_t order(uint32_t n) const {
+		uint32_t retval = 0;
+		for (uint32_t x = 0; x != n / 32; x++)
+			retval += qPopulationCount(data[x]);
+		if (n % 32)
+			retval += qPopulationCount(data[n / 32] & ((1U << (n % 32)) - 1U));
+		return (retval);
+	};
+	/* get first bit set at or after the given bit, else -1 */
+	int next_set(uint32_t n) const {
+		for (uint32_t x = n / 32; x < MPP_MAX_CHORD_BANDS / 32; x++) {
+			uint32_t temp = data[x];
+			if (x == n / 32)
+				temp &= -1U << (n % 32);
+			if (temp != 0)
+				return (x * 32 + qCountTrailingZeroBits(temp));
+		}
+		return (-1);
+	};
+	int first_set() const {
+		return (next_set(0));
+	};
+	/* rotate the MPP_MAX_CHORD_BANDS bits towards bit zero */
+	void rotr(uint32_t n) {
+		enum { MAX = MPP_MAX_CHORD_BANDS / 32 };
+		uint32_t temp[MAX];
+		uint32_t w;
+		uint32_t b;
+
+		n %= MPP_MAX_CHORD_BANDS;
+		if (n == 0)
+			return;
+		w = n / 32;
+		b = n % 32;
+		for (uint32_t x = 0; x != MAX; x++) {
+			temp[x] = data[(x + w) % MAX] >> b;
+			if (b != 0)
+				temp[x] |= data[(x + w + 1) % MAX] << (32 - b);
+		}
+		memcpy(data, temp, sizeof(temp));
+	};
+	/* rotate the MPP_MAX_CHORD_BANDS bits away from bit zero */
+	void rotl(uint32_t n) {
+		rotr(MPP_MAX_CHORD_BANDS - (n % MPP_MAX_CHORD_BANDS));
+	};
 	void inc(int step) {
 		int x;
 		int y = 0;
@@ -103,11 +147,11 @@ struct MppChord {
 			rem = next;
 		}
 	};
-	int last_set() {
-		int rem = MPP_MAX_CHORD_BANDS;
-		while (rem--) {
-			if (test(rem))
-				return (rem);
+	int last_set() const {
+		int x = MPP_MAX_CHORD_BANDS / 32;
+		while (x--) {
+			if (data[x] != 0)
+				return (x * 32 + 31 - qCountLeadingZeroBits(data[x]));
 		}
 		return (-1);
 	};
@@ -182,6 +226,7 @@ extern MppChord_t MppFindChordRoot(MppChord_t, uint32_t * = 0, uint32_t * = 0);
 extern int MppIsChord(QString &);
 
 extern void MppChordToStringGeneric(MppChord_t mask, uint32_t rem, uint32_t bass, uint32_t is_chord, uint32_t step, QString &retval);
+extern void MppChordTablesInit(void);
 extern void MppStringToChordGeneric(MppChord_t &mask, uint32_t &rem, uint32_t &bass, uint32_t step, const QString &str);
 extern const QString MppKeyToStringGeneric(int key, int sharp);
 extern void MppStepChordGeneric(QString &str, int adjust, uint32_t sharp);
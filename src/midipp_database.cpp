@@ -34,6 +34,21 @@
 #include "midipp_show.h"
 
 #define	MIDIPP_FILTER_MAX 32
+#define	MIDIPP_INDEX_MAGIC "MPPDBIX1"
+#define	MIDIPP_TRIGRAM_CHARS 37	/* other, 'a'..'z' and '0'..'9' */
+#define	MIDIPP_TRIGRAM_MAX \
+	(MIDIPP_TRIGRAM_CHARS * MIDIPP_TRIGRAM_CHARS * MIDIPP_TRIGRAM_CHARS)
+
+/*
+ * The database is stored as a TAR file which is memory mapped, and an
+ * index file, holding this header followed by the offset of each
+ * record in the TAR file, sorted by name.
+ */
+struct MppDataBaseIndex {
+	char magic[8];
+	uint64_t length;
+	uint64_t count;
+};
 
 struct filter {
 	const char *match_word[MIDIPP_FILTER_MAX];
@@ -161,6 +176,47 @@ tar_compare_r(void *arg, const void *_pa, const void *_pb)
 	return (strcmp((*pa)->header.name, (*pb)->header.name));
 }
 
+static int
+tar_trigram_char(char c)
+{
+	if (c >= 'a' && c <= 'z')
+		return (c - 'a' + 1);
+	else if (c >= '0' && c <= '9')
+		return (c - '0' + 27);
+	else
+		return (0);
+}
+
+static uint32_t
+tar_trigram(const char *str)
+{
+	return ((tar_trigram_char(str[0]) * MIDIPP_TRIGRAM_CHARS +
+	    tar_trigram_char(str[1])) * MIDIPP_TRIGRAM_CHARS +
+	    tar_trigram_char(str[2]));
+}
+
+/* intersect two sorted lists, storing the result in the first one */
+static uint64_t
+tar_intersect(uint32_t *pa, uint64_t na, const uint32_t *pb, uint64_t nb)
+{
+	uint64_t x = 0;
+	uint64_t y = 0;
+	uint64_t z = 0;
+
+	while (x != na && y != nb) {
+		if (pa[x] < pb[y]) {
+			x++;
+		} else if (pa[x] > pb[y]) {
+			y++;
+		} else {
+			pa[z++] = pa[x];
+			x++;
+			y++;
+		}
+	}
+	return (z);
+}
+
 /* Source: http://stackoverflow.com/questions/2690328/qt-quncompress-gzip-data */
 
 #define	CHUNK_SIZE 1024
@@ -249,12 +305,19 @@ MppDataBase :: MppDataBase(MppMainWindow *mw)
 {
 	parent = mw;
 
+	input_file = 0;
 	input_ptr = 0;
 	input_len = 0;
 
 	record_ptr = 0;
 	record_count = 0;
 
+	result_idx = 0;
+	result_count = 0;
+
+	index_start = 0;
+	index_data = 0;
+
 	gl = new QGridLayout(this);
 
 	location = new QLineEdit(QString(MPP_DEFAULT_URL));
@@ -314,16 +377,124 @@ MppDataBase :: MppDataBase(MppMainWindow *mw)
 
 MppDataBase :: ~MppDataBase()
 {
+	reset_index(true);
+	free(record_ptr);
+	unmap_file();
+}
+
+/*
+ * Must be called when the set of records changes. The records are
+ * kept sorted by name, so that search results are in the right order
+ * without sorting them again.
+ */
+void
+MppDataBase :: reset_index(bool sorted)
+{
+	struct filter filter;
+
+	free(index_start);
+	index_start = 0;
+	free(index_data);
+	index_data = 0;
+	free(result_idx);
+	result_idx = 0;
+	result_count = 0;
+
+	search_words.clear();
+
+	if (sorted == false && record_count != 0) {
+		memset(&filter, 0, sizeof(filter));
+		MppSort(record_ptr, record_count, sizeof(record_ptr[0]),
+		    &tar_compare_r, &filter);
+	}
+}
+
+/*
+ * Build a trigram index of the record names. For every trigram the
+ * sorted list of records containing it is stored in "index_data",
+ * starting at "index_start[trigram]".
+ */
+void
+MppDataBase :: build_index()
+{
+	uint32_t *plast;
+	uint32_t *ppos;
+	uint64_t x;
+	size_t y;
+	size_t len;
+	uint32_t k;
+
+	index_start = (uint32_t *)calloc(MIDIPP_TRIGRAM_MAX + 1, sizeof(uint32_t));
+	plast = (uint32_t *)malloc(MIDIPP_TRIGRAM_MAX * sizeof(uint32_t));
+	ppos = (uint32_t *)malloc(MIDIPP_TRIGRAM_MAX * sizeof(uint32_t));
+	if (index_start == NULL || plast == NULL || ppos == NULL)
+		goto error;
+
+	/* count the number of records for each trigram */
+	memset(plast, 255, MIDIPP_TRIGRAM_MAX * sizeof(uint32_t));
+
+	for (x = 0; x != record_count; x++) {
+		const char *name = record_ptr[x]->header.name;
+
+		len = strnlen(name, sizeof(record_ptr[x]->header.name));
+		for (y = 0; y + 3 <= len; y++) {
+			k = tar_trigram(name + y);
+			if (plast[k] == x)
+				continue;
+			plast[k] = x;
+			index_start[k + 1]++;
+		}
+	}
+
+	for (k = 0; k != MIDIPP_TRIGRAM_MAX; k++)
+		index_start[k + 1] += index_start[k];
+
+	index_data = (uint32_t *)malloc(
+	    (index_start[MIDIPP_TRIGRAM_MAX] + 1) * sizeof(uint32_t));
+	if (index_data == NULL)
+		goto error;
+
+	/* fill in the records for each trigram */
+	memset(plast, 255, MIDIPP_TRIGRAM_MAX * sizeof(uint32_t));
+	memcpy(ppos, index_start, MIDIPP_TRIGRAM_MAX * sizeof(uint32_t));
+
+	for (x = 0; x != record_count; x++) {
+		const char *name = record_ptr[x]->header.name;
+
+		len = strnlen(name, sizeof(record_ptr[x]->header.name));
+		for (y = 0; y + 3 <= len; y++) {
+			k = tar_trigram(name + y);
+			if (plast[k] == x)
+				continue;
+			plast[k] = x;
+			index_data[ppos[k]++] = x;
+		}
+	}
+	free(plast);
+	free(ppos);
+	return;
+error:
+	free(plast);
+	free(ppos);
+	free(index_start);
+	index_start = 0;
 }
 
 void
 MppDataBase :: update_list_view()
 {
 	struct filter filter;
+	QList<QByteArray> words;
 	char *filter_str;
 	char titlebuf[64];
+	uint32_t *pcand;
+	uint64_t ncand;
+	uint64_t n;
 	uint64_t x;
 	uint64_t y;
+	uint32_t k;
+	bool narrow;
+	bool any;
 
 	memset(&filter, 0, sizeof(filter));
 
@@ -345,17 +516,80 @@ MppDataBase :: update_list_view()
 			break;
 	}
 
-	if (record_count != 0) {
-		MppSort(record_ptr, record_count, sizeof(record_ptr[0]),
-		    &tar_compare_r, &filter);
+	for (x = 0; x != filter.match_count; x++)
+		words.append(QByteArray(filter.match_word[x]));
+
+	/*
+	 * If every previous search word is part of a new search word,
+	 * the new results are a subset of the previous results.
+	 */
+	narrow = (result_idx != 0 && search_words.isEmpty() == false);
+	for (x = 0; narrow && x != (uint64_t)search_words.size(); x++) {
+		for (y = 0; y != (uint64_t)words.size(); y++) {
+			if (words[y].contains(search_words[x]))
+				break;
+		}
+		if (y == (uint64_t)words.size())
+			narrow = false;
+	}
+
+	pcand = (uint32_t *)malloc(sizeof(uint32_t) * (record_count + 1));
+	ncand = 0;
+
+	if (pcand == NULL) {
+		/* out of memory */
+	} else if (narrow) {
+		memcpy(pcand, result_idx, sizeof(uint32_t) * result_count);
+		ncand = result_count;
+	} else {
+		if (filter.match_count != 0 && index_start == 0)
+			build_index();
+
+		/* intersect the records of all trigrams in the search words */
+		any = false;
+		for (x = 0; index_start != 0 && x != filter.match_count; x++) {
+			const char *word = filter.match_word[x];
+
+			for (y = 0; word[y] != 0 && word[y + 1] != 0 &&
+			    word[y + 2] != 0; y++) {
+				k = tar_trigram(word + y);
+				n = index_start[k + 1] - index_start[k];
+				if (any == false) {
+					memcpy(pcand, index_data + index_start[k],
+					    sizeof(uint32_t) * n);
+					ncand = n;
+					any = true;
+				} else {
+					ncand = tar_intersect(pcand, ncand,
+					    index_data + index_start[k], n);
+				}
+			}
+		}
+
+		/* short search words only, check all records */
+		if (any == false) {
+			for (x = 0; x != record_count; x++)
+				pcand[x] = x;
+			ncand = record_count;
+		}
 	}
 
+	/* the trigrams are only a hint, check the actual words */
+	for (x = y = 0; x != ncand; x++) {
+		if (tar_match(&filter, record_ptr[pcand[x]]->header.name))
+			pcand[y++] = pcand[x];
+	}
+
+	free(result_idx);
+	result_idx = pcand;
+	result_count = y;
+	search_words = words;
+
 	result->clear();
 
-	for (x = 0; x != record_count; x++) {
-		if (tar_match(&filter, record_ptr[x]->header.name) == 0)
-			break;
-		new QListWidgetItem(QString(record_ptr[x]->header.name), result);
+	for (x = 0; x != result_count; x++) {
+		new QListWidgetItem(
+		    QString(record_ptr[result_idx[x]]->header.name), result);
 	}
 
 	result->setCurrentRow(0);
@@ -371,7 +605,14 @@ MppDataBase :: update_list_view()
 void
 MppDataBase :: handle_open(union record *prec, MppScoreMain *ps)
 {
-	ps->handleScoreFileOpenRaw((char *)(prec + 1), tar_record_size(prec, 1));
+	uint64_t off = ((uint8_t *)(prec + 1)) - ((uint8_t *)input_ptr);
+	uint32_t size = tar_record_size(prec, 1);
+
+	/* the index is not trusted */
+	if (off > input_len || size > input_len - off)
+		return;
+
+	ps->handleScoreFileOpenRaw((char *)(prec + 1), size);
 }
 
 void
@@ -380,8 +621,8 @@ MppDataBase :: handle_open_a()
 	int n = result->currentRow();
 	MppScoreMain *sm = parent->scores_main[0];
 
-	if (n > -1 && n < (int)record_count)
-		handle_open(record_ptr[n], sm);
+	if (n > -1 && n < (int)result_count)
+		handle_open(record_ptr[result_idx[n]], sm);
 }
 
 void
@@ -390,8 +631,8 @@ MppDataBase :: handle_open_b()
 	int n = result->currentRow();
 	MppScoreMain *sm = parent->scores_main[1];
 
-	if (n > -1 && n < (int)record_count)
-		handle_open(record_ptr[n], sm);
+	if (n > -1 && n < (int)result_count)
+		handle_open(record_ptr[result_idx[n]], sm);
 }
 
 void
@@ -442,11 +683,171 @@ MppDataBase :: handle_download_progress(qint64 curr, qint64 total)
 	download->setText(tr("Download %1kb").arg((curr + 1023) / 1024));
 }
 
+void
+MppDataBase :: unmap_file()
+{
+	if (input_file == 0)
+		return;
+
+	/* closing the file also unmaps it */
+	input_file->close();
+	delete input_file;
+	input_file = 0;
+	input_ptr = 0;
+	input_len = 0;
+}
+
+/*
+ * Map the database saved by save_file() into memory. Returns false
+ * if the database file does not exist.
+ */
+bool
+MppDataBase :: load_file(const QString &name)
+{
+	struct MppDataBaseIndex hdr;
+	union record *prec;
+	QFile idx(name + QString(".idx"));
+	QFile *pf;
+	uint64_t *poff;
+	uchar *ptr;
+	uint64_t x;
+	bool sorted;
+
+	pf = new QFile(name + QString(".tar"));
+	if (pf->open(QIODevice::ReadOnly) == false || pf->size() == 0) {
+		delete pf;
+		return (false);
+	}
+	ptr = pf->map(0, pf->size());
+	if (ptr == 0) {
+		delete pf;
+		return (false);
+	}
+
+	free(record_ptr);
+	record_ptr = 0;
+	record_count = 0;
+
+	unmap_file();
+	input_data = QByteArray();
+
+	input_file = pf;
+	input_ptr = ptr;
+	input_len = pf->size();
+
+	/* try to use the index, if any */
+	if (idx.open(QIODevice::ReadOnly) &&
+	    idx.read((char *)&hdr, sizeof(hdr)) == sizeof(hdr) &&
+	    memcmp(hdr.magic, MIDIPP_INDEX_MAGIC, sizeof(hdr.magic)) == 0 &&
+	    hdr.length == input_len && hdr.count != 0 &&
+	    hdr.count <= input_len / RECORDSIZE) {
+		poff = (uint64_t *)malloc(sizeof(poff[0]) * hdr.count);
+		record_ptr = (union record **)malloc(sizeof(void *) * hdr.count);
+
+		if (poff != NULL && record_ptr != NULL &&
+		    idx.read((char *)poff, sizeof(poff[0]) * hdr.count) ==
+		    (qint64)(sizeof(poff[0]) * hdr.count)) {
+			for (x = 0; x != hdr.count; x++) {
+				if (poff[x] > input_len - RECORDSIZE)
+					break;
+				record_ptr[x] = (union record *)
+				    (((uint8_t *)input_ptr) + poff[x]);
+			}
+			if (x == hdr.count)
+				record_count = x;
+		}
+		free(poff);
+
+		if (record_count == 0) {
+			free(record_ptr);
+			record_ptr = 0;
+		}
+	}
+
+	sorted = (record_count != 0);
+
+	/* else scan the records, which are already filtered */
+	if (record_count == 0) {
+		prec = NULL;
+		while (tar_record_foreach(&prec))
+			record_count++;
+
+		if (record_count != 0) {
+			record_ptr = (union record **)malloc(sizeof(void *) * record_count);
+			if (record_ptr != NULL) {
+				prec = NULL;
+				record_count = 0;
+				while (tar_record_foreach(&prec))
+					record_ptr[record_count++] = prec;
+			} else {
+				record_count = 0;
+			}
+		}
+	}
+	reset_index(sorted);
+	update_list_view();
+
+	return (true);
+}
+
+/*
+ * Store the current database and its index, so that it can be
+ * memory mapped by load_file().
+ */
+void
+MppDataBase :: save_file(const QString &name)
+{
+	struct MppDataBaseIndex hdr;
+	uint64_t off;
+	uint64_t x;
+
+	/* check if the database is already stored there */
+	if (input_file != 0 &&
+	    input_file->fileName() == name + QString(".tar"))
+		return;
+
+	if (input_len == 0 || record_count == 0) {
+		QFile::remove(name + QString(".tar"));
+		QFile::remove(name + QString(".idx"));
+		return;
+	}
+
+	QDir().mkpath(QFileInfo(name).absolutePath());
+	QFile::remove(name + QString(".idx"));
+
+	QSaveFile tar(name + QString(".tar"));
+	QSaveFile idx(name + QString(".idx"));
+
+	if (tar.open(QIODevice::WriteOnly) == false ||
+	    tar.write((const char *)input_ptr, input_len) != (qint64)input_len ||
+	    tar.commit() == false)
+		return;
+
+	/* the records are sorted by name, see reset_index() */
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MIDIPP_INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.length = input_len;
+	hdr.count = record_count;
+
+	if (idx.open(QIODevice::WriteOnly) &&
+	    idx.write((const char *)&hdr, sizeof(hdr)) == sizeof(hdr)) {
+		for (x = 0; x != record_count; x++) {
+			off = ((uint8_t *)record_ptr[x]) - ((uint8_t *)input_ptr);
+			if (idx.write((const char *)&off, sizeof(off)) != sizeof(off))
+				break;
+		}
+		if (x == record_count)
+			idx.commit();
+	}
+}
+
 void
 MppDataBase :: handle_download_finished_sub()
 {
 	union record *prec;
 
+	unmap_file();
+
 	input_len = input_data.size();
 	input_ptr = input_data.data();
 
@@ -496,6 +897,7 @@ MppDataBase :: handle_download_finished_sub()
 			}
 		}
 	}
+	reset_index(false);
 	update_list_view();
 }
 
@@ -43,15 +43,31 @@ public:
 	void handle_open(union record *, MppScoreMain *);
 	void handle_download_finished_sub();
 
+	void reset_index(bool);
+	void build_index();
+
+	bool load_file(const QString &);
+	void save_file(const QString &);
+	void unmap_file();
+
 	void update_list_view();
 
 	QByteArray input_data;
+	QFile *input_file;
 	void *input_ptr;
 	uint64_t input_len;
 
 	union record **record_ptr;
 	uint64_t record_count;
 
+	uint32_t *result_idx;
+	uint64_t result_count;
+
+	uint32_t *index_start;
+	uint32_t *index_data;
+
+	QList<QByteArray> search_words;
+
 	MppMainWindow *parent;
 
 	QGridLayout *gl;
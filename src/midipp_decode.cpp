@@ -117,6 +117,9 @@ MppScoreVariantInit(void)
 	uint32_t y;
 	uint32_t z;
 
+	/* compile the chord patterns */
+	MppChordTablesInit();
+
 	Mpp.VariantList += QString("\n/* Unique chords having two keys */\n\n");
 
 	for (z = 0, x = MPP_BAND_STEP_12; x != MPP_MAX_BANDS; x += MPP_BAND_STEP_12) {
@@ -208,14 +211,7 @@ MppCommonKeys(const MppChord_t & pa, const MppChord_t & pb, int a_key, int b_key
 	int key = ((12 + a_key - b_key) % 12) *
 	    (MPP_BAND_STEP_12 / MPP_BAND_STEP_CHORD);
 
-	while (key--) {
-		if (temp.test(0)) {
-			temp.tog(0);
-			temp.tog(MPP_MAX_CHORD_BANDS);
-		}
-		temp.shr();
-	}
-
+	temp.rotr(key);
 	temp &= pa;
 	return (temp.order());
 }
@@ -419,10 +415,10 @@ MppDecodeTab :: parseScoreChord(MppChordElement *pinfo)
 	if (!any)
 		return (1);	/* not found */
 
-	while (footprint.test(0) == 0) {
-		footprint.shr();
-		key += MPP_BAND_STEP_CHORD;
-	}
+	/* rotate lowest key down to zero */
+	key = footprint.first_set();
+	footprint.rotr(key);
+	key *= MPP_BAND_STEP_CHORD;
 
 	bass = MPP_BAND_REM(pinfo->key_base, MPP_MAX_BANDS);
 
@@ -657,6 +653,41 @@ MppDecodeTab :: handle_play_release()
 	mw->atomic_unlock();
 }
 
+/*
+ * Render the line holding "elem", with the chord element replaced by
+ * "chord_txt" and the scores from "start" up to "stop" replaced by
+ * "score_txt". The elements themselves are left untouched.
+ */
+static QString
+MppDecodeRenderLine(const MppElement *elem, const MppChordElement *pinfo,
+    const QString &chord_txt, const QString &score_txt)
+{
+	const MppElement *ptr;
+	QString retval;
+	int line = elem->line;
+
+	/* find the first element of the line */
+	while ((ptr = TAILQ_PREV(elem, MppElementHead, entry)) != 0 &&
+	    ptr->line == line)
+		elem = ptr;
+
+	for (ptr = elem; ptr != 0 && ptr->line == line; ) {
+		if (ptr == pinfo->start) {
+			retval += score_txt;
+			do {
+				ptr = TAILQ_NEXT(ptr, entry);
+			} while (ptr != 0 && ptr != pinfo->stop && ptr->line == line);
+			continue;
+		} else if (ptr == pinfo->chord) {
+			retval += chord_txt;
+		} else {
+			retval += ptr->txt;
+		}
+		ptr = TAILQ_NEXT(ptr, entry);
+	}
+	return (retval.replace("\n", ""));
+}
+
 void
 MppDecodeTab :: handle_insert()
 {
@@ -665,45 +696,53 @@ MppDecodeTab :: handle_insert()
 		return;
 
 	QTextCursor cursor(qedit->textCursor());
+	MppScoreMain *sm = mw->currScores();
 	MppChordElement info;
-	MppElement *ptr;
 	MppHead temp;
+	MppHead *phead;
+	QString chord_txt;
+	QString score_txt;
 	int row;
 
-	temp += qedit->toPlainText();
-	temp.flush();
+	if (sm != 0 && sm->editWidget == qedit) {
+		/* make sure the compiled scores are up to date */
+		sm->handleCompile();
+		phead = &sm->head;
+	} else {
+		/* the import and help editors are not compiled */
+		temp += qedit->toPlainText();
+		temp.flush();
+		phead = &temp;
+	}
 
 	row = cursor.blockNumber();
 
 	cursor.beginEditBlock();
 
-	/* check if the chord is valid */
-	if (temp.getChord(row, &info) != 0) {
-		if (info.chord != 0) {
-			info.chord->txt = QChar('(') + lin_edit->text().trimmed() + QChar(')');
+	/*
+	 * Only the GUI thread modifies the elements, so the line
+	 * index can be used without locking. The new lines are
+	 * rendered aside and compiled by the final handle_compile():
+	 */
+	if (phead->getChord(row, &info) != 0) {
+		chord_txt = QChar('(') + lin_edit->text().trimmed() + QChar(')');
+		score_txt = getText();
 
+		if (info.chord != 0) {
 			cursor.movePosition(QTextCursor::Start, QTextCursor::MoveAnchor, 1);
 			cursor.movePosition(QTextCursor::Down, QTextCursor::MoveAnchor, info.chord->line);
 			cursor.movePosition(QTextCursor::EndOfLine, QTextCursor::MoveAnchor, 1);
 			cursor.movePosition(QTextCursor::StartOfLine, QTextCursor::KeepAnchor, 1);
 			cursor.removeSelectedText();
-			cursor.insertText(temp.toPlain(info.chord->line).replace("\n", ""));
+			cursor.insertText(MppDecodeRenderLine(info.chord, &info, chord_txt, score_txt));
 		}
 		if (info.start != 0) {
-			for (ptr = info.start; ptr != info.stop;
-			    ptr = TAILQ_NEXT(ptr, entry)) {
-				ptr->type = MPP_T_UNKNOWN;
-				ptr->txt = "";
-			}
-
-			info.start->txt = getText();
-
 			cursor.movePosition(QTextCursor::Start, QTextCursor::MoveAnchor, 1);
 			cursor.movePosition(QTextCursor::Down, QTextCursor::MoveAnchor, row);
 			cursor.movePosition(QTextCursor::EndOfLine, QTextCursor::MoveAnchor, 1);
 			cursor.movePosition(QTextCursor::StartOfLine, QTextCursor::KeepAnchor, 1);
 			cursor.removeSelectedText();
-			cursor.insertText(temp.toPlain(info.start->line).replace("\n", ""));
+			cursor.insertText(MppDecodeRenderLine(info.start, &info, chord_txt, score_txt));
 		}
 	} else {
 		cursor.removeSelectedText();
@@ -1144,10 +1183,27 @@ MppDecodeTab :: handle_sustain_pedal(int level)
 	}
 }
 
+/*
+ * Look up the chord of the given line. The scratch text is only
+ * parsed again when it has changed since the last lookup.
+ */
+int
+MppDecodeEditor :: getChord(int row, MppChordElement *pinfo)
+{
+	QString str = toPlainText();
+
+	if (str != text) {
+		head.clear();
+		head += str;
+		head.flush();
+		text = str;
+	}
+	return (head.getChord(row, pinfo));
+}
+
 void
 MppDecodeEditor :: mouseDoubleClickEvent(QMouseEvent *e)
 {
-	MppHead temp;
 	MppChordElement info;
 	QTextCursor cursor(textCursor());
 	int row;
@@ -1161,11 +1217,8 @@ MppDecodeEditor :: mouseDoubleClickEvent(QMouseEvent *e)
 
 	row = cursor.blockNumber();
 
-	temp += toPlainText();
-	temp.flush();
-
 	/* check if the chord is valid */
-	if (temp.getChord(row, &info) != 0)
+	if (getChord(row, &info) != 0)
 		mw->tab_chord_gl->parseScoreChord(&info);
 
 	setTextCursor(cursor);
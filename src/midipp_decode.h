@@ -27,6 +27,7 @@
 #define	_MIDIPP_DECODE_H_
 
 #include "midipp_chords.h"
+#include "midipp_element.h"
 
 class MppDecodeEditor : public QPlainTextEdit
 {
@@ -35,6 +36,10 @@ public:
 	~MppDecodeEditor() {};
 
 	MppMainWindow *mw;
+	MppHead head;
+	QString text;	/* text parsed into "head" */
+
+	int getChord(int, MppChordElement *);
 	void mouseDoubleClickEvent(QMouseEvent *);
 };
 
@@ -67,6 +67,71 @@ MppDeQuoteString(QString &str)
 	return (str);
 }
 
+/*
+ * Elements are allocated from slabs of MPP_ELEMENT_SLAB entries, which
+ * are kept on a free list, because a score typically consists of many
+ * small elements which are all freed and re-allocated at every
+ * compile. Slabs are never returned to the system. Only the GUI thread
+ * allocates and frees elements, so the pool needs no locking.
+ * MppHead::clear() moves its whole list to the "dead" list in constant
+ * time, and the destructor of a dead element runs when its memory is
+ * reused.
+ */
+static void *MppElementPoolFree;
+static MppElementHeadT MppElementPoolDead =
+    TAILQ_HEAD_INITIALIZER(MppElementPoolDead);
+
+void *
+MppElement :: operator new(size_t size)
+{
+	MppElement *elem;
+	void *ptr;
+	size_t x;
+
+	if (size != sizeof(MppElement))
+		return (::operator new(size));
+
+	if (MppElementPoolFree == 0) {
+		uint8_t *pslab;
+
+		elem = TAILQ_FIRST(&MppElementPoolDead);
+		if (elem != 0) {
+			TAILQ_REMOVE(&MppElementPoolDead, elem, entry);
+			elem->~MppElement();
+			return (elem);
+		}
+
+		pslab = (uint8_t *)malloc(sizeof(MppElement) * MPP_ELEMENT_SLAB);
+		if (pslab == 0)
+			return (::operator new(size));
+
+		for (x = 0; x != MPP_ELEMENT_SLAB; x++) {
+			ptr = pslab + (x * sizeof(MppElement));
+			*(void **)ptr = MppElementPoolFree;
+			MppElementPoolFree = ptr;
+		}
+	}
+	ptr = MppElementPoolFree;
+	MppElementPoolFree = *(void **)ptr;
+
+	return (ptr);
+}
+
+void
+MppElement :: operator delete(void *ptr, size_t size)
+{
+	if (ptr == 0)
+		return;
+
+	if (size != sizeof(MppElement)) {
+		::operator delete(ptr);
+		return;
+	}
+
+	*(void **)ptr = MppElementPoolFree;
+	MppElementPoolFree = ptr;
+}
+
 MppElement :: MppElement(MppElementType _type, int _line,
     int v0, int v1, int v2, int v3)
 {
@@ -74,6 +139,7 @@ MppElement :: MppElement(MppElementType _type, int _line,
 	type = _type;
 	line = _line;
 	sequence = 0;
+	compiled = 0;
 	value[0] = v0;
 	value[1] = v1;
 	value[2] = v2;
@@ -139,6 +205,10 @@ MppElement :: getIntValue(int *poffset) const
 MppHead :: MppHead()
 {
 	TAILQ_INIT(&head);
+	compiled = 0;
+	compiled_max = 0;
+	line_index = 0;
+	line_index_max = 0;
 	last = ' ';
 	memset(&state, 0, sizeof(state));
 	state.text_curr.reset();
@@ -152,12 +222,16 @@ MppHead :: ~MppHead()
 void
 MppHead :: clear()
 {
-	MppElement *elem;
+	/* the elements are destroyed when their memory is reused */
+	TAILQ_CONCAT(&MppElementPoolDead, &head, entry);
 
-	while ((elem = TAILQ_FIRST(&head)) != 0) {
-		TAILQ_REMOVE(&head, elem, entry);
-		delete elem;
-	}
+	delete [] compiled;
+	compiled = 0;
+	compiled_max = 0;
+
+	delete [] line_index;
+	line_index = 0;
+	line_index_max = 0;
 
 	reset();
 }
@@ -165,13 +239,21 @@ MppHead :: clear()
 void
 MppHead :: reset()
 {
-	MppElement *elem;
-
 	delete (state.elem);
 	last = ' ';
 	memset(&state, 0, sizeof(state));
 	state.text_curr.reset();
 
+	updateLabels();
+}
+
+void
+MppHead :: updateLabels()
+{
+	MppElement *elem;
+
+	memset(state.label_start, 0, sizeof(state.label_start));
+
 	TAILQ_FOREACH(elem, &head, entry) {
 		switch (elem->type) {
 		case MPP_T_LABEL:
@@ -205,6 +287,9 @@ MppHead :: operator += (MppElement *elem)
 	if (elem == 0)
 		return;
 
+	if (elem == state.txt_elem)
+		flushText();
+
 	off = 1;
 
 	switch (elem->type) {
@@ -407,8 +492,29 @@ MppHead :: operator += (const QString &str)
 {
 	int x;
 
-	for (x = 0; x != str.size(); x++)
+	/* the text of the elements is copied from "str" in slices */
+	state.src = &str;
+	for (x = 0; x != str.size(); x++) {
+		state.src_pos = x;
 		*this += str[x];
+	}
+	flushText();
+	state.src = 0;
+}
+
+/*
+ * Append the pending slice of the text being added to the element
+ * owning it, if any.
+ */
+void
+MppHead :: flushText()
+{
+	if (state.txt_elem == 0)
+		return;
+
+	state.txt_elem->txt += state.src->mid(state.txt_start,
+	    state.txt_end - state.txt_start);
+	state.txt_elem = 0;
 }
 
 void
@@ -564,7 +670,18 @@ MppHead :: operator += (QChar ch)
 		else if (ch == ')' || ch == ']')
 			state.level --;
 	}
-	state.elem->txt += ch;
+	if (state.src != 0 && state.src->at(state.src_pos) == ch) {
+		/* extend the pending slice */
+		if (state.txt_elem != state.elem) {
+			flushText();
+			state.txt_elem = state.elem;
+			state.txt_start = state.src_pos;
+		}
+		state.txt_end = state.src_pos + 1;
+	} else {
+		flushText();
+		state.elem->txt += ch;
+	}
 	last = ch;
 	if (ch == '\n')
 		state.line++;
@@ -635,15 +752,309 @@ MppHead :: replace(MppHead *phead, MppElement *start, MppElement *stop)
 	reset();
 }
 
+static bool
+MppIsCompiled(const MppElement *elem)
+{
+	switch (elem->type) {
+	case MPP_T_CHANNEL:
+	case MPP_T_DURATION:
+	case MPP_T_MACRO:
+	case MPP_T_SCORE_SUBDIV:
+	case MPP_T_TIMER:
+	case MPP_T_TRANSPOSE:
+		return (true);
+	default:
+		return (false);
+	}
+}
+
+static bool
+MppIsLineEnd(const MppElement *ptr)
+{
+	return (ptr->type == MPP_T_NEWLINE &&
+	    ptr->txt.size() == 1 && ptr->txt[0] == '\n');
+}
+
+/*
+ * Prepare replacing the elements belonging to the lines "first" up
+ * to, but not including, "first + num" by the elements of "phead",
+ * which must be parsed from complete lines of text. If "num" is
+ * negative, all lines from "first" and onwards are replaced. The new
+ * elements are numbered and the resulting table of operations is
+ * built in "phead", so that replaceLines() only needs to move the
+ * elements. Only the GUI thread modifies the elements, so this
+ * function is called unlocked. Returns zero on success. Else the
+ * caller must re-parse the whole text.
+ */
 int
-MppHead :: getChord(int line, MppChordElement *pinfo)
+MppHead :: prepareLines(int first, int num, MppHead *phead,
+    MppElement **ppstart, MppElement **ppstop)
 {
-	MppElement *ptr;
 	MppElement *start;
 	MppElement *stop;
-	MppElement *string_start = 0;
-	MppElement *string_stop = 0;
-	int counter = 0;
+	MppElement *prev;
+	MppElement *ptr;
+	int seq;
+	int op;
+	int x;
+	int y;
+
+	/* locate range of elements to replace */
+	for (start = TAILQ_FIRST(&head); start != 0 &&
+	     start->line < first; start = start->next())
+		;
+	for (stop = start; stop != 0 && (num < 0 ||
+	     stop->line < first + num); stop = stop->next())
+		;
+
+	/* an element must not span into the range, like a comment */
+	if (start != 0)
+		prev = TAILQ_PREV(start, MppElementHead, entry);
+	else
+		prev = TAILQ_LAST(&head, MppElementHead);
+	if (prev != 0 && MppIsLineEnd(prev) == false)
+		return (-1);
+
+	/* an element must not span out of the range */
+	if (stop != 0) {
+		ptr = TAILQ_PREV(stop, MppElementHead, entry);
+		if (ptr != 0 && ptr != prev && MppIsLineEnd(ptr) == false)
+			return (-1);
+	}
+
+	/* commands have global effects */
+	for (ptr = start; ptr != stop; ptr = ptr->next()) {
+		if (ptr->type == MPP_T_COMMAND)
+			return (-1);
+	}
+	TAILQ_FOREACH(ptr, &phead->head, entry) {
+		if (ptr->type == MPP_T_COMMAND)
+			return (-1);
+	}
+
+	/* adjust line numbers */
+	TAILQ_FOREACH(ptr, &phead->head, entry)
+		ptr->line += first;
+
+	/* number the new elements, like sequence() does */
+	if (start != 0) {
+		seq = start->sequence;
+		op = start->compiled;
+	} else if (prev != 0) {
+		seq = prev->sequence + 1;
+		op = compiled_max;
+	} else {
+		seq = 0;
+		op = 0;
+	}
+
+	x = op;
+	TAILQ_FOREACH(ptr, &phead->head, entry) {
+		ptr->sequence = seq++;
+		ptr->compiled = op;
+		if (MppIsCompiled(ptr))
+			op++;
+	}
+
+	/* build the new table of operations */
+	y = stop ? stop->compiled : compiled_max;
+
+	delete [] phead->compiled;
+	phead->compiled = 0;
+	phead->compiled_max = op + (compiled_max - y);
+
+	if (phead->compiled_max != 0) {
+		phead->compiled = new MppCompiledOp [phead->compiled_max];
+
+		memcpy(phead->compiled, compiled, sizeof(compiled[0]) * x);
+
+		TAILQ_FOREACH(ptr, &phead->head, entry) {
+			if (MppIsCompiled(ptr) == false)
+				continue;
+			phead->compiled[x].type = ptr->type;
+			phead->compiled[x].value[0] = ptr->value[0];
+			phead->compiled[x].value[1] = ptr->value[1];
+			x++;
+		}
+
+		memcpy(phead->compiled + x, compiled + y,
+		    sizeof(compiled[0]) * (compiled_max - y));
+	}
+
+	*ppstart = start;
+	*ppstop = stop;
+
+	return (0);
+}
+
+/*
+ * Replace the elements from "start" up to "stop", as located by
+ * prepareLines(), by the elements of "phead", which were parsed from
+ * "lines" complete lines of text. The play position is kept, unless
+ * it points into the replaced lines. The old elements and table of
+ * operations are left in "phead", so that they can be freed after the
+ * lock is dropped. Must be called locked.
+ */
+void
+MppHead :: replaceLines(int first, int num, int lines, MppHead *phead,
+    MppElement *start, MppElement *stop)
+{
+	MppElement **pp[] = {
+		&state.curr_start, &state.curr_stop,
+		&state.last_start, &state.last_stop,
+		&state.push_start, &state.push_stop,
+	};
+	MppCompiledOp *pop;
+	MppElement *ptr;
+	MppElement *repl;
+	int dseq = 0;
+	int dop;
+	int max;
+	size_t x;
+
+	/* move play position out of the range, if any */
+	repl = TAILQ_FIRST(&phead->head);
+	if (repl == 0)
+		repl = stop;
+
+	for (ptr = start; ptr != stop; ptr = ptr->next()) {
+		for (x = 0; x != sizeof(pp) / sizeof(pp[0]); x++) {
+			if (*pp[x] == ptr)
+				*pp[x] = repl;
+		}
+	}
+
+	/* insert new elements */
+	while ((ptr = TAILQ_FIRST(&phead->head)) != 0) {
+		TAILQ_REMOVE(&phead->head, ptr, entry);
+		if (stop != 0)
+			TAILQ_INSERT_BEFORE(stop, ptr, entry);
+		else
+			TAILQ_INSERT_TAIL(&head, ptr, entry);
+		dseq++;
+	}
+
+	/* move old elements into "phead", which is freed by the caller */
+	while (start != stop) {
+		ptr = start->next();
+		TAILQ_REMOVE(&head, start, entry);
+		TAILQ_INSERT_TAIL(&phead->head, start, entry);
+		start = ptr;
+		dseq--;
+	}
+
+	/* renumber the following elements */
+	dop = phead->compiled_max - compiled_max;
+
+	if (num > -1) {
+		for (ptr = stop; ptr != 0; ptr = ptr->next()) {
+			ptr->line += lines - num;
+			ptr->sequence += dseq;
+			ptr->compiled += dop;
+		}
+		state.line += lines - num;
+	} else {
+		state.line = first + phead->state.line;
+	}
+
+	/* exchange the table of operations */
+	pop = compiled;
+	compiled = phead->compiled;
+	phead->compiled = pop;
+
+	max = compiled_max;
+	compiled_max = phead->compiled_max;
+	phead->compiled_max = max;
+
+	/* the line index is rebuilt on demand by getChord() */
+	delete [] line_index;
+	line_index = 0;
+	line_index_max = 0;
+
+	updateLabels();
+}
+
+/*
+ * Returns the first line segment having scores at or after the given
+ * line, as found in the line index, or NULL if there is none.
+ */
+MppElement *
+MppHead :: lineStart(int line)
+{
+	if (line < 0)
+		line = 0;
+	for (; line < line_index_max; line++) {
+		if (line_index[line].start != 0)
+			return (line_index[line].start);
+	}
+	return (0);
+}
+
+/*
+ * Exchange the elements of this head with the ones from "phead" and
+ * remap the play position by line number, using the line index of the
+ * new elements. The table of operations and the line index must
+ * already be built in "phead" by sequence(). The old elements are left
+ * in "phead", so that they can be freed after the lock is dropped.
+ */
+void
+MppHead :: publish(MppHead *phead)
+{
+	MppElementHeadT temp;
+	MppCompiledOp *pop;
+	MppLineIndex *pindex;
+	int curr;
+	int push;
+	int line;
+
+	curr = state.curr_start ? state.curr_start->line : -1;
+	push = state.push_start ? state.push_start->line : -1;
+
+	/* exchange the lists, which takes constant time */
+	TAILQ_INIT(&temp);
+	TAILQ_CONCAT(&temp, &head, entry);
+	TAILQ_CONCAT(&head, &phead->head, entry);
+	TAILQ_CONCAT(&phead->head, &temp, entry);
+
+	/* keep the line count and compiled operations of the new elements */
+	line = state.line;
+	state.line = phead->state.line;
+	phead->state.line = line;
+
+	pop = compiled;
+	compiled = phead->compiled;
+	phead->compiled = pop;
+
+	line = compiled_max;
+	compiled_max = phead->compiled_max;
+	phead->compiled_max = line;
+
+	pindex = line_index;
+	line_index = phead->line_index;
+	phead->line_index = pindex;
+
+	line = line_index_max;
+	line_index_max = phead->line_index_max;
+	phead->line_index_max = line;
+
+	if (curr < 0)
+		state.curr_start = state.curr_stop = 0;
+	else
+		state.curr_start = state.curr_stop = lineStart(curr);
+
+	if (push < 0)
+		state.push_start = state.push_stop = 0;
+	else
+		state.push_start = state.push_stop = lineStart(push);
+
+	syncLast();
+	updateLabels();
+}
+
+int
+MppHead :: getChord(int line, MppChordElement *pinfo)
+{
+	MppElement *ptr;
 	int x;
 	int y;
 
@@ -651,14 +1062,87 @@ MppHead :: getChord(int line, MppChordElement *pinfo)
 	memset(pinfo, 0, sizeof(*pinfo));
 	pinfo->key_max = MPP_KEY_MIN;
 
+	if (line_index == 0)
+		indexLines();
+
+	if (line < 0 || line >= line_index_max ||
+	    line_index[line].start == 0)
+		return (0);
+
+	pinfo->chord = line_index[line].chord;
+	pinfo->start = line_index[line].start;
+	pinfo->stop = line_index[line].stop;
+
+	/* compute chord profile */
+	for (ptr = pinfo->start; ptr != pinfo->stop; ptr = ptr->next()) {
+		if (ptr->type == MPP_T_SCORE_SUBDIV) {
+			int key = ptr->value[0];
+			if (key > pinfo->key_max)
+				pinfo->key_max = key;
+			pinfo->stats[MPP_BAND_REM(key, MPP_MAX_CHORD_BANDS)]++;
+		}
+	}
+
+	for (x = y = 0; x != MPP_MAX_CHORD_BANDS; x++) {
+		if (pinfo->stats[x] > pinfo->stats[y])
+			y = x;
+	}
+
+	/*
+	 * The key having the most hits typically is
+	 * the base:
+	 */
+	pinfo->key_base = y * MPP_BAND_STEP_CHORD;
+
+	/* valid chord/score found */
+	return (1);
+}
+
+/*
+ * Build a table of the first line segment having scores for every
+ * line, and the chord in the closest string line before it which
+ * belongs to the scores. The N-th line having scores after a string
+ * line is associated with the N-th dot of that string line.
+ */
+void
+MppHead :: indexLines()
+{
+	MppElement *ptr;
+	MppElement *start;
+	MppElement *stop;
+	MppElement *chord;
+	MppElement *scan = 0;
+	MppElement *string_stop = 0;
+	int dot_first = 0;
+	int num_dot = 0;
+	int counter = 0;
+	int key;
+
+	delete [] line_index;
+	line_index = 0;
+	line_index_max = 0;
+
+	TAILQ_FOREACH(ptr, &head, entry) {
+		if (ptr->line >= line_index_max)
+			line_index_max = ptr->line + 1;
+	}
+
+	if (line_index_max == 0)
+		return;
+
+	line_index = new MppLineIndex [line_index_max];
+	memset(line_index, 0, sizeof(line_index[0]) * line_index_max);
+
 	start = stop = 0;
 
 	while (foreachLine(&start, &stop) != 0) {
 
 		for (ptr = start; ptr != stop; ptr = ptr->next()) {
 			if (ptr->type == MPP_T_STRING_CHORD) {
-				string_start = start;
+				scan = start;
 				string_stop = stop;
+				dot_first = 0;
+				num_dot = 0;
 				counter = 0;
 				break;
 			}
@@ -672,64 +1156,39 @@ MppHead :: getChord(int line, MppChordElement *pinfo)
 		if (ptr == stop)
 			continue;
 
-		if (start->line == line) {
-			/* compute pointer to chord info, if any */
-			int dot_first = 0;
-			int num_dot = 0;
-
-			for (ptr = string_start; ptr != string_stop;
-			     ptr = ptr->next()) {
-
-				if (ptr->type == MPP_T_STRING_DOT) {
-					if (dot_first == 0)
-						dot_first = 1;
-					num_dot++;
-				} else if (ptr->type == MPP_T_STRING_CHORD) {
-					if (dot_first == 0)
-						dot_first = -1;
-					if (dot_first == 1) {
-						/* dot is before the chord */
-						if ((num_dot - 1) == counter)
-							break;
-					} else {
-						/* dot is after the chord */
-						if (num_dot == counter)
-							break;
-					}
+		/* advance to the chord belonging to these scores, if any */
+		for (chord = 0; scan != string_stop; scan = scan->next()) {
+			if (scan->type == MPP_T_STRING_DOT) {
+				if (dot_first == 0)
+					dot_first = 1;
+				num_dot++;
+			} else if (scan->type == MPP_T_STRING_CHORD) {
+				if (dot_first == 0)
+					dot_first = -1;
+				if (dot_first == 1) {
+					/* dot is before the chord */
+					key = num_dot - 1;
+				} else {
+					/* dot is after the chord */
+					key = num_dot;
 				}
-			}
-			if (ptr != string_stop)
-				pinfo->chord = ptr;
-			pinfo->start = start;
-			pinfo->stop = stop;
-
-			/* compute chord profile */
-			for (ptr = start; ptr != stop; ptr = ptr->next()) {
-				if (ptr->type == MPP_T_SCORE_SUBDIV) {
-					int key = ptr->value[0];
-					if (key > pinfo->key_max)
-						pinfo->key_max = key;
-					pinfo->stats[MPP_BAND_REM(key, MPP_MAX_CHORD_BANDS)]++;
+				if (key > counter)
+					break;
+				if (key == counter) {
+					chord = scan;
+					scan = scan->next();
+					break;
 				}
 			}
+		}
 
-			for (x = y = 0; x != MPP_MAX_CHORD_BANDS; x++) {
-				if (pinfo->stats[x] > pinfo->stats[y])
-					y = x;
-			}
-
-			/*
-			 * The key having the most hits typically is
-			 * the base:
-			 */
-			pinfo->key_base = y * MPP_BAND_STEP_CHORD;
-
-			/* valid chord/score found */
-			return (1);
+		if (line_index[start->line].start == 0) {
+			line_index[start->line].start = start;
+			line_index[start->line].stop = stop;
+			line_index[start->line].chord = chord;
 		}
 		counter++;
 	}
-	return (0);
 }
 
 void
@@ -1549,16 +2008,62 @@ MppHead :: jumpPointer(MppElement *ptr)
 	state.curr_start = state.curr_stop = ptr;
 }
 
+/*
+ * Number all elements and build the flat table of operations used
+ * when playing. Each element stores the index of the first operation
+ * at or after it, so that the operations of any range of elements can
+ * be found without walking the list.
+ */
 void
 MppHead :: sequence()
 {
 	MppElement *elem;
 	int count = 0;
+	int num = 0;
 
 	TAILQ_FOREACH(elem, &head, entry) {
 		elem->sequence = count;
+		elem->compiled = num;
 		count++;
+		if (MppIsCompiled(elem))
+			num++;
 	}
+
+	indexLines();
+
+	delete [] compiled;
+	compiled = 0;
+	compiled_max = num;
+
+	if (num == 0)
+		return;
+
+	compiled = new MppCompiledOp [num];
+	num = 0;
+
+	TAILQ_FOREACH(elem, &head, entry) {
+		if (MppIsCompiled(elem) == false)
+			continue;
+		compiled[num].type = elem->type;
+		compiled[num].value[0] = elem->value[0];
+		compiled[num].value[1] = elem->value[1];
+		num++;
+	}
+}
+
+/* must be called locked */
+void
+MppHead :: compiledRange(const MppElement *start, const MppElement *stop,
+    const MppCompiledOp **ppstart, const MppCompiledOp **ppstop)
+{
+	int x = start ? start->compiled : compiled_max;
+	int y = stop ? stop->compiled : compiled_max;
+
+	if (y < x)
+		y = x;
+
+	*ppstart = compiled + x;
+	*ppstop = compiled + y;
 }
 
 /* must be called locked */
@@ -172,11 +172,27 @@ public:
 	MppColorProps color;
 };
 
+/* compiled form of the elements used when playing a line */
+struct MppCompiledOp {
+	enum MppElementType type;
+	int value[2];
+};
+
+/* scores and chord of a line, used when inspecting chords */
+struct MppLineIndex {
+	MppElement *start;
+	MppElement *stop;
+	MppElement *chord;
+};
+
 class MppElement {
 public:
 	MppElement(MppElementType type, int, int = 0, int = 0, int = 0, int = 0);
 	~MppElement();
 
+	static void *operator new(size_t);
+	static void operator delete(void *, size_t);
+
 	int compare(const MppElement *) const;
 
 	MppElement * next() const;
@@ -191,12 +207,19 @@ public:
 	int value[4];
 	int line;
 	int sequence;
+	int compiled;	/* index of first compiled operation */
 };
 
 class MppHead {
 public:
 	MppElementHeadT head;
 
+	MppCompiledOp *compiled;
+	int compiled_max;
+
+	MppLineIndex *line_index;
+	int line_index_max;
+
 	QChar last;
 
 	struct {
@@ -218,14 +241,24 @@ public:
 		MppElement *last_stop;
 		MppElement *elem;
 		MppElement *label_start[MPP_MAX_LABELS];
+		const QString *src;	/* text being added, if any */
+		MppElement *txt_elem;	/* element owning the pending slice */
+		int src_pos;
+		int txt_start;
+		int txt_end;
 	} state;
 
 	MppHead();
 	~MppHead();
 
 	void replace(MppHead *, MppElement *, MppElement *);
+	int prepareLines(int, int, MppHead *, MppElement **, MppElement **);
+	void replaceLines(int, int, int, MppHead *, MppElement *, MppElement *);
+	MppElement *lineStart(int);
+	void publish(MppHead *);
 	int getChord(int, MppChordElement *);
 	void reset();
+	void updateLabels();
 	void clear();
 	void sortScore();
 	void optimise();
@@ -238,6 +271,7 @@ public:
 	void dotReorder();
 	int getPlaytime();
 	void flush();
+	void flushText();
 	QString toPlain(int = -1);
 	QString toLyrics(int no_chords = 0);
 	int foreachLine(MppElement **, MppElement **);
@@ -251,6 +285,9 @@ public:
 	void jumpLabel(int);
 	void jumpPointer(MppElement *);
 	void sequence();
+	void indexLines();
+	void compiledRange(const MppElement *, const MppElement *,
+	    const MppCompiledOp **, const MppCompiledOp **);
 	int getCurrLine();
 
 	void operator += (QChar);
@@ -0,0 +1,275 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "midipp_engine.h"
+#include "midipp_mainwindow.h"
+
+MppRxRing :: MppRxRing()
+{
+	producer.storeRelaxed(0);
+	consumer.storeRelaxed(0);
+	memset(entry, 0, sizeof(entry));
+}
+
+/* must only be called by the producer */
+bool
+MppRxRing :: push(uint8_t device_no, const struct umidi20_event *event, uint64_t ts)
+{
+	const uint32_t p = producer.loadRelaxed();
+	struct MppRxEntry *pe;
+
+	if ((p - consumer.loadAcquire()) >= MPP_RX_RING_MAX)
+		return (false);		/* ring is full */
+
+	pe = &entry[p % MPP_RX_RING_MAX];
+	memcpy(pe->cmd, event->cmd, sizeof(pe->cmd));
+	pe->device_no = device_no;
+	pe->enqueue_ns = ts;
+
+	/* full barrier, see MppEngine::run() */
+	producer.fetchAndStoreOrdered(p + 1);
+	return (true);
+}
+
+/* must only be called by the consumer */
+bool
+MppRxRing :: pop(struct MppRxEntry *pe)
+{
+	const uint32_t c = consumer.loadRelaxed();
+
+	if (c == producer.loadAcquire())
+		return (false);		/* ring is empty */
+
+	*pe = entry[c % MPP_RX_RING_MAX];
+
+	consumer.storeRelease(c + 1);
+	return (true);
+}
+
+static void *
+MppEngineThread(void *arg)
+{
+	MppEngine *pe = (MppEngine *)arg;
+
+	pe->run();
+
+	return (NULL);
+}
+
+MppEngine :: MppEngine(MppMainWindow *_mw)
+{
+	mw = _mw;
+
+	started.storeRelaxed(0);
+	running.storeRelaxed(0);
+	sleeping.storeRelaxed(0);
+
+	stats_last_us.storeRelaxed(0);
+	stats_max_us.storeRelaxed(0);
+	stats_count.storeRelaxed(0);
+	stats_overflow.storeRelaxed(0);
+
+	pthread_mutex_init(&wakeup_mtx, NULL);
+	pthread_cond_init(&wakeup_cv, NULL);
+
+	clock.start();
+}
+
+MppEngine :: ~MppEngine()
+{
+	stop();
+
+	pthread_cond_destroy(&wakeup_cv);
+	pthread_mutex_destroy(&wakeup_mtx);
+}
+
+uint64_t
+MppEngine :: now()
+{
+	return (clock.nsecsElapsed());
+}
+
+void
+MppEngine :: start()
+{
+	if (started.loadRelaxed() != 0)
+		return;
+
+	running.storeRelease(1);
+
+	if (pthread_create(&thread, NULL, &MppEngineThread, this) != 0) {
+		running.storeRelease(0);
+		return;
+	}
+	started.storeRelease(1);
+}
+
+void
+MppEngine :: stop()
+{
+	if (started.loadRelaxed() == 0)
+		return;
+
+	pthread_mutex_lock(&wakeup_mtx);
+	running.storeRelease(0);
+	pthread_cond_signal(&wakeup_cv);
+	pthread_mutex_unlock(&wakeup_mtx);
+
+	pthread_join(thread, NULL);
+
+	/* full barrier, see MppEngine::enqueue() */
+	started.fetchAndStoreOrdered(0);
+
+	/* process any events left behind by the engine thread */
+	mw->atomic_lock();
+	for (unsigned n = 0; n != MPP_MAX_DEVS; n++)
+		drain_locked(n);
+	mw->atomic_unlock();
+}
+
+/* must be called locked */
+void
+MppEngine :: process_locked(const struct MppRxEntry *rx)
+{
+	struct umidi20_event event;
+	uint64_t ts;
+	uint32_t delta;
+
+	ts = now();
+	delta = (ts - rx->enqueue_ns) / 1000ULL;
+
+	stats_last_us.storeRelaxed(delta);
+	if (delta > stats_max_us.loadRelaxed())
+		stats_max_us.storeRelaxed(delta);
+	stats_count.fetchAndAddRelaxed(1);
+	memset(&event, 0, sizeof(event));
+	memcpy(event.cmd, rx->cmd, sizeof(event.cmd));
+	event.device_no = rx->device_no;
+
+	mw->handle_rx_event_locked(rx->device_no, &event);
+}
+
+/*
+ * Process all events queued for the given device. The consumer side
+ * of the rings is only accessed with the global lock held, so that
+ * the receive thread can drain its own ring before processing an
+ * event directly. Must be called locked.
+ */
+void
+MppEngine :: drain_locked(uint8_t device_no)
+{
+	struct MppRxEntry rx;
+
+	while (ring[device_no].pop(&rx))
+		process_locked(&rx);
+}
+
+/* NOTE: Is called unlocked from the umidi20 receive thread */
+void
+MppEngine :: enqueue(uint8_t device_no, struct umidi20_event *event)
+{
+	if (started.loadAcquire() == 0 || device_no >= MPP_MAX_DEVS ||
+	    ring[device_no].push(device_no, event, now()) == false) {
+		/* fallback - process the event directly, after the queued ones */
+		stats_overflow.fetchAndAddRelaxed(1);
+		mw->atomic_lock();
+		if (device_no < MPP_MAX_DEVS)
+			drain_locked(device_no);
+		mw->handle_rx_event_locked(device_no, event);
+		mw->atomic_unlock();
+		return;
+	}
+
+	/*
+	 * The engine may have been stopped after "started" was
+	 * checked. Then stop() either sees this event, or the event
+	 * is drained here.
+	 */
+	if (started.loadAcquire() == 0) {
+		mw->atomic_lock();
+		drain_locked(device_no);
+		mw->atomic_unlock();
+		return;
+	}
+
+	/*
+	 * Only wake up the engine thread when it is sleeping. The full
+	 * barrier in push() orders the producer index store before this
+	 * load, and pairs with the one in run().
+	 */
+	if (sleeping.loadAcquire() != 0) {
+		pthread_mutex_lock(&wakeup_mtx);
+		pthread_cond_signal(&wakeup_cv);
+		pthread_mutex_unlock(&wakeup_mtx);
+	}
+}
+
+void
+MppEngine :: run()
+{
+	struct MppRxEntry rx;
+	bool any;
+
+	while (running.loadAcquire() != 0) {
+		any = false;
+
+		for (unsigned n = 0; n != MPP_MAX_DEVS; n++) {
+			if (ring[n].consumer.loadRelaxed() ==
+			    ring[n].producer.loadAcquire())
+				continue;
+
+			mw->atomic_lock();
+			if (ring[n].pop(&rx)) {
+				process_locked(&rx);
+				any = true;
+			}
+			mw->atomic_unlock();
+		}
+
+		if (any)
+			continue;
+
+		/*
+		 * Wait for more events. Setting "sleeping" is a full
+		 * barrier, so that either the producer sees it set, or
+		 * the check below sees the new event.
+		 */
+		pthread_mutex_lock(&wakeup_mtx);
+		sleeping.fetchAndStoreOrdered(1);
+
+		for (unsigned n = 0; n != MPP_MAX_DEVS; n++) {
+			if (ring[n].consumer.loadRelaxed() !=
+			    ring[n].producer.loadAcquire()) {
+				any = true;
+				break;
+			}
+		}
+		if (any == false && running.loadAcquire() != 0)
+			pthread_cond_wait(&wakeup_cv, &wakeup_mtx);
+
+		sleeping.storeRelease(0);
+		pthread_mutex_unlock(&wakeup_mtx);
+	}
+}
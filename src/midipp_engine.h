@@ -0,0 +1,94 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MIDIPP_ENGINE_H_
+#define	_MIDIPP_ENGINE_H_
+
+#include "midipp.h"
+
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+
+#define	MPP_RX_RING_MAX	256	/* entries, must be power of two */
+
+struct MppRxEntry {
+	uint8_t cmd[UMIDI20_COMMAND_LEN];
+	uint8_t device_no;
+	uint64_t enqueue_ns;
+};
+
+/*
+ * Single producer, single consumer ring. The producer is the umidi20
+ * receive thread of one device. The consumer side is serialized by
+ * the global lock, see MppEngine::drain_locked().
+ */
+class MppRxRing {
+public:
+	MppRxRing();
+
+	bool push(uint8_t, const struct umidi20_event *, uint64_t);
+	bool pop(struct MppRxEntry *);
+
+	QAtomicInteger<uint32_t> producer;
+	QAtomicInteger<uint32_t> consumer;
+
+	struct MppRxEntry entry[MPP_RX_RING_MAX];
+};
+
+class MppEngine {
+public:
+	MppEngine(MppMainWindow *);
+	~MppEngine();
+
+	void start();
+	void stop();
+	void enqueue(uint8_t, struct umidi20_event *);
+	void drain_locked(uint8_t);
+	void process_locked(const struct MppRxEntry *);
+	void run();
+	uint64_t now();
+
+	MppMainWindow *mw;
+
+	MppRxRing ring[MPP_MAX_DEVS];
+
+	QElapsedTimer clock;
+
+	pthread_t thread;
+	pthread_mutex_t wakeup_mtx;
+	pthread_cond_t wakeup_cv;
+
+	QAtomicInteger<uint32_t> started;
+	QAtomicInteger<uint32_t> running;
+	QAtomicInteger<uint32_t> sleeping;
+
+	/* statistics, written with the global lock held */
+	QAtomicInteger<uint32_t> stats_last_us;
+	QAtomicInteger<uint32_t> stats_max_us;
+	QAtomicInteger<uint32_t> stats_count;
+	QAtomicInteger<uint32_t> stats_overflow;
+};
+
+#endif		/* _MIDIPP_ENGINE_H_ */
@@ -32,17 +32,37 @@
 
 #include "midipp_gpro.h"
 #include "midipp_checkbox.h"
+#include "midipp_loader.h"
 
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include <sys/queue.h>
+/*
+ * The events are appended to flat arrays while parsing and sorted
+ * once when all measures have been merged. The merge counters are
+ * used to keep the order of events at the same time the same as
+ * when inserting into sorted lists, where events from the latest
+ * merge come first.
+ */
+struct gpro_event {
+	uint32_t time;
+	uint32_t dur;
+	uint32_t seq;		/* insertion order in measure */
+	uint32_t merge[2];	/* merge order into song and repeat */
+	uint8_t key;
+	uint8_t chan;
+};
+
+struct gpro_event_head {
+	struct gpro_event *pev;
+	uint32_t num;
+	uint32_t max;
+	uint32_t nmerge;
+};
 
-struct gpro_event;
-typedef TAILQ_ENTRY(gpro_event) gpro_event_entry_t;
-typedef TAILQ_HEAD(gpro_event_head,gpro_event) gpro_event_head_t;
+typedef struct gpro_event_head gpro_event_head_t;
 
 #ifdef HAVE_DEBUG
 #define	DPRINTF(fmt, ...) do { \
@@ -62,6 +82,7 @@ struct gpro_measure {
 struct gpro_file {
 	gpro_event_head_t head;
 	gpro_event_head_t temp;
+	MppLoaderJob *job;
 	QString *out;
 	const uint8_t *ptr;
 	char *track_str[GPRO_MAX_TRACKS];
@@ -81,14 +102,6 @@ struct gpro_file {
 	uint8_t tuning[GPRO_MAX_TRACKS][8];
 };
 
-struct gpro_event {
-	gpro_event_entry_t entry;
-	uint8_t key;
-	uint8_t chan;
-	uint32_t time;
-	uint32_t dur;
-};
-
 static uint32_t
 gpro_duration_to_ticks(uint8_t dur)
 {
@@ -261,14 +274,32 @@ gpro_pad_string(struct gpro_file *pgf, uint32_t len)
 	}
 }
 
+static struct gpro_event *
+gpro_alloc_event(gpro_event_head_t *phead)
+{
+	struct gpro_event *pev;
+
+	if (phead->num == phead->max) {
+		uint32_t max = phead->max ? (2 * phead->max) : 64;
+
+		pev = (struct gpro_event *)realloc(phead->pev, sizeof(*pev) * max);
+		if (pev == NULL)
+			return (NULL);
+		phead->pev = pev;
+		phead->max = max;
+	}
+	pev = &phead->pev[phead->num++];
+	memset(pev, 0, sizeof(*pev));
+	return (pev);
+}
+
 static void
 gpro_new_event(gpro_event_head_t *phead, uint32_t time,
     uint32_t dur, uint8_t key, uint8_t chan)
 {
 	struct gpro_event *pev;
-	struct gpro_event *pin;
 
-	pev = (struct gpro_event *)malloc(sizeof(*pev));
+	pev = gpro_alloc_event(phead);
 	if (pev == NULL)
 		return;
 
@@ -276,101 +307,154 @@ gpro_new_event(gpro_event_head_t *phead, uint32_t time,
 	pev->chan = chan;
 	pev->time = time;
 	pev->dur = dur;
+	pev->seq = phead->num - 1;
 
 	DPRINTF("key=%s chan=%d time=%d dur=%d\n",
 	    mid_key_str[key & 0x7F], chan, time, dur);
-
-	TAILQ_FOREACH(pin, phead, entry) {
-		if (pin->time > time)
-			break;
-	}
-
-	if (pin == NULL)
-		TAILQ_INSERT_TAIL(phead, pev, entry);
-	else
-		TAILQ_INSERT_BEFORE(pin, pev, entry);
 }
 
+/*
+ * Append a copy of the events in "phead2" to "phead1". The events
+ * are sorted by gpro_sort_events() when all heads have been merged.
+ */
 static void
-gpro_copy_merge_head(gpro_event_head_t *phead1, gpro_event_head_t *phead2, uint32_t time_offset)
+gpro_copy_merge_head(gpro_event_head_t *phead1, gpro_event_head_t *phead2,
+    uint32_t time_offset, uint8_t level)
 {
-	struct gpro_event *pev;
-	struct gpro_event *pin;
 	struct gpro_event *pxv;
-	struct gpro_event *plv;
-
-	pin = TAILQ_FIRST(phead1);
-	if (pin != NULL) {
-		pev = TAILQ_FIRST(phead2);
-		if (pev != NULL) {
-			plv = TAILQ_LAST(phead1, gpro_event_head);
-			if ((pev->time + time_offset) > plv->time)
-				pin = NULL;
-		}
-	}
-
-	TAILQ_FOREACH(pev, phead2, entry) {
-
-		while ((pin != NULL) && ((pev->time + time_offset) > pin->time))
-			pin = TAILQ_NEXT(pin, entry);
+	uint32_t x;
 
-		pxv = (struct gpro_event *)malloc(sizeof(*pxv));
+	for (x = 0; x != phead2->num; x++) {
+		pxv = gpro_alloc_event(phead1);
 		if (pxv == NULL)
-			continue;
+			break;
+		*pxv = phead2->pev[x];
+		pxv->time += time_offset;
+		pxv->merge[level] = phead1->nmerge;
+	}
+	phead1->nmerge++;
+}
 
-		pxv->key = pev->key;
-		pxv->chan = pev->chan;
-		pxv->time = pev->time + time_offset;
-		pxv->dur = pev->dur;
+static int
+gpro_compare_event(void *arg, const void *pa, const void *pb)
+{
+	const struct gpro_event *a = (const struct gpro_event *)pa;
+	const struct gpro_event *b = (const struct gpro_event *)pb;
+
+	if (a->time != b->time)
+		return ((a->time > b->time) ? 1 : -1);
+	/* latest merge first */
+	if (a->merge[0] != b->merge[0])
+		return ((a->merge[0] < b->merge[0]) ? 1 : -1);
+	if (a->merge[1] != b->merge[1])
+		return ((a->merge[1] < b->merge[1]) ? 1 : -1);
+	if (a->seq != b->seq)
+		return ((a->seq > b->seq) ? 1 : -1);
+	return (0);
+}
 
-		if (pin == NULL)
-			TAILQ_INSERT_TAIL(phead1, pxv, entry);
-		else
-			TAILQ_INSERT_BEFORE(pin, pxv, entry);
-	}
+static void
+gpro_sort_events(gpro_event_head_t *phead)
+{
+	MppSort(phead->pev, phead->num, sizeof(phead->pev[0]),
+	    &gpro_compare_event, 0);
 }
 
-static uint32_t
-gpro_event_duration(struct gpro_file *pgf, struct gpro_event *pev)
+/*
+ * Compute the duration of all events, in number of time steps until
+ * the same key is pressed again, the event ends or the maximum
+ * duration is reached. Events which are not selected by "chan_mask"
+ * are ignored and get a duration of zero.
+ */
+static void
+gpro_event_duration(struct gpro_file *pgf, uint8_t *pdur)
 {
-	uint32_t tim = pev->time;
-	uint32_t end = tim + pev->dur;
-	uint32_t dur = 1;
-	uint8_t chan;
-	uint8_t key;
+	gpro_event_head_t *phead = &pgf->head;
+	uint32_t *pidx;
+	uint32_t *pgrp;
+	uint32_t *pfirst;
+	uint32_t *pnext;
+	uint32_t next[GPRO_MAX_TRACKS][256];
+	uint32_t ngrp = 0;
+	uint32_t num = 0;
+	uint32_t x;
 
-	chan = pev->chan;
-	key = pev->key;
+	memset(pdur, 0, phead->num);
 
-	while ((pev = TAILQ_NEXT(pev, entry))) {
+	pidx = (uint32_t *)malloc(sizeof(uint32_t) * 4 * (phead->num + 1));
+	if (pidx == NULL)
+		return;
+	pgrp = pidx + phead->num + 1;
+	pfirst = pgrp + phead->num + 1;
+	pnext = pfirst + phead->num + 1;
+
+	/* collect selected events and group them by time */
+	for (x = 0; x != phead->num; x++) {
+		const struct gpro_event *pev = &phead->pev[x];
 
 		if (pev->chan >= GPRO_MAX_TRACKS)
 			continue;
 		if ((pgf->chan_mask & (1 << pev->chan)) == 0)
 			continue;
-		if (pev->time > end)
-			break;
-		if (pev->chan == chan && pev->key == key)
-			break;
-		if (pev->time != tim) {
-			tim = pev->time;
-			dur++;
-			if (dur == GPRO_MAX_DURATION)
-				break;
+		if (num == 0 || pev->time != phead->pev[pidx[num - 1]].time)
+			pfirst[ngrp++] = num;
+		pgrp[num] = ngrp - 1;
+		pidx[num++] = x;
+	}
+
+	/* locate the next event having the same key, if any */
+	memset(next, 255, sizeof(next));
+
+	for (x = num; x--; ) {
+		const struct gpro_event *pev = &phead->pev[pidx[x]];
+
+		pnext[x] = next[pev->chan][pev->key];
+		next[pev->chan][pev->key] = x;
+	}
+
+	for (x = 0; x != num; x++) {
+		const struct gpro_event *pev = &phead->pev[pidx[x]];
+		uint32_t end = pev->time + pev->dur;
+		uint32_t lo = pgrp[x] + 1;
+		uint32_t hi = ngrp;
+		uint32_t max;
+
+		/* count time steps up to the next press of the same key */
+		if (pnext[x] != -1U) {
+			max = pgrp[pnext[x]];
+			if (pfirst[max] == pnext[x])
+				max--;
+			max++;
+		} else {
+			max = ngrp;
+		}
+
+		/* count time steps up to the end of the event */
+		while (lo < hi) {
+			uint32_t mid = (lo + hi) / 2;
+
+			if (phead->pev[pidx[pfirst[mid]]].time > end)
+				hi = mid;
+			else
+				lo = mid + 1;
 		}
+		if (max > lo)
+			max = lo;
+
+		max -= pgrp[x];
+		if (max > GPRO_MAX_DURATION)
+			max = GPRO_MAX_DURATION;
+		pdur[pidx[x]] = max;
 	}
-	return (dur);
+
+	free(pidx);
 }
 
 static void
 gpro_clean_events(gpro_event_head_t *phead)
 {
-	struct gpro_event *pev;
-
-	while ((pev = TAILQ_FIRST(phead)) != NULL) {
-		TAILQ_REMOVE(phead, pev, entry);
-		free(pev);
-	}
+	free(phead->pev);
+	memset(phead, 0, sizeof(*phead));
 }
 
 static void
@@ -801,8 +885,6 @@ gpro_get_measure(struct gpro_file *pgf)
 
 	memset(&pgf->pmeas[pgf->imeas], 0, sizeof(pgf->pmeas[0]));
 
-	TAILQ_INIT(&pgf->pmeas[pgf->imeas].head);
-
 	hdr = gpro_get_1(pgf);
 
 	DPRINTF("hdr = 0x%x\n", hdr);
@@ -999,12 +1081,15 @@ gpro_get_beat(struct gpro_file *pgf)
 
 		/* check for tie to previous measure */
 		if ((flags & (1U << 26)) && (pgf->imeas != 0)) {
-			struct gpro_event *pev;
+			gpro_event_head_t *phead = &pgf->pmeas[pgf->imeas - 1].head;
 			struct gpro_event *pev_last = NULL;
+			uint32_t i;
 
-			TAILQ_FOREACH(pev, &pgf->pmeas[pgf->imeas - 1].head, entry) {
-				if (pev->key == note_key && pev->chan == pgf->track) {
-					pev_last = pev;
+			for (i = phead->num; i--; ) {
+				if (phead->pev[i].key == note_key &&
+				    phead->pev[i].chan == pgf->track) {
+					pev_last = &phead->pev[i];
+					break;
 				}
 			}
 			if (pev_last != NULL) {
@@ -1108,19 +1193,28 @@ gpro_dump_events(struct gpro_file *pgf, QString &out, uint8_t single_track)
 {
 	struct gpro_event *pev;
 	char buf[64];
+	uint8_t *pdur;
 	uint32_t chan_last = 0;
 	uint32_t dur_last = -1U;
 	uint32_t dur;
 	uint32_t time_last;
 	uint32_t nevent = 0;
+	uint32_t x;
+
+	pdur = (uint8_t *)malloc(pgf->head.num + 1);
+	if (pdur == NULL)
+		return;
+
+	gpro_event_duration(pgf, pdur);
 
-	pev = TAILQ_FIRST(&pgf->head);
-	if (pev != 0)
-		time_last = ~pev->time;
+	if (pgf->head.num != 0)
+		time_last = ~pgf->head.pev[0].time;
 	else
 		time_last = 0;
 
-	TAILQ_FOREACH(pev, &pgf->head, entry) {
+	for (x = 0; x != pgf->head.num; x++) {
+
+		pev = &pgf->head.pev[x];
 
 		if (pev->chan >= GPRO_MAX_TRACKS)
 			continue;
@@ -1149,7 +1243,7 @@ gpro_dump_events(struct gpro_file *pgf, QString &out, uint8_t single_track)
 			}
 		}
 
-		dur = gpro_event_duration(pgf, pev);
+		dur = pdur[x];
 
 		if (dur != dur_last) {
 			dur_last = dur;
@@ -1162,6 +1256,8 @@ gpro_dump_events(struct gpro_file *pgf, QString &out, uint8_t single_track)
 	}
 
 	out += "\n";
+
+	free(pdur);
 }
 
 static void
@@ -1184,8 +1280,8 @@ gpro_parse(struct gpro_file *pgf, QString *out)
 	pgf->pmeas = 0;
 	pgf->nmeas = 0;
 
-	TAILQ_INIT(&pgf->head);
-	TAILQ_INIT(&pgf->temp);
+	memset(&pgf->head, 0, sizeof(pgf->head));
+	memset(&pgf->temp, 0, sizeof(pgf->temp));
 
 	memset(pgf->track_str, 0, sizeof(pgf->track_str));
 	pgf->chan_mask = 0;
@@ -1389,7 +1485,13 @@ gpro_parse(struct gpro_file *pgf, QString *out)
 
 	for (y = 0; y != nmeas; y++) {
 
-		struct gpro_event *pev;
+		gpro_event_head_t *phead = &pgf->pmeas[y].head;
+
+		if (pgf->job != NULL) {
+			if (pgf->job->cancel.loadRelaxed() != 0)
+				break;
+			pgf->job->progress.storeRelaxed((100ULL * y) / nmeas);
+		}
 
 		pgf->imeas = y;
 
@@ -1406,9 +1508,10 @@ gpro_parse(struct gpro_file *pgf, QString *out)
 				gpro_get_beat(pgf);
 
 			/* fixup all ringing strings */
-			TAILQ_FOREACH(pev, &pgf->pmeas[pgf->imeas].head, entry) {
-				if ((pev->dur == (uint32_t)-1) && (pev->chan == x)) {
-					pev->dur = pgf->ticks_sub - 1;
+			for (z = 0; z != phead->num; z++) {
+				if ((phead->pev[z].dur == (uint32_t)-1) &&
+				    (phead->pev[z].chan == x)) {
+					phead->pev[z].dur = pgf->ticks_sub - 1;
 				}
 			}
 		}
@@ -1438,11 +1541,11 @@ gpro_parse(struct gpro_file *pgf, QString *out)
 			for (x = 0; x != n_repeat; x++) {
 				for (z = y_repeat; z != y; z++) {
 					gpro_copy_merge_head(&pgf->temp, &pgf->pmeas[z].head,
-					    (x * value) + pgf->pmeas[z].start_time + acc_time);
+					    (x * value) + pgf->pmeas[z].start_time + acc_time, 1);
 				}
 			}
 
-			gpro_copy_merge_head(&pgf->head, &pgf->temp, 0);
+			gpro_copy_merge_head(&pgf->head, &pgf->temp, 0, 0);
 			gpro_clean_events(&pgf->temp);
 
 			acc_time += value * (n_repeat - 1);
@@ -1454,9 +1557,11 @@ gpro_parse(struct gpro_file *pgf, QString *out)
 
 	for (z = y_repeat; z < nmeas; z++) {
 		gpro_copy_merge_head(&pgf->head, &pgf->pmeas[z].head,
-		    pgf->pmeas[z].start_time + acc_time);
+		    pgf->pmeas[z].start_time + acc_time, 0);
 	}
 
+	gpro_sort_events(&pgf->head);
+
 	if (gpro_eof(pgf) == 0) {
 		DPRINTF("Extra data at end of file\n");
 	}
@@ -1481,10 +1586,55 @@ gpro_cleanup(struct gpro_file *pgf)
 	}
 }
 
-MppGPro :: MppGPro(MppMainWindow *_mw, const uint8_t *ptr, uint32_t len) :
+/* must be called from the loader thread */
+struct gpro_file *
+MppGProParse(MppLoaderJob *job)
+{
+	struct gpro_file *pgf;
+
+	pgf = (struct gpro_file *)calloc(1, sizeof(*pgf));
+	if (pgf == NULL)
+		return (NULL);
+
+	pgf->ptr = (const uint8_t *)job->data.constData();
+	pgf->rem = job->data.size();
+	pgf->job = job;
+
+	gpro_parse(pgf, &job->output);
+
+	/* the input data is not used after parsing */
+	pgf->ptr = NULL;
+	pgf->rem = 0;
+	pgf->job = NULL;
+	pgf->out = NULL;
+
+	return (pgf);
+}
+
+/* must be called from the loader thread */
+void
+MppGProDump(MppLoaderJob *job)
+{
+	struct gpro_file *pgf = job->gpro;
+
+	if (pgf == NULL)
+		return;
+
+	/* only dump events if one or more tracks are selected */
+	if ((pgf->chan_mask = job->param[0]) != 0)
+		gpro_dump_events(pgf, job->output, job->param[1]);
+}
+
+void
+MppGProFree(struct gpro_file *pgf)
+{
+	gpro_cleanup(pgf);
+	free(pgf);
+}
+
+MppGPro :: MppGPro(MppMainWindow *_mw, struct gpro_file *pgf) :
     MppDialog(_mw, QObject::tr("GuitarPro v3 and v4 import"))
 {
-	struct gpro_file gpf;
 	char line_buf[64];
 	uint32_t x;
 	uint32_t y;
@@ -1492,9 +1642,6 @@ MppGPro :: MppGPro(MppMainWindow *_mw, const uint8_t *ptr, uint32_t len) :
 	uint32_t t;
 	uint32_t u;
 
-	gpf.ptr = ptr;
-	gpf.rem = len;
-
 	lbl_import[0] = new QLabel(tr("Select tracks\nto import"));
 	lbl_import[0]->setAlignment(Qt::AlignCenter);
 
@@ -1518,10 +1665,8 @@ MppGPro :: MppGPro(MppMainWindow *_mw, const uint8_t *ptr, uint32_t len) :
 
 	y++;
 
-	gpro_parse(&gpf, &output);
-
 	for (z = x = 0; x != GPRO_MAX_TRACKS; x++) {
-		if (gpf.track_str[x] != 0) {
+		if (pgf->track_str[x] != 0) {
 			chan_mask |= (1 << x);
 			z++;
 		}
@@ -1536,7 +1681,7 @@ MppGPro :: MppGPro(MppMainWindow *_mw, const uint8_t *ptr, uint32_t len) :
 			}
 
 			snprintf(line_buf, sizeof(line_buf),
-			    "Track%d: %s", (int)x, gpf.track_str[x]);
+			    "Track%d: %s", (int)x, pgf->track_str[x]);
 
 			cbx_import[x] = new MppCheckBox();
 
@@ -1573,11 +1718,7 @@ MppGPro :: MppGPro(MppMainWindow *_mw, const uint8_t *ptr, uint32_t len) :
 		}
 	}
 
-	/* only dump events if one or more tracks are selected */
-	if ((gpf.chan_mask = chan_mask) != 0)
-		gpro_dump_events(&gpf, output, cbx_single_track->isChecked());
-
-	gpro_cleanup(&gpf);
+	single_track = cbx_single_track->isChecked();
 }
 
 void
@@ -33,17 +33,23 @@
 #define	GPRO_MAX_DURATION 255
 #define	GPRO_MAX_TRACKS 16
 
+struct gpro_file;
+
+extern struct gpro_file *MppGProParse(MppLoaderJob *);
+extern void MppGProDump(MppLoaderJob *);
+extern void MppGProFree(struct gpro_file *);
+
 class MppGPro : public MppDialog
 {
 	Q_OBJECT
 
 public:
-	MppGPro(MppMainWindow *, const uint8_t *, uint32_t);
+	MppGPro(MppMainWindow *, struct gpro_file *);
 
-	QString output;
+	uint32_t chan_mask;
+	uint8_t single_track;
 
 private:
-	uint32_t chan_mask;
 
 	QLabel *lbl_import[2];
 	QLabel *lbl_info[GPRO_MAX_TRACKS];
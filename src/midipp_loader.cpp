@@ -0,0 +1,261 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "midipp_loader.h"
+#include "midipp_mainwindow.h"
+#include "midipp_gpro.h"
+#include "midipp_musicxml.h"
+
+MppLoaderJob :: MppLoaderJob(int _type, const QByteArray &_data, int _view)
+{
+	data = _data;
+	song = 0;
+	gpro = 0;
+	mxml = 0;
+	progress.storeRelaxed(0);
+	cancel.storeRelaxed(0);
+	memset(param, 0, sizeof(param));
+	type = _type;
+	view = _view;
+	result = 0;
+}
+
+static void *
+MppLoaderThread(void *arg)
+{
+	MppLoader *pl = (MppLoader *)arg;
+
+	pl->run();
+
+	return (NULL);
+}
+
+MppLoader :: MppLoader(MppMainWindow *_mw)
+{
+	mw = _mw;
+
+	TAILQ_INIT(&pending);
+	TAILQ_INIT(&finished);
+	active = 0;
+	dialog = 0;
+	njobs = 0;
+	running = 0;
+	started = 0;
+
+	pthread_mutex_init(&mtx, NULL);
+	pthread_cond_init(&cv, NULL);
+	umidi20_mutex_init(&song_mtx);
+
+	connect(&watchdog, SIGNAL(timeout()), this, SLOT(handle_watchdog()));
+}
+
+MppLoader :: ~MppLoader()
+{
+	MppLoaderJob *job;
+
+	watchdog.stop();
+
+	pthread_mutex_lock(&mtx);
+	running = 0;
+	if (active != 0)
+		active->cancel.storeRelaxed(1);
+	pthread_cond_signal(&cv);
+	pthread_mutex_unlock(&mtx);
+
+	if (started)
+		pthread_join(thread, NULL);
+
+	while ((job = TAILQ_FIRST(&pending)) != 0) {
+		TAILQ_REMOVE(&pending, job, entry);
+		release(job);
+	}
+	while ((job = TAILQ_FIRST(&finished)) != 0) {
+		TAILQ_REMOVE(&finished, job, entry);
+		release(job);
+	}
+
+	pthread_cond_destroy(&cv);
+	pthread_mutex_destroy(&mtx);
+}
+
+static void
+MppLoaderExecute(MppLoader *pl, MppLoaderJob *job)
+{
+	switch (job->type) {
+	case MPP_LOADER_MIDI:
+		pthread_mutex_lock(&pl->song_mtx);
+		job->song = umidi20_load_file(&pl->song_mtx,
+		    (const uint8_t *)job->data.constData(), job->data.size());
+		pthread_mutex_unlock(&pl->song_mtx);
+		break;
+	case MPP_LOADER_GPRO_PARSE:
+		job->gpro = MppGProParse(job);
+		break;
+	case MPP_LOADER_GPRO_DUMP:
+		MppGProDump(job);
+		break;
+	case MPP_LOADER_MXML_PARSE:
+		job->mxml = MppMusicXMLParse(job);
+		break;
+	case MPP_LOADER_MXML_DUMP:
+		MppMusicXMLDump(job);
+		break;
+	default:
+		break;
+	}
+}
+
+void
+MppLoader :: run()
+{
+	MppLoaderJob *job;
+
+	pthread_mutex_lock(&mtx);
+	while (running) {
+		job = TAILQ_FIRST(&pending);
+		if (job == 0) {
+			pthread_cond_wait(&cv, &mtx);
+			continue;
+		}
+		TAILQ_REMOVE(&pending, job, entry);
+		active = job;
+		pthread_mutex_unlock(&mtx);
+
+		if (job->cancel.loadRelaxed() == 0)
+			MppLoaderExecute(this, job);
+		job->progress.storeRelaxed(100);
+
+		pthread_mutex_lock(&mtx);
+		active = 0;
+		TAILQ_INSERT_TAIL(&finished, job, entry);
+
+		/* let the GUI thread pick up the result */
+		QMetaObject::invokeMethod(this, "handle_finished", Qt::QueuedConnection);
+	}
+	pthread_mutex_unlock(&mtx);
+}
+
+void
+MppLoader :: queue(MppLoaderJob *job)
+{
+	if (started == 0) {
+		running = 1;
+		if (pthread_create(&thread, NULL, &MppLoaderThread, this) != 0) {
+			running = 0;
+			release(job);
+			return;
+		}
+		started = 1;
+	}
+
+	if (dialog == 0) {
+		dialog = new QProgressDialog(tr("Importing file"),
+		    tr("Cancel"), 0, 100, mw);
+		dialog->setWindowTitle(MppVersion);
+		dialog->setWindowModality(Qt::NonModal);
+		dialog->setMinimumDuration(500);
+		connect(dialog, SIGNAL(canceled()), this, SLOT(handle_cancel()));
+	}
+
+	if (njobs++ == 0) {
+		dialog->setValue(0);
+		watchdog.start(100);
+	}
+
+	pthread_mutex_lock(&mtx);
+	TAILQ_INSERT_TAIL(&pending, job, entry);
+	pthread_cond_signal(&cv);
+	pthread_mutex_unlock(&mtx);
+}
+
+void
+MppLoader :: release(MppLoaderJob *job)
+{
+	if (job->song != 0) {
+		pthread_mutex_lock(&song_mtx);
+		umidi20_song_free(job->song);
+		pthread_mutex_unlock(&song_mtx);
+	}
+	if (job->gpro != 0)
+		MppGProFree(job->gpro);
+	if (job->mxml != 0)
+		MppMusicXMLFree(job->mxml);
+	delete job;
+}
+
+void
+MppLoader :: handle_finished()
+{
+	MppLoaderJob *job;
+
+	while (1) {
+		pthread_mutex_lock(&mtx);
+		job = TAILQ_FIRST(&finished);
+		if (job != 0)
+			TAILQ_REMOVE(&finished, job, entry);
+		pthread_mutex_unlock(&mtx);
+
+		if (job == 0)
+			break;
+
+		if (njobs != 0 && --njobs == 0) {
+			watchdog.stop();
+			dialog->reset();
+		}
+
+		/* hand over the result, unless cancelled */
+		if (job->cancel.loadRelaxed() == 0)
+			mw->handle_loader_done(job);
+
+		release(job);
+	}
+}
+
+void
+MppLoader :: handle_watchdog()
+{
+	uint32_t value = 0;
+
+	pthread_mutex_lock(&mtx);
+	if (active != 0 && active->cancel.loadRelaxed() == 0)
+		value = active->progress.loadRelaxed();
+	pthread_mutex_unlock(&mtx);
+
+	if (dialog->wasCanceled() == false && value < 100)
+		dialog->setValue(value);
+}
+
+void
+MppLoader :: handle_cancel()
+{
+	MppLoaderJob *job;
+
+	pthread_mutex_lock(&mtx);
+	TAILQ_FOREACH(job, &pending, entry)
+		job->cancel.storeRelaxed(1);
+	if (active != 0)
+		active->cancel.storeRelaxed(1);
+	pthread_mutex_unlock(&mtx);
+}
@@ -0,0 +1,113 @@
+/*-
+ * Copyright (c) 2026 Hans Petter Selasky
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MIDIPP_LOADER_H_
+#define	_MIDIPP_LOADER_H_
+
+#include "midipp.h"
+
+#include <QAtomicInteger>
+#include <QProgressDialog>
+
+enum {
+	MPP_LOADER_MIDI,
+	MPP_LOADER_GPRO_PARSE,
+	MPP_LOADER_GPRO_DUMP,
+	MPP_LOADER_MXML_PARSE,
+	MPP_LOADER_MXML_DUMP,
+};
+
+struct gpro_file;
+struct mxml_file;
+class MppLoaderJob;
+
+typedef TAILQ_HEAD(MppLoaderJobHead, MppLoaderJob) MppLoaderJobHeadT;
+
+/*
+ * A file import job. The input data is parsed by the loader thread
+ * and the result is handed over to the GUI thread in one step.
+ */
+class MppLoaderJob {
+public:
+	MppLoaderJob(int, const QByteArray &, int = 0);
+
+	TAILQ_ENTRY(MppLoaderJob) entry;
+
+	QByteArray data;
+	QString name;
+	QString output;
+
+	struct umidi20_song *song;
+	struct gpro_file *gpro;
+	struct mxml_file *mxml;
+
+	QAtomicInteger<uint32_t> progress;	/* percent */
+	QAtomicInteger<uint32_t> cancel;
+
+	uint32_t param[3];
+	int type;
+	int view;
+	int result;
+};
+
+class MppLoader : public QObject
+{
+	Q_OBJECT
+
+public:
+	MppLoader(MppMainWindow *);
+	~MppLoader();
+
+	void queue(MppLoaderJob *);
+	void release(MppLoaderJob *);
+	void run();
+
+	MppMainWindow *mw;
+
+	MppLoaderJobHeadT pending;
+	MppLoaderJobHeadT finished;
+	MppLoaderJob *active;
+
+	QProgressDialog *dialog;
+	QTimer watchdog;
+
+	pthread_t thread;
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;
+
+	/* mutex of the songs loaded by the loader thread */
+	pthread_mutex_t song_mtx;
+
+	uint32_t njobs;
+	uint8_t running;
+	uint8_t started;
+
+public slots:
+	void handle_finished();
+	void handle_watchdog();
+	void handle_cancel();
+};
+
+#endif		/* _MIDIPP_LOADER_H_ */
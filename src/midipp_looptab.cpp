@@ -25,6 +25,7 @@
 
 #include "midipp.h"
 
+#include "midipp_bpm.h"
 #include "midipp_buttonmap.h"
 #include "midipp_chansel.h"
 #include "midipp_mainwindow.h"
@@ -60,69 +61,188 @@ static void
 MppLoopTabTimerCallback(void *arg)
 {
 	MppLoopTab *plt = (MppLoopTab *)arg;
-	uint32_t period = 0;
-	struct umidi20_event *event;
-	struct umidi20_event *event_copy;
 
 	plt->mw->atomic_lock();
+	plt->schedule();
+	plt->mw->atomic_unlock();
+}
 
-	/* find the longest period */
-	for (int x = 0; x != MPP_LOOP_MAX; x++) {
-		if (plt->loop[x].state != MppLoopTab::ST_PLAYING)
+static int
+MppLoopEventCompare(void *arg, const void *pa, const void *pb)
+{
+	const struct MppLoopEvent *a = (const struct MppLoopEvent *)pa;
+	const struct MppLoopEvent *b = (const struct MppLoopEvent *)pb;
+
+	if (a->position > b->position)
+		return (1);
+	else if (a->position < b->position)
+		return (-1);
+	else if (a->seq > b->seq)
+		return (1);
+	else if (a->seq < b->seq)
+		return (-1);
+	else
+		return (0);
+}
+
+/* must be called locked */
+void
+MppLoopTab :: output_event(const struct MppLoopEvent *pe, uint32_t pos)
+{
+	const struct MppOutputRoute *pr = mw->outRoute[pe->track];
+	struct umidi20_event *event_copy;
+
+	/* the playback and recording routes always come first */
+	for (unsigned x = 0; x != 2; x++, pr++) {
+		if (mw->output_route(pr, 0, pos) == false)
+			continue;
+		event_copy = umidi20_event_copy(pe->event, 0);
+		if (event_copy != 0)
+			mid_add_event(&mw->mid_data, event_copy);
+	}
+}
+
+/*
+ * Output the events of the given loop which are due before the
+ * limit, but not more than "budget" events. When the loop has
+ * completed its period, it continues with the current period, if
+ * that is a later one. Returns the number of events output. Must be
+ * called locked.
+ */
+uint32_t
+MppLoopTab :: schedule_loop(struct MppLoopEntry *pl, uint32_t limit, uint32_t budget)
+{
+	const struct MppLoopEvent *pe;
+	uint32_t base;
+	uint32_t num = 0;
+
+	while (num != budget) {
+		if (pl->sched_repeat >= pl->repeat_count) {
+			if (pl->sched_start == sched_start)
+				break;
+			schedule_setup(pl);
 			continue;
-		if (period < plt->loop[x].period)
-			period = plt->loop[x].period;
+		}
+
+		base = pl->sched_start + pl->sched_offset +
+		    pl->sched_repeat * pl->repeat_step;
+		pe = pl->events + pl->sched_index;
+
+		if ((int32_t)(base + pe->position - limit) >= 0)
+			break;
+
+		output_event(pe, base);
+		num++;
+
+		if (++(pl->sched_index) == pl->num_events) {
+			pl->sched_index = 0;
+			pl->sched_repeat++;
+		}
 	}
+	return (num);
+}
 
-	plt->pos_align = plt->mw->get_time_offset();
-	plt->cur_period = period;
+/*
+ * Prepare the given loop for the current period. Shorter loops are
+ * repeated and stretched to fill the longest period. Must be called
+ * locked.
+ */
+void
+MppLoopTab :: schedule_setup(struct MppLoopEntry *pl)
+{
+	pl->sched_start = sched_start;
+	pl->sched_index = 0;
+	pl->sched_repeat = 0;
 
-	if (period == 0 || plt->mw->midiTriggered == 0) {
-	  	umidi20_update_timer(&MppLoopTabTimerCallback, plt, 1, 0);
-	  	plt->mw->atomic_unlock();		
+	if (pl->state != ST_PLAYING || pl->num_events == 0 || cur_period == 0) {
+		pl->repeat_count = 0;
 		return;
 	}
+	pl->repeat_count = qRound((qreal)cur_period / (qreal)pl->period);
+	if (pl->repeat_count == 0)
+		pl->repeat_count = 1;
+	pl->repeat_step = cur_period / pl->repeat_count;
+	pl->sched_offset = (pl->period * pl->sli_offset->value()) / 8;
+}
 
+/*
+ * Let the given loop wait for the next period, for example when it
+ * starts playing. Must be called locked.
+ */
+void
+MppLoopTab :: schedule_wait(struct MppLoopEntry *pl)
+{
+	pl->sched_start = sched_start;
+	pl->repeat_count = 0;
+}
+
+/*
+ * Restart all loops at the given position, dropping any pending
+ * events. Must be called locked.
+ */
+void
+MppLoopTab :: schedule_period(uint32_t start, uint32_t period)
+{
+	sched_start = start;
+	sched_sync = 0;
+	cur_period = period;
+	pos_align = (start & 0x3FFFFFFFU) % 100000000UL;
+
+	for (int x = 0; x != MPP_LOOP_MAX; x++)
+		schedule_setup(&loop[x]);
+}
+
+/*
+ * Stream the frozen loop events into the output queues, at most
+ * MPP_LOOP_AHEAD milliseconds ahead of time and at most
+ * MPP_LOOP_BURST events per tick. Must be called locked.
+ */
+void
+MppLoopTab :: schedule()
+{
+	uint32_t budget = MPP_LOOP_BURST;
+	uint32_t period = 0;
+	uint32_t now;
+
+	/* find the longest period */
 	for (int x = 0; x != MPP_LOOP_MAX; x++) {
-		uint32_t base_off;
-		if (plt->loop[x].state != MppLoopTab::ST_PLAYING)
+		if (loop[x].state != ST_PLAYING)
 			continue;
-		plt->loop[x].repeat_factor = qRound((qreal)period / (qreal)plt->loop[x].period);
-		plt->loop[x].scale_factor = (qreal)period / (plt->loop[x].repeat_factor *
-		    (qreal)plt->loop[x].period);
-
-		base_off = (plt->loop[x].period * plt->loop[x].sli_offset->value()) / 8;
-
-		for (qreal n = 0; n != plt->loop[x].repeat_factor; n++) {
-			for (int z = 0; z != MPP_MAX_TRACKS; z++) {
-				UMIDI20_QUEUE_FOREACH(event, &plt->loop[x].track[z]->queue) {
-					if (~umidi20_event_get_what(event) & UMIDI20_WHAT_CHANNEL)
-						continue;
-					if (plt->mw->check_play(z, 0, base_off)) {
-						event_copy = umidi20_event_copy(event, 0);
-						if (event_copy != 0)
-							mid_add_event(&plt->mw->mid_data, event_copy);
-					}
-					if (plt->mw->check_record(z, 0, base_off)) {
-						event_copy = umidi20_event_copy(event, 0);
-						if (event_copy != 0)
-							mid_add_event(&plt->mw->mid_data, event_copy);
-					}
-				}
-			}
-			base_off += plt->loop[x].period * plt->loop[x].scale_factor;
-		}
+		if (period < loop[x].period)
+			period = loop[x].period;
+	}
+
+	if (period == 0 || mw->midiTriggered == 0) {
+		cur_period = 0;
+		pos_align = mw->get_time_offset();
+		return;
+	}
+
+	now = umidi20_get_curr_position() - mw->startPosition;
+
+	if (cur_period == 0 || sched_sync != 0 ||
+	    (int32_t)(now - sched_start - 2 * cur_period) >= 0) {
+		schedule_period(now, period);
+	} else if ((int32_t)(now + MPP_LOOP_AHEAD - sched_start - cur_period) >= 0) {
+		/* the loops follow when they have completed the current period */
+		sched_start += cur_period;
+		cur_period = period;
+		pos_align = (sched_start & 0x3FFFFFFFU) % 100000000UL;
 	}
-	plt->mw->atomic_unlock();
 
-	umidi20_update_timer(&MppLoopTabTimerCallback, plt, period, 0);
+	for (int x = 0; x != MPP_LOOP_MAX && budget != 0; x++) {
+		if (loop[x].state == ST_PLAYING)
+			budget -= schedule_loop(&loop[x], now + MPP_LOOP_AHEAD, budget);
+	}
 }
 
 void
 MppLoopTab :: handle_timer_sync()
 {
 	mw->atomic_lock();
-	umidi20_update_timer(&MppLoopTabTimerCallback, this, 1, 1);
+	/* start a new period at the next tick */
+	sched_sync = 1;
+	umidi20_update_timer(&MppLoopTabTimerCallback, this, MPP_LOOP_TICK, 1);
 	/* update alignment position */
 	pos_align = mw->get_time_offset();
 	mw->atomic_unlock();
@@ -200,7 +320,7 @@ MppLoopTab :: MppLoopTab(MppMainWindow *_mw)
 
 	handle_value_changed(0);
 
-	umidi20_set_timer(&MppLoopTabTimerCallback, this, 1);
+	umidi20_set_timer(&MppLoopTabTimerCallback, this, MPP_LOOP_TICK);
 }
 
 MppLoopTab :: ~MppLoopTab()
@@ -212,39 +332,30 @@ MppLoopTab :: ~MppLoopTab()
 
 	mw->atomic_lock();
 	for (n = 0; n != MPP_LOOP_MAX; n++) {
+		free(loop[n].events);
 		for (z = 0; z != MPP_MAX_TRACKS; z++)
 			umidi20_track_free(loop[n].track[z]);
 	}
 	mw->atomic_unlock();
 }
 
-/* This function must be called locked */
-bool
-MppLoopTab :: check_record(uint8_t index, uint8_t chan, uint8_t n)
+/*
+ * Update the recorded range of the given loop and return the
+ * position relative to its first event. This function must be
+ * called locked.
+ */
+uint32_t
+MppLoopTab :: record_position(uint8_t n, uint32_t pos)
 {
-	struct mid_data *d = &mw->mid_data;
-	uint32_t pos;
-
-	if (index >= MPP_MAX_TRACKS || chan >= 0x10 ||
-	    n >= MPP_LOOP_MAX || loop[n].state != ST_REC)
-		return (false);
-
-	pos = mw->get_time_offset();
-	if (pos == 0)
-		pos = 1;
-
 	if (loop[n].first == 0)
 		loop[n].first = pos;
 
 	loop[n].last = pos;
 
 	needs_update = 1;
+	mw->notify(MPP_DIRTY_LOOP);
 
-	d->track = loop[n].track[index];
-	mid_set_channel(d, chan);
-	mid_set_position(d, pos - loop[n].first);
-	mid_set_device_no(d, 0xFF);
-	return (true);
+	return (pos - loop[n].first);
 }
 
 bool
@@ -280,91 +391,229 @@ MppLoopTab :: handle_import(int n)
 	return (true);
 }
 
+/*
+ * Return the repetition period, in bins, of the given onset
+ * histogram, or zero if no repetition is found. The normalised
+ * autocorrelation is computed for all lags which overlap at least
+ * half of the histogram, and the shortest lag scoring close to the
+ * best one is selected, to avoid picking a multiple of the period.
+ * The number of bins is limited to MPP_LOOP_BINS, which bounds the
+ * work to about 0.5M multiply-adds, because this is done with the
+ * global lock held.
+ */
+static uint32_t
+MppLoopPeriodEstimate(const uint32_t *hist, uint32_t nb, uint32_t min_lag)
+{
+	double *energy;
+	double *score;
+	double best = 0;
+	double r;
+	uint32_t max_lag = (2 * nb) / 3;
+	uint32_t lag;
+	uint32_t x;
+
+	if (min_lag == 0)
+		min_lag = 1;
+	if (max_lag < min_lag)
+		return (0);
+
+	energy = (double *)malloc(sizeof(double) * (nb + 1));
+	score = (double *)malloc(sizeof(double) * (max_lag + 2));
+	if (energy == 0 || score == 0) {
+		free(energy);
+		free(score);
+		return (0);
+	}
+
+	/* prefix sums of the squared histogram */
+	energy[0] = 0;
+	for (x = 0; x != nb; x++)
+		energy[x + 1] = energy[x] + (double)hist[x] * (double)hist[x];
+
+	for (lag = min_lag; lag <= max_lag; lag++) {
+		double e = energy[nb - lag] * (energy[nb] - energy[lag]);
+
+		r = 0;
+		for (x = 0; x != nb - lag; x++)
+			r += (double)hist[x] * (double)hist[x + lag];
+
+		/* squared cosine similarity */
+		score[lag] = (e > 0) ? (r * r) / e : 0;
+		if (score[lag] > best)
+			best = score[lag];
+	}
+	score[max_lag + 1] = 0;
+
+	/* require at least 50% similarity */
+	if (best < 0.25) {
+		lag = 0;
+	} else {
+		for (lag = min_lag; lag <= max_lag; lag++) {
+			if (score[lag] < 0.81 * best)
+				continue;
+			if (lag != min_lag && score[lag] < score[lag - 1])
+				continue;
+			if (score[lag] < score[lag + 1])
+				continue;
+			break;
+		}
+		if (lag > max_lag)
+			lag = 0;
+	}
+
+	free(energy);
+	free(score);
+
+	return (lag);
+}
+
 /* Must be called locked */
 void
 MppLoopTab :: handle_recordN(int n)
 {
 	struct umidi20_event *event;
 	struct umidi20_event *temp;
+	uint32_t *hist;
+	uint32_t time_start = 0;
+	uint32_t time_end = 0;
+	uint32_t num_onsets = 0;
+	uint32_t period;
+	uint32_t beat;
+	uint32_t span;
+	uint32_t bin;
+	uint32_t nb;
+	uint32_t x;
 
 	loop[n].period = 0;
 
+	/* find the range of key starts, over all tracks */
 	for (int z = 0; z != MPP_MAX_TRACKS; z++) {
-		struct umidi20_event *first = 0;
-		struct umidi20_event *middle = 0;
-		uint32_t time_start = 0;
-		uint32_t period;
-		size_t num_events = 0;
-		size_t divisor;
-
-		if (pedal_rec == 0) {
-			UMIDI20_QUEUE_FOREACH_SAFE(event, &loop[n].track[z]->queue, temp) {
-				if (umidi20_event_get_control_address(event) == 0x40) {
-					UMIDI20_IF_REMOVE(&loop[n].track[z]->queue, event);
-					umidi20_event_free(event);
-				}
+		UMIDI20_QUEUE_FOREACH_SAFE(event, &loop[n].track[z]->queue, temp) {
+			if (pedal_rec == 0 &&
+			    umidi20_event_get_control_address(event) == 0x40) {
+				UMIDI20_IF_REMOVE(&loop[n].track[z]->queue, event);
+				umidi20_event_free(event);
+				continue;
 			}
+			if (!umidi20_event_is_key_start(event))
+				continue;
+			if (num_onsets == 0 || event->position < time_start)
+				time_start = event->position;
+			if (num_onsets == 0 || event->position > time_end)
+				time_end = event->position;
+			num_onsets++;
 		}
+	}
 
+	if (num_onsets < 2) {
+		handle_clearN(n);
+		return;
+	}
+
+	span = time_end - time_start;
+	bin = MPP_LOOP_BIN;
+	if (span / bin >= MPP_LOOP_BINS)
+		bin = (span / MPP_LOOP_BINS) + 1;
+	nb = (span / bin) + 1;
+
+	hist = (uint32_t *)calloc(nb, sizeof(uint32_t));
+	if (hist == 0) {
+		handle_clearN(n);
+		return;
+	}
+
+	/* align all tracks to the first key start and build the onset histogram */
+	for (int z = 0; z != MPP_MAX_TRACKS; z++) {
 		UMIDI20_QUEUE_FOREACH(event, &loop[n].track[z]->queue) {
-			if (umidi20_event_is_key_start(event)) {
-				if (first == 0) {
-					first = event;
-					num_events++;
-				} else if (umidi20_event_get_key(event) == umidi20_event_get_key(first) &&
-					   umidi20_event_get_channel(event) == umidi20_event_get_channel(first)) {
-					num_events++;
-				}
-			}
+			if (event->position < time_start)
+				event->position = 0;
+			else
+				event->position -= time_start;
+
+			if (!umidi20_event_is_key_start(event))
+				continue;
+
+			/* spread each onset to tolerate timing jitter */
+			x = event->position / bin;
+			hist[x] += 2;
+			if (x != 0)
+				hist[x - 1]++;
+			if (x + 1 != nb)
+				hist[x + 1]++;
 		}
+	}
 
-		if (first == 0 || num_events < 2)
-			continue;
+	period = MppLoopPeriodEstimate(hist, nb, MPP_LOOP_MIN_PERIOD / bin) * bin;
 
-		/* figure out how many times the events repeat */
-		for (divisor = 2; (divisor * divisor) <= num_events; divisor++) {
-			if ((num_events % divisor) == 0)
-				break;
+	free(hist);
+
+	/* snap to whole beats, if the BPM generator is active */
+	if (mw->dlg_bpm->enabled != 0 && mw->dlg_bpm->bpm_other != 0) {
+		beat = mw->dlg_bpm->bpm_get() / mw->dlg_bpm->bpm_other;
+		if (beat != 0) {
+			period = ((period + (beat / 2)) / beat) * beat;
+			if (period == 0)
+				period = beat;
 		}
+	}
 
-		/* prime number */
-		if ((divisor * divisor) > num_events)
-			divisor = num_events;
+	if (period == 0) {
+		/* no repetition found, keep the whole take */
+		loop[n].period = ((span / bin) + 1) * bin;
+	} else {
+		/* the loop consists of all the repetitions recorded */
+		loop[n].period = ((span / period) + 1) * period;
+	}
 
-		time_start = first->position;
+	freeze(n);
+}
 
-		/* compute offset for last period */
-		num_events /= divisor;
-		num_events *= (divisor - 1);
+/*
+ * Take a sorted snapshot of the channel events of the given loop,
+ * so that the scheduler does not need to walk the track queues.
+ * Must be called locked.
+ */
+void
+MppLoopTab :: freeze(int n)
+{
+	struct MppLoopEvent *pe;
+	struct umidi20_event *event;
+	uint32_t num = 0;
 
-		UMIDI20_QUEUE_FOREACH(event, &loop[n].track[z]->queue) {
-			if (event->position < time_start)
-				event->position = 0;
-			else
-				event->position -= time_start;
+	free(loop[n].events);
+	loop[n].events = 0;
+	loop[n].num_events = 0;
 
-			if (umidi20_event_is_key_start(event)) {
-				if (umidi20_event_get_key(event) == umidi20_event_get_key(first) &&
-				    umidi20_event_get_channel(event) == umidi20_event_get_channel(first)) {
-					if (!num_events--)
-						middle = event;
-				}
-			}
+	for (int z = 0; z != MPP_MAX_TRACKS; z++) {
+		UMIDI20_QUEUE_FOREACH(event, &loop[n].track[z]->queue) {
+			if (umidi20_event_get_what(event) & UMIDI20_WHAT_CHANNEL)
+				num++;
 		}
+	}
 
-		if (middle == 0)
-			continue;
+	if (num == 0)
+		return;
 
-		/* now compute the final period */
-		period = ((middle->position - first->position) * divisor) / (divisor - 1);
+	pe = (struct MppLoopEvent *)malloc(sizeof(*pe) * num);
+	if (pe == 0)
+		return;
+
+	loop[n].events = pe;
+	loop[n].num_events = num;
 
-		/* collect largest period */
-		if (period > loop[n].period)
-			loop[n].period = period;
+	for (int z = 0; z != MPP_MAX_TRACKS; z++) {
+		UMIDI20_QUEUE_FOREACH(event, &loop[n].track[z]->queue) {
+			if (~umidi20_event_get_what(event) & UMIDI20_WHAT_CHANNEL)
+				continue;
+			pe->event = event;
+			pe->position = event->position;
+			pe->seq = pe - loop[n].events;
+			pe->track = z;
+			pe++;
+		}
 	}
-	/* check if there are no events */
-	if (loop[n].period == 0)
-		handle_clearN(n);
+
+	MppSort(loop[n].events, num, sizeof(*pe), &MppLoopEventCompare, 0);
 }
 
 void
@@ -381,17 +630,22 @@ MppLoopTab :: handle_trigger(int n)
 	case ST_REC:
 		loop[n].state = ST_PLAYING;
 		handle_recordN(n);
+		schedule_wait(&loop[n]);
 		break;
 	case ST_PLAYING:
 		loop[n].state = ST_STOPPED;
 		break;
 	case ST_STOPPED:
 		loop[n].state = ST_PLAYING;
+		/* don't output the events which were due while stopped */
+		schedule_wait(&loop[n]);
 		break;
 	default:
 		break;
 	}
+	mw->update_out_plan();
 	needs_update = 1;
+	mw->notify(MPP_DIRTY_LOOP);
 	mw->atomic_unlock();
 }
 
@@ -416,6 +670,11 @@ MppLoopTab :: handle_clear(int n)
 void
 MppLoopTab :: handle_clearN(int n)
 {
+	free(loop[n].events);
+	loop[n].events = 0;
+	loop[n].num_events = 0;
+	loop[n].repeat_count = 0;
+
 	for (unsigned z = 0; z != MPP_MAX_TRACKS; z++)
 		umidi20_event_queue_drain(&loop[n].track[z]->queue);
 
@@ -424,7 +683,9 @@ MppLoopTab :: handle_clearN(int n)
 	loop[n].last = 0;
 	loop[n].period = 0;
 
+	mw->update_out_plan();
 	needs_update = 1;
+	mw->notify(MPP_DIRTY_LOOP);
 }
 
 void
@@ -28,12 +28,34 @@
 
 #include "midipp.h"
 
+#define	MPP_LOOP_TICK	20	/* ms, scheduler interval */
+#define	MPP_LOOP_AHEAD	100	/* ms, scheduling horizon */
+#define	MPP_LOOP_BURST	256	/* events, maximum per tick */
+#define	MPP_LOOP_BIN	10	/* ms, onset histogram resolution */
+#define	MPP_LOOP_BINS	1024	/* maximum number of histogram bins */
+#define	MPP_LOOP_MIN_PERIOD 100	/* ms */
+
+struct MppLoopEvent {
+	struct umidi20_event *event;
+	uint32_t position;
+	uint32_t seq;
+	uint8_t track;
+};
+
 struct MppLoopEntry {
 	MppButton *but_trig;
 	QSlider *sli_offset;
 	struct umidi20_track *track[MPP_MAX_TRACKS];
-	qreal scale_factor;
-	qreal repeat_factor;
+	/* frozen copy of the channel events, sorted by position */
+	struct MppLoopEvent *events;
+	uint32_t num_events;
+	/* schedule for the current period */
+	uint32_t repeat_count;
+	uint32_t repeat_step;
+	uint32_t sched_start;
+	uint32_t sched_offset;
+	uint32_t sched_repeat;
+	uint32_t sched_index;
 	uint32_t period;
 	uint32_t first;
 	uint32_t last;
@@ -55,11 +77,19 @@ public:
 	MppLoopTab(MppMainWindow *);
 	~MppLoopTab();
 
-	bool check_record(uint8_t index, uint8_t chan, uint8_t n);
+	uint32_t record_position(uint8_t n, uint32_t pos);
 	void handle_clearN(int);
 	void handle_recordN(int);
 	void handle_timer_sync();
 
+	void freeze(int);
+	void schedule();
+	void schedule_period(uint32_t, uint32_t);
+	void schedule_setup(struct MppLoopEntry *);
+	void schedule_wait(struct MppLoopEntry *);
+	uint32_t schedule_loop(struct MppLoopEntry *, uint32_t, uint32_t);
+	void output_event(const struct MppLoopEvent *, uint32_t);
+
 	uint8_t auto_zero_start[0];
 
 	MppMainWindow *mw;
@@ -79,8 +109,10 @@ public:
 
 	uint32_t pos_align;
 	uint32_t cur_period;
+	uint32_t sched_start;
   
 	uint8_t pedal_rec;
+	uint8_t sched_sync;
 	uint8_t needs_update;
 
 	uint8_t auto_zero_end[0];
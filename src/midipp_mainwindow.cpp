@@ -25,6 +25,8 @@
 
 #include <unistd.h>
 
+#include <QScreen>
+
 #include "midipp_chansel.h"
 #include "midipp_mainwindow.h"
 #include "midipp_scores.h"
@@ -59,6 +61,8 @@
 #include "midipp_volume.h"
 #include "midipp_devsel.h"
 #include "midipp_onlinetabs.h"
+#include "midipp_engine.h"
+#include "midipp_loader.h"
 
 uint8_t
 MppMainWindow :: noise8(uint8_t factor)
@@ -90,6 +94,9 @@ MppMainWindow :: MppMainWindow()
 
 	umidi20_mutex_init(&mtx);
 
+	engine = new MppEngine(this);
+	loader = new MppLoader(this);
+
 	noiseRem = 1;
 
 	defaultFont.fromString(QString("Sans Serif,-1,20,5,75,0,0,0,0,0"));
@@ -175,6 +182,9 @@ MppMainWindow :: MppMainWindow()
 
 	connect(&watchdog, SIGNAL(timeout()), this, SLOT(handle_watchdog()));
 
+	tim_refresh.setSingleShot(true);
+	connect(&tim_refresh, SIGNAL(timeout()), this, SLOT(handle_refresh()));
+
 	/* Buttons */
 
 	main_tb->addWidget(0);
@@ -636,10 +646,18 @@ MppMainWindow :: MppMainWindow()
 MppMainWindow :: ~MppMainWindow()
 {
 	watchdog.stop();
+	tim_refresh.stop();
 	tim_config_init.stop();
 	tim_config_apply.stop();
 
+	delete loader;
+
 	MidiUnInit();
+
+	delete engine;
+
+	free(convLineStart);
+	free(convLineEnd);
 }
 
 void
@@ -679,6 +697,8 @@ MppMainWindow :: handle_compile(int force)
 		handle_stop();
 		atomic_unlock();
 	}
+
+	notify(MPP_DIRTY_VIEW_ALL);
 }
 
 void
@@ -821,58 +841,70 @@ MppMainWindow :: handle_watchdog_sub(MppScoreMain *sm, int update_cursor)
 		sm->watchdog();
 	}
 
-	sm->viewWidgetSub->update();
+	sm->viewUpdate();
 	sm->sheet->update();
 }
 
+/*
+ * Request a GUI update. The updates are coalesced and applied by
+ * handle_refresh() at most once per display frame. Can be called
+ * from any thread, locked or unlocked.
+ */
 void
-MppMainWindow :: handle_watchdog()
+MppMainWindow :: notify(uint32_t mask)
 {
-	int bpm;
-	uint8_t instr_update;
-	uint8_t cursor_update;
-	uint8_t key_mode_update;
-	uint8_t ops;
-	uint8_t score_record_on;
+	if (dirtyMask.fetchAndOrRelease(mask) == 0)
+		QMetaObject::invokeMethod(this, "handle_dirty", Qt::QueuedConnection);
+}
 
-	/* update focus if any */
-	handle_tab_changed();
+void
+MppMainWindow :: handle_dirty()
+{
+	QScreen *ps;
+	int rate;
 
-	atomic_lock();
-	cursor_update = cursorUpdate;
-	cursorUpdate = 0;
-	instr_update = instrUpdated;
-	instrUpdated = 0;
-	key_mode_update = keyModeUpdated;
-	keyModeUpdated = 0;
-	ops = doOperation;
-	doOperation = 0;
-	bpm = dlg_bpm->bpm_other;
-	score_record_on = scoreRecordOn;
-	atomic_unlock();
+	if (tim_refresh.isActive())
+		return;
 
-	if (score_record_on)
-		tab_chord_gl->watchdog();
+	ps = QGuiApplication::primaryScreen();
+	rate = (ps != NULL) ? (int)ps->refreshRate() : 0;
+	if (rate < 24 || rate > 240)
+		rate = 60;
 
-	if (instr_update)
-		tab_instrument->handle_instr_changed();
+	tim_refresh.start(1000 / rate);
+}
 
-	if (bpm < 0)
-		bpm = 0;
-	else if (bpm > 9999)
-		bpm = 9999;
+void
+MppMainWindow :: handle_refresh()
+{
+	uint32_t mask;
+	uint8_t ops;
 
-	lbl_bpm_avg_val->display(bpm);
+	mask = dirtyMask.fetchAndStoreAcquire(0);
+	if (mask == 0)
+		return;
 
-	do_clock_stats();
+	if (mask & MPP_DIRTY_INSTR)
+		tab_instrument->handle_instr_changed();
 
 	for (uint8_t x = 0; x != MPP_MAX_VIEWS; x++) {
-		if (key_mode_update)
+		if (mask & MPP_DIRTY_KEY_MODE)
 			handle_mode(x, 0);
-		handle_watchdog_sub(scores_main[x], cursor_update);
+		if (mask & (MPP_DIRTY_CURSOR | MPP_DIRTY_VIEW(x)))
+			handle_watchdog_sub(scores_main[x], mask & MPP_DIRTY_CURSOR);
 	}
 
-	tab_loop->watchdog();
+	if (mask & MPP_DIRTY_LOOP)
+		tab_loop->watchdog();
+
+	if (mask & MPP_DIRTY_OPERATION) {
+		atomic_lock();
+		ops = doOperation;
+		doOperation = 0;
+		atomic_unlock();
+	} else {
+		ops = 0;
+	}
 
 	if (ops & MPP_OPERATION_PAUSE)
 		handle_midi_pause();
@@ -889,6 +921,47 @@ MppMainWindow :: handle_watchdog()
 	}
 }
 
+/*
+ * Periodic housekeeping of the time based displays. Updates
+ * triggered by MIDI events are handled by handle_refresh().
+ */
+void
+MppMainWindow :: handle_watchdog()
+{
+	int bpm;
+	uint8_t score_record_on;
+
+	/* update focus if any */
+	handle_tab_changed();
+
+	atomic_lock();
+	bpm = dlg_bpm->bpm_other;
+	score_record_on = scoreRecordOn;
+	atomic_unlock();
+
+	if (score_record_on)
+		tab_chord_gl->watchdog();
+
+	/* the active chord overlay is blinking */
+	for (uint8_t x = 0; x != MPP_MAX_VIEWS; x++) {
+		if (scores_main[x]->keyMode == MM_PASS_NONE_CHORD_PIANO ||
+		    scores_main[x]->keyMode == MM_PASS_NONE_CHORD_AUX)
+			notify(MPP_DIRTY_VIEW(x));
+	}
+
+	if (bpm < 0)
+		bpm = 0;
+	else if (bpm > 9999)
+		bpm = 9999;
+
+	if (lbl_bpm_avg_val->intValue() != bpm)
+		lbl_bpm_avg_val->display(bpm);
+
+	do_clock_stats();
+
+	tab_loop->watchdog();
+}
+
 void
 MppMainWindow :: handle_midi_file_clear_name()
 {
@@ -965,12 +1038,8 @@ MppMainWindow :: handle_midi_file_open(int how)
 	  new QFileDialog(*this, tr("Select MIDI File"),
 		Mpp.HomeDirMid,
 		QString("MIDI File (*.mid *.MID)"));
-	struct umidi20_song *song_copy;
-	struct umidi20_track *track_copy;
-	struct umidi20_event *event;
-	struct umidi20_event *event_copy;
+	MppLoaderJob *job;
 	QByteArray data;
-	unsigned int x;
 
 	diag->setAcceptMode(QFileDialog::AcceptOpen);
 	diag->setFileMode(QFileDialog::ExistingFile);
@@ -979,42 +1048,51 @@ MppMainWindow :: handle_midi_file_open(int how)
 
 		Mpp.HomeDirMid = diag->directory().path();
 
-		if (how & 1) {
+		QString fname(diag->selectedFiles()[0]);
+
+		if (MppReadRawFile(fname, &data) == 0) {
+			/* the file is loaded by the loader thread */
+			job = new MppLoaderJob(MPP_LOADER_MIDI, data, how);
+			job->name = fname;
+			loader->queue(job);
+		} else if (how & (4 | 1)) {
 			handle_midi_file_clear_name();
-			handle_rewind();
-		} else {
-			handle_midi_file_new();
 		}
+	}
 
-		CurrMidiFileName = new QString(diag->selectedFiles()[0]);
-
-		if (MppReadRawFile(*CurrMidiFileName, &data) == 0) {
-		
-			atomic_lock();
-			song_copy = umidi20_load_file(&mtx,
-			    (const uint8_t *)data.data(), data.size());
-			atomic_unlock();
+	delete diag;
+}
 
-			if (song_copy == NULL) {
-				QMessageBox box;
+void
+MppMainWindow :: handle_midi_file_loaded(MppLoaderJob *job)
+{
+	struct umidi20_song *song_copy = job->song;
+	struct umidi20_track *track_copy;
+	struct umidi20_event *event;
+	struct umidi20_event *event_copy;
+	unsigned int x;
+	int how = job->view;
 
-				box.setText(tr("Invalid MIDI file!"));
-				box.setStandardButtons(QMessageBox::Ok);
-				box.setIcon(QMessageBox::Information);
-				box.setWindowIcon(QIcon(MppIconFile));
-				box.setWindowTitle(MppVersion);
-				box.exec();
-			} else {
-				goto load_file;
-			}
-		} else {
-			song_copy = NULL;
-		}
+	if (how & 1) {
+		handle_midi_file_clear_name();
+		handle_rewind();
+	} else {
+		handle_midi_file_new();
 	}
 
-	goto done;
+	CurrMidiFileName = new QString(job->name);
 
-load_file:
+	if (song_copy == NULL) {
+		QMessageBox box;
+
+		box.setText(tr("Invalid MIDI file!"));
+		box.setStandardButtons(QMessageBox::Ok);
+		box.setIcon(QMessageBox::Information);
+		box.setWindowIcon(QIcon(MppIconFile));
+		box.setWindowTitle(MppVersion);
+		box.exec();
+		goto done;
+	}
 
 	printf("format %d\n", song_copy->midi_file_format);
 	printf("resolution %d\n", song_copy->midi_resolution);
@@ -1054,8 +1132,6 @@ load_file:
 		break;
 	}
 
-	umidi20_song_free(song_copy);
-
 	update_play_device_no();
 
 	atomic_unlock();
@@ -1066,8 +1142,6 @@ done:
 	/* make sure we save into a new file */
 	if (how & (4 | 1))
 		handle_midi_file_clear_name();
-
-	delete diag;
 }
 
 /* must be called locked */
@@ -1414,6 +1488,7 @@ MppMainWindow :: handle_config_apply()
 	atomic_lock();
 	memcpy(devSelMap, deviceSelectionMap, sizeof(devSelMap));
 	memcpy(devInputMask, devInputMaskCopy, sizeof(devInputMask));
+	update_tx_plan();
 	atomic_unlock();
 	
 	handle_config_reload();
@@ -1543,7 +1618,8 @@ MppMainWindow :: check_play(uint8_t index, uint8_t chan, uint32_t off, uint8_t d
 	if (index >= MPP_MAX_TRACKS || chan >= 0x10)
 		return (false);
 
-	handle_midi_trigger();
+	if (midiTriggered == 0)
+		handle_midi_trigger();
 
 	/* compute relative time distance */
 	pos = umidi20_get_curr_position() - startPosition + off;
@@ -1572,7 +1648,8 @@ MppMainWindow :: check_record(uint8_t index, uint8_t chan, uint32_t off)
 	if (midiRecordOff || index >= MPP_MAX_TRACKS || chan >= 0x10)
 		return (false);
 
-	handle_midi_trigger();
+	if (midiTriggered == 0)
+		handle_midi_trigger();
 
 	pos = (umidi20_get_curr_position() - startPosition + off) & 0x3FFFFFFFU;
 	if (pos < MPP_MIN_POS)
@@ -1587,6 +1664,67 @@ MppMainWindow :: check_record(uint8_t index, uint8_t chan, uint32_t off)
 	return (true);
 }
 
+/*
+ * Prepare for output on the given track and return the number of
+ * precomputed destinations in outRoute[index][]. The current
+ * position is read once and must be passed to output_route().
+ * Must be called locked.
+ */
+uint8_t
+MppMainWindow :: output_plan(uint8_t index, uint32_t *pnow)
+{
+	if (index >= MPP_MAX_TRACKS)
+		return (0);
+
+	if (midiTriggered == 0)
+		handle_midi_trigger();
+
+	*pnow = umidi20_get_curr_position() - startPosition;
+	noteMode = scores_main[index / MPP_TRACKS_PER_VIEW]->noteMode;
+
+	return (outRouteNum[index]);
+}
+
+/* must be called locked */
+bool
+MppMainWindow :: output_route(const struct MppOutputRoute *pr, uint8_t chan, uint32_t now)
+{
+	struct mid_data *d = &mid_data;
+	uint32_t pos;
+
+	if (chan >= 0x10)
+		return (false);
+
+	switch (pr->type) {
+	case MPP_ROUTE_PLAY:
+		/* compensate for processing delay */
+		pos = now;
+		if (pos != 0)
+			pos--;
+		break;
+	case MPP_ROUTE_RECORD:
+		/* recording may be paused temporarily, see handle_stop() */
+		if (midiRecordOff)
+			return (false);
+		pos = now & 0x3FFFFFFFU;
+		if (pos < MPP_MIN_POS)
+			pos = MPP_MIN_POS;
+		break;
+	default:
+		pos = (now & 0x3FFFFFFFU) % 100000000UL;
+		if (pos == 0)
+			pos = 1;
+		pos = tab_loop->record_position(pr->loop, pos);
+		break;
+	}
+
+	d->track = pr->track;
+	mid_set_channel(d, chan);
+	mid_set_position(d, pos);
+	mid_set_device_no(d, pr->device_no);
+	return (true);
+}
+
 int
 MppMainWindow :: do_extended_alloc(int key, int refcount)
 {
@@ -1830,6 +1968,7 @@ MppMainWindow :: handle_stop(int flag)
 
 	    /* MPE mode cleanup */
 	    memset(scores_main[z]->inputKeyToChannel, 0, sizeof(scores_main[z]->inputKeyToChannel));
+	    memset(scores_main[z]->inputChannelKeys, 0, sizeof(scores_main[z]->inputChannelKeys));
 
 	    /* check if we should kill the pedal, modulation and pitch */
 	    if (!(flag & 1)) {
@@ -1866,15 +2005,31 @@ void
 MppMainWindow :: do_clock_stats(void)
 {
 	uint32_t time_offset;
+	uint32_t count;
 	char buf[32];
 
 	atomic_lock();
 	time_offset = get_time_offset();
 	atomic_unlock();
 
+	count = engine->stats_count.loadRelaxed();
+
+	/* avoid repainting the display when idle */
+	if (time_offset == clockLastOffset && count == clockLastCount)
+		return;
+	clockLastOffset = time_offset;
+	clockLastCount = count;
+
 	snprintf(buf, sizeof(buf), "%u.%03u", time_offset / 1000, time_offset % 1000);
 
 	lbl_curr_time_val->display(QString(buf));
+
+	lbl_curr_time_val->setToolTip(tr("Input latency: %1us last, %2us max, "
+	    "%3 events, %4 unqueued")
+	    .arg(engine->stats_last_us.loadRelaxed())
+	    .arg(engine->stats_max_us.loadRelaxed())
+	    .arg(count)
+	    .arg(engine->stats_overflow.loadRelaxed()));
 }
 
 /* NOTE: Is called unlocked */
@@ -1882,6 +2037,18 @@ static void
 MidiEventRxCallback(uint8_t device_no, void *arg, struct umidi20_event *event, uint8_t *drop)
 {
 	MppMainWindow *mw = (MppMainWindow *)arg;
+
+	*drop = 1;
+
+	/* let the engine thread process the event */
+	mw->engine->enqueue(device_no, event);
+}
+
+/* must be called locked */
+void
+MppMainWindow :: handle_rx_event_locked(uint8_t device_no, struct umidi20_event *event)
+{
+	MppMainWindow *mw = this;
 	MppScoreMain *sm;
 	uint32_t what;
 	uint8_t chan;
@@ -1891,10 +2058,6 @@ MidiEventRxCallback(uint8_t device_no, void *arg, struct umidi20_event *event, u
 	int vel;
 	int n;
 
-	*drop = 1;
-
-	mw->atomic_lock();
-
 	what = umidi20_event_get_what(event);
 
 	if (what & UMIDI20_WHAT_CHANNEL) {
@@ -1944,6 +2107,9 @@ MidiEventRxCallback(uint8_t device_no, void *arg, struct umidi20_event *event, u
 			mpe_channel = 0;
 		}
 
+		/* the view may change, repaint it */
+		mw->notify(MPP_DIRTY_VIEW(n));
+
 		chan = sm->synthChannel;
 
 		ctrl = umidi20_event_get_control_address(event);
@@ -1957,22 +2123,23 @@ MidiEventRxCallback(uint8_t device_no, void *arg, struct umidi20_event *event, u
 			vel = umidi20_event_get_pitch_value(event);
 
 			if (sm->inputChannel == MPP_CHAN_MPE && chan != 0) {
-				for (key = 0; key != 128; key++) {
-					if (sm->inputKeyToChannel[key] != chan)
-						continue;
-
-					switch (sm->keyMode) {
-					case MM_PASS_ALL:
-						mw->output_key_pitch(MPP_DEFAULT_TRACK(sm->unit),
-						    sm->synthChannel, key * MPP_BAND_STEP_12, vel);
-						break;
-					case MM_PASS_NONE_CHORD_PIANO:
-					case MM_PASS_NONE_CHORD_AUX:
-					case MM_PASS_NONE_CHORD_TRANS:
-						sm->handleKeyPitchChord(key * MPP_BAND_STEP_12, vel, 0);
-						break;
-					default:
-						break;
+				for (unsigned w = 0; w != 128 / 32; w++) {
+					for (uint32_t m = sm->inputChannelKeys[chan][w]; m != 0; m &= m - 1) {
+						key = w * 32 + qCountTrailingZeroBits(m);
+
+						switch (sm->keyMode) {
+						case MM_PASS_ALL:
+							mw->output_key_pitch(MPP_DEFAULT_TRACK(sm->unit),
+							    sm->synthChannel, key * MPP_BAND_STEP_12, vel);
+							break;
+						case MM_PASS_NONE_CHORD_PIANO:
+						case MM_PASS_NONE_CHORD_AUX:
+						case MM_PASS_NONE_CHORD_TRANS:
+							sm->handleKeyPitchChord(key * MPP_BAND_STEP_12, vel, 0);
+							break;
+						default:
+							break;
+						}
 					}
 				}
 			} else {
@@ -2004,22 +2171,23 @@ MidiEventRxCallback(uint8_t device_no, void *arg, struct umidi20_event *event, u
 			chan = umidi20_event_get_channel(event) & 0x0F;
 
 			if (sm->inputChannel == MPP_CHAN_MPE && chan != 0) {
-				for (key = 0; key != 128; key++) {
-					if (sm->inputKeyToChannel[key] != chan)
-						continue;
-
-					switch (sm->keyMode) {
-					case MM_PASS_ALL:
-						mw->output_key_pressure(MPP_DEFAULT_TRACK(sm->unit),
-						    sm->synthChannel, key * MPP_BAND_STEP_12, vel, 0);
-						break;
-					case MM_PASS_NONE_CHORD_PIANO:
-					case MM_PASS_NONE_CHORD_AUX:
-					case MM_PASS_NONE_CHORD_TRANS:
-						sm->handleKeyPressureChord(key * MPP_BAND_STEP_12, vel, 0);
-						break;
-					default:
-						break;
+				for (unsigned w = 0; w != 128 / 32; w++) {
+					for (uint32_t m = sm->inputChannelKeys[chan][w]; m != 0; m &= m - 1) {
+						key = w * 32 + qCountTrailingZeroBits(m);
+
+						switch (sm->keyMode) {
+						case MM_PASS_ALL:
+							mw->output_key_pressure(MPP_DEFAULT_TRACK(sm->unit),
+							    sm->synthChannel, key * MPP_BAND_STEP_12, vel, 0);
+							break;
+						case MM_PASS_NONE_CHORD_PIANO:
+						case MM_PASS_NONE_CHORD_AUX:
+						case MM_PASS_NONE_CHORD_TRANS:
+							sm->handleKeyPressureChord(key * MPP_BAND_STEP_12, vel, 0);
+							break;
+						default:
+							break;
+						}
 					}
 				}
 			} else {
@@ -2043,9 +2211,11 @@ MidiEventRxCallback(uint8_t device_no, void *arg, struct umidi20_event *event, u
 
 			if (sm->inputChannel == MPP_CHAN_MPE && chan != 0) {
 				/* make sure key start is paired with key end */
-				if (sm->inputKeyToChannel[key] != 0)
+				if (sm->inputKeyToChannel[key] != 0) {
+					sm->inputKeyClear(key);
 					sm->handleMidiKeyReleaseLocked(key * MPP_BAND_STEP_12, vel);
-				sm->inputKeyToChannel[key] = chan;
+				}
+				sm->inputKeySet(key, chan);
 			}
 			sm->handleMidiKeyPressLocked(key * MPP_BAND_STEP_12, vel);
 
@@ -2056,7 +2226,7 @@ MidiEventRxCallback(uint8_t device_no, void *arg, struct umidi20_event *event, u
 			vel = umidi20_event_get_velocity(event);
 
 			if (sm->inputChannel == MPP_CHAN_MPE && chan != 0)
-				sm->inputKeyToChannel[key] = 0;
+				sm->inputKeyClear(key);
 
 			sm->handleMidiKeyReleaseLocked(key * MPP_BAND_STEP_12, vel);
 
@@ -2073,22 +2243,23 @@ MidiEventRxCallback(uint8_t device_no, void *arg, struct umidi20_event *event, u
 			if (sm->inputChannel == MPP_CHAN_MPE && chan != 0) {
 				vel *= MPP_BAND_STEP_12;
 
-				for (key = 0; key != 128; key++) {
-					if (sm->inputKeyToChannel[key] != chan)
-						continue;
-
-					switch (sm->keyMode) {
-					case MM_PASS_ALL:
-						mw->output_key_control(MPP_DEFAULT_TRACK(sm->unit),
-						    sm->synthChannel, key * MPP_BAND_STEP_12, ctrl, vel, 0);
-						break;
-					case MM_PASS_NONE_CHORD_PIANO:
-					case MM_PASS_NONE_CHORD_AUX:
-					case MM_PASS_NONE_CHORD_TRANS:
-						sm->handleKeyControlChord(key * MPP_BAND_STEP_12, ctrl, vel, 0);
-						break;
-					default:
-						break;
+				for (unsigned w = 0; w != 128 / 32; w++) {
+					for (uint32_t m = sm->inputChannelKeys[chan][w]; m != 0; m &= m - 1) {
+						key = w * 32 + qCountTrailingZeroBits(m);
+
+						switch (sm->keyMode) {
+						case MM_PASS_ALL:
+							mw->output_key_control(MPP_DEFAULT_TRACK(sm->unit),
+							    sm->synthChannel, key * MPP_BAND_STEP_12, ctrl, vel, 0);
+							break;
+						case MM_PASS_NONE_CHORD_PIANO:
+						case MM_PASS_NONE_CHORD_AUX:
+						case MM_PASS_NONE_CHORD_TRANS:
+							sm->handleKeyControlChord(key * MPP_BAND_STEP_12, ctrl, vel, 0);
+							break;
+						default:
+							break;
+						}
 					}
 				}
 			} else {
@@ -2096,7 +2267,67 @@ MidiEventRxCallback(uint8_t device_no, void *arg, struct umidi20_event *event, u
 			}
 		}
 	}
-	mw->atomic_unlock();
+}
+
+/*
+ * Precompute the list of destinations each track is output to by
+ * output_key() and friends: the playback queue, the recording queue
+ * and the queue of every loop currently recording. Must be called
+ * locked whenever a loop starts or stops recording.
+ */
+void
+MppMainWindow :: update_out_plan()
+{
+	struct MppOutputRoute *pr;
+	uint8_t n;
+
+	for (unsigned x = 0; x != MPP_MAX_TRACKS; x++) {
+		pr = outRoute[x];
+
+		pr->track = track[x];
+		pr->type = MPP_ROUTE_PLAY;
+		pr->loop = 0;
+		pr->device_no = MPP_MAGIC_DEVNO + x;
+		pr++;
+
+		pr->track = track[x];
+		pr->type = MPP_ROUTE_RECORD;
+		pr->loop = 0;
+		pr->device_no = 0xFF;
+		pr++;
+
+		for (n = 0; n != MPP_LOOP_MAX; n++) {
+			if (tab_loop->loop[n].state != MppLoopTab::ST_REC)
+				continue;
+			pr->track = tab_loop->loop[n].track[x];
+			pr->type = MPP_ROUTE_LOOP;
+			pr->loop = n;
+			pr->device_no = 0xFF;
+			pr++;
+		}
+		outRouteNum[x] = pr - outRoute[x];
+	}
+}
+
+/* must be called locked */
+static void
+MppTxFanOut(struct umidi20_event *event, uint32_t mask)
+{
+	struct umidi20_event *p_event;
+	int x;
+
+	for (x = 0; mask != 0; x++, mask >>= 1) {
+		if ((mask & 1) == 0)
+			continue;
+
+		/* duplicate event */
+		p_event = umidi20_event_copy(event, 1);
+		if (p_event != NULL) {
+			p_event->device_no = x;
+			umidi20_event_queue_insert(&root_dev.play[x].queue,
+			    p_event, UMIDI20_CACHE_INPUT);
+		}
+	}
 }
 
 /* NOTE: Is called unlocked */
@@ -2104,8 +2335,8 @@ static void
 MidiEventTxCallback(uint8_t device_no, void *arg, struct umidi20_event *event, uint8_t *drop)
 {
 	MppMainWindow *mw = (MppMainWindow *)arg;
-	struct umidi20_event *p_event;
 	uint32_t what;
+	uint32_t mask;
 	int do_drop = 0;
 
 	mw->atomic_lock();
@@ -2141,7 +2372,6 @@ MidiEventTxCallback(uint8_t device_no, void *arg, struct umidi20_event *event, u
 		} else if (device_no >= MPP_MAGIC_DEVNO &&
 		    device_no < UMIDI20_N_DEVICES) {
 			int index = device_no - MPP_MAGIC_DEVNO;
-			int devno = -2;	/* no device */
 
 			if (vel != 0) {
 				/* adjust volume, if any */
@@ -2155,57 +2385,22 @@ MidiEventTxCallback(uint8_t device_no, void *arg, struct umidi20_event *event, u
 				umidi20_event_set_velocity(event, vel);
 			}
 
-			/* check if we should duplicate events for other devices */
-			MppScoreMain *sm = mw->scores_main[index / MPP_TRACKS_PER_VIEW];
+			mask = mw->txPlayMask[index] & ~mw->txMuteChannel[chan];
 
-			switch (index % MPP_TRACKS_PER_VIEW) {
-			case MPP_DEFAULT_TRACK(0):
-				devno = sm->synthDevice;
-				break;
-			case MPP_TREBLE_TRACK(0):
-				devno = sm->synthDeviceTreb;
-				break;
-			case MPP_BASS_TRACK(0):
-				devno = sm->synthDeviceBase;
-				break;
-			default:
-				break;
+			/* check for pedal and control events mute */
+			if (what & UMIDI20_WHAT_CONTROL_VALUE) {
+				if (umidi20_event_get_control_address(event) == 0x40)
+					mask &= ~mw->txMutePedal;
+				else
+					mask &= ~mw->txMuteControl;
 			}
 
-			for (int x = 0; x != MPP_MAX_DEVS; x++) {
-				if (devno != -1 && mw->devSelMap[x] != devno)
-					continue;
-				if (((mw->deviceBits >> (2 * x)) & MPP_DEV0_PLAY) == 0)
-					continue;
-				/* check for pedal and control events mute */
-				if (what & UMIDI20_WHAT_CONTROL_VALUE) {
-					if (umidi20_event_get_control_address(event) == 0x40) {
-						if (mw->mutePedal[x])
-							continue;
-					} else {
-						if (mw->muteAllControl[x])
-							continue;
-					}
-				}
-
-				/* check for program mute */
-				if (what & UMIDI20_WHAT_PROGRAM_VALUE) {
-					if (mw->muteProgram[x])
-						continue;
-				}
-
-				/* check for channel mute */
-				if (mw->muteMap[x][chan])
-					continue;
+			/* check for program mute */
+			if (what & UMIDI20_WHAT_PROGRAM_VALUE)
+				mask &= ~mw->txMuteProgram;
 
-				/* duplicate event */
-				p_event = umidi20_event_copy(event, 1);
-				if (p_event != NULL) {
-					p_event->device_no = x;
-					umidi20_event_queue_insert(&root_dev.play[x].queue,
-					    p_event, UMIDI20_CACHE_INPUT);
-				}
-			}
+			/* duplicate events for other devices */
+			MppTxFanOut(event, mask);
 			do_drop = 1;
 		} else {
 			do_drop = 1;
@@ -2217,41 +2412,9 @@ MidiEventTxCallback(uint8_t device_no, void *arg, struct umidi20_event *event, u
 		} else if (device_no >= MPP_MAGIC_DEVNO &&
 		    device_no < UMIDI20_N_DEVICES) {
 			int index = device_no - MPP_MAGIC_DEVNO;
-			int devno = -2;	/* no device */
 
-			/* check if we should duplicate events for other devices */
-			MppScoreMain *sm = mw->scores_main[index / MPP_TRACKS_PER_VIEW];
-
-			switch (index % MPP_TRACKS_PER_VIEW) {
-			case MPP_DEFAULT_TRACK(0):
-				devno = sm->synthDevice;
-				break;
-			case MPP_TREBLE_TRACK(0):
-				devno = sm->synthDeviceTreb;
-				break;
-			case MPP_BASS_TRACK(0):
-				devno = sm->synthDeviceBase;
-				break;
-			default:
-				break;
-			}
-
-			for (int x = 0; x != MPP_MAX_DEVS; x++) {
-				if (devno != -1 && mw->devSelMap[x] != devno)
-					continue;
-				if (((mw->deviceBits >> (2 * x)) & MPP_DEV0_PLAY) == 0)
-					continue;
-				if (mw->muteAllNonChannel[x])
-					continue;
-
-				/* duplicate event */
-				p_event = umidi20_event_copy(event, 1);
-				if (p_event != NULL) {
-					p_event->device_no = x;
-					umidi20_event_queue_insert(&root_dev.play[x].queue,
-					    p_event, UMIDI20_CACHE_INPUT);
-				}
-			}
+			/* duplicate events for other devices */
+			MppTxFanOut(event, mw->txPlayMask[index] & ~mw->txMuteNonChannel);
 			do_drop = 1;
 		} else {
 			do_drop = 1;
@@ -2263,6 +2426,73 @@ MidiEventTxCallback(uint8_t device_no, void *arg, struct umidi20_event *event, u
 	mw->atomic_unlock();
 }
 
+/*
+ * Precompute which output devices each track is duplicated to, and
+ * which output devices mute the various kinds of events, so that
+ * MidiEventTxCallback() does not need to evaluate the configuration
+ * for every event. Must be called locked whenever the device
+ * selection, device configuration or mute maps change.
+ */
+void
+MppMainWindow :: update_tx_plan()
+{
+	int devno;
+	int x;
+	int y;
+
+	memset(txPlayMask, 0, sizeof(txPlayMask));
+	memset(txMuteChannel, 0, sizeof(txMuteChannel));
+	txMutePedal = 0;
+	txMuteControl = 0;
+	txMuteProgram = 0;
+	txMuteNonChannel = 0;
+
+	for (x = 0; x != MPP_MAX_DEVS; x++) {
+		if (mutePedal[x])
+			txMutePedal |= (1U << x);
+		if (muteAllControl[x])
+			txMuteControl |= (1U << x);
+		if (muteProgram[x])
+			txMuteProgram |= (1U << x);
+		if (muteAllNonChannel[x])
+			txMuteNonChannel |= (1U << x);
+		for (y = 0; y != 16; y++) {
+			if (muteMap[x][y])
+				txMuteChannel[y] |= (1U << x);
+		}
+	}
+
+	for (y = 0; y != MPP_MAX_TRACKS; y++) {
+		MppScoreMain *sm = scores_main[y / MPP_TRACKS_PER_VIEW];
+
+		if (sm == 0)
+			continue;
+
+		switch (y % MPP_TRACKS_PER_VIEW) {
+		case MPP_DEFAULT_TRACK(0):
+			devno = sm->synthDevice;
+			break;
+		case MPP_TREBLE_TRACK(0):
+			devno = sm->synthDeviceTreb;
+			break;
+		case MPP_BASS_TRACK(0):
+			devno = sm->synthDeviceBase;
+			break;
+		default:
+			devno = -2;	/* no device */
+			break;
+		}
+
+		for (x = 0; x != MPP_MAX_DEVS; x++) {
+			if (devno != -1 && devSelMap[x] != devno)
+				continue;
+			if (((deviceBits >> (2 * x)) & MPP_DEV0_PLAY) == 0)
+				continue;
+			txPlayMask[y] |= (1U << x);
+		}
+	}
+}
+
 /* must be called locked */
 uint8_t
 MppMainWindow :: do_instr_check(struct umidi20_event *event, int dry_run)
@@ -2283,7 +2513,7 @@ MppMainWindow :: do_instr_check(struct umidi20_event *event, int dry_run)
 			instr[chan].bank |= (val << 7);
 			instr[chan].updated |= 2;
 			instr[chan].muted = 0;
-			instrUpdated = 1;
+			notify(MPP_DIRTY_INSTR);
 			return (1);
 		} else if (addr == 0x20) {
 			if (dry_run)
@@ -2292,7 +2522,7 @@ MppMainWindow :: do_instr_check(struct umidi20_event *event, int dry_run)
 			instr[chan].bank |= (val & 0x7F);
 			instr[chan].updated |= 2;
 			instr[chan].muted = 0;
-			instrUpdated = 1;
+			notify(MPP_DIRTY_INSTR);
 			return (1);
 		}
 	} else if (umidi20_event_get_what(event) & UMIDI20_WHAT_PROGRAM_VALUE) {
@@ -2307,7 +2537,7 @@ MppMainWindow :: do_instr_check(struct umidi20_event *event, int dry_run)
 		instr[chan].prog = val;
 		instr[chan].updated |= 2;
 		instr[chan].muted = 0;
-		instrUpdated = 1;
+		notify(MPP_DIRTY_INSTR);
 		return (1);
 	}
 	return (0);
@@ -2368,6 +2598,41 @@ found:
 		handle_compile();
 }
 
+/*
+ * Make sure the line table has room for at least "num" lines. New
+ * lines are zeroed. Returns zero on success.
+ */
+int
+MppMainWindow :: convert_midi_reserve(uint32_t num)
+{
+	uint32_t *pstart;
+	uint32_t *pend;
+	uint32_t max;
+
+	if (num <= convLineMax)
+		return (0);
+
+	max = convLineMax ? convLineMax : 1024;
+	while (max < num)
+		max *= 2;
+
+	pstart = (uint32_t *)realloc(convLineStart, sizeof(uint32_t) * max);
+	if (pstart == 0)
+		return (-1);
+	convLineStart = pstart;
+
+	pend = (uint32_t *)realloc(convLineEnd, sizeof(uint32_t) * max);
+	if (pend == 0)
+		return (-1);
+	convLineEnd = pend;
+
+	memset(pstart + convLineMax, 0, sizeof(uint32_t) * (max - convLineMax));
+	memset(pend + convLineMax, 0, sizeof(uint32_t) * (max - convLineMax));
+
+	convLineMax = max;
+	return (0);
+}
+
 int
 MppMainWindow :: convert_midi_duration(struct umidi20_track *im_track, uint32_t thres, uint32_t chan_mask)
 {
@@ -2384,8 +2649,10 @@ MppMainWindow :: convert_midi_duration(struct umidi20_track *im_track, uint32_t
 	curr_pos = 0;
 	duration = 0;
 
-	memset(convLineStart, 0, sizeof(convLineStart));
-	memset(convLineEnd, 0, sizeof(convLineEnd));
+	if (convLineMax != 0) {
+		memset(convLineStart, 0, sizeof(uint32_t) * convLineMax);
+		memset(convLineEnd, 0, sizeof(uint32_t) * convLineMax);
+	}
 
 	UMIDI20_QUEUE_FOREACH(event, &im_track->queue) {
 
@@ -2402,7 +2669,7 @@ MppMainWindow :: convert_midi_duration(struct umidi20_track *im_track, uint32_t
 		if (umidi20_event_is_key_start(event)) {
 			if (delta >= thres) {
 				last_pos = curr_pos;
-				if (index < MPP_MAX_LINES) {
+				if (convert_midi_reserve(index + 2) == 0) {
 					convLineStart[index] = last_pos;
 					index++;
 				}
@@ -2410,11 +2677,12 @@ MppMainWindow :: convert_midi_duration(struct umidi20_track *im_track, uint32_t
 		}
 
 		if (umidi20_event_is_key_end(event)) {
-			if (index > 0 && index < MPP_MAX_LINES)
+			if (index > 0)
 				convLineEnd[index - 1] = curr_pos;
 		}
 	}
-	if ((curr_pos + duration) > last_pos && index < MPP_MAX_LINES) {
+	if ((curr_pos + duration) > last_pos &&
+	    convert_midi_reserve(index + 2) == 0) {
 		convLineStart[index] = curr_pos + duration;
 		index++;
 	}
@@ -2483,6 +2751,7 @@ MppMainWindow :: import_midi_track(struct umidi20_track *im_track, uint32_t flag
 	uint32_t chan_mask = 0;
 	uint32_t thres = 25;
 	uint32_t sumdur = 0;
+	uint32_t num_keys = 0;
 	uint8_t last_chan = 0;
 	uint8_t chan;
 	uint8_t first_score;
@@ -2498,6 +2767,7 @@ MppMainWindow :: import_midi_track(struct umidi20_track *im_track, uint32_t flag
 		if (umidi20_event_is_key_start(event)) {
 			chan = umidi20_event_get_channel(event) & 0xF;
 			chan_mask |= (1 << chan);
+			num_keys++;
 		}
 	}
 
@@ -2528,6 +2798,11 @@ MppMainWindow :: import_midi_track(struct umidi20_track *im_track, uint32_t flag
 
 	max_index = convert_midi_duration(im_track, thres, chan_mask);
 
+	/* reserve space for the keys and the line durations */
+	output.reserve(output.size() + 8 * num_keys + 48 * max_index);
+	out_block.reserve(4096);
+	out_desc.reserve(256);
+
 	UMIDI20_QUEUE_FOREACH(event, &im_track->queue) {
 
 		if (!(umidi20_event_get_what(event) & UMIDI20_WHAT_CHANNEL))
@@ -2584,8 +2859,9 @@ MppMainWindow :: import_midi_track(struct umidi20_track *im_track, uint32_t flag
 				}
 				output += "\n";
 
-				out_desc = "";
-				out_block = "";
+				/* keep the reserved buffers */
+				out_desc.truncate(0);
+				out_block.truncate(0);
 			}
 
 			last_u = MPP_MAX_DURATION + 1;
@@ -2596,12 +2872,17 @@ MppMainWindow :: import_midi_track(struct umidi20_track *im_track, uint32_t flag
 
 		if (umidi20_event_is_key_start(event)) {
 			uint32_t ext_key;
+			uint32_t hi = max_index;
 
+			/* find the first line starting after the key ends */
 			x = convIndex;
-			while (x < max_index) {
-				if (convLineStart[x] >= end)
-					break;
-				x++;
+			while (x < hi) {
+				uint32_t mid = (x + hi) / 2;
+
+				if (convLineStart[mid] >= end)
+					hi = mid;
+				else
+					x = mid + 1;
 			}
 
 			x = x - convIndex;
@@ -2715,8 +2996,6 @@ MppMainWindow :: handle_gpro_file_import(int view)
 		Mpp.HomeDirGp3,
 		QString("GPro File (*.gp *.gp3 *.gp4 *.GP *.GP3 *.GP4)"));
 	QByteArray data;
-	MppGPro *gpro;
-	QTextCursor *cursor;
 
 	diag->setAcceptMode(QFileDialog::AcceptOpen);
 	diag->setFileMode(QFileDialog::ExistingFile);
@@ -2738,29 +3017,57 @@ MppMainWindow :: handle_gpro_file_import(int view)
 
 			box.exec();
 		} else {
-			goto load_file;
+			loader->queue(new MppLoaderJob(
+			    MPP_LOADER_GPRO_PARSE, data, view));
 		}
 	}
 
-	goto done;
+	delete diag;
+}
+
+void
+MppMainWindow :: handle_gpro_file_parsed(MppLoaderJob *job)
+{
+	MppGPro *gpro;
+	MppLoaderJob *next;
 
-load_file:
+	if (job->gpro == NULL)
+		return;
 
-	gpro = new MppGPro(this, (uint8_t *)data.data(), data.size());
+	gpro = new MppGPro(this, job->gpro);
 
-	cursor = new QTextCursor(scores_main[view]->editWidget->textCursor());
-	cursor->beginEditBlock();
-	cursor->insertText(gpro->output);
-	cursor->endEditBlock();
+	/* convert the selected tracks in the loader thread */
+	next = new MppLoaderJob(MPP_LOADER_GPRO_DUMP, QByteArray(), job->view);
+	next->output = job->output;
+	next->gpro = job->gpro;
+	next->param[0] = gpro->chan_mask;
+	next->param[1] = gpro->single_track;
+	job->gpro = NULL;
 
 	delete gpro;
-	delete cursor;
 
-	handle_compile();
-	handle_make_scores_visible(scores_main[view]);
+	loader->queue(next);
+}
 
-done:
-	delete diag;
+void
+MppMainWindow :: handle_score_text_loaded(MppLoaderJob *job, int erase)
+{
+	MppScoreMain *sm = scores_main[job->view];
+
+	if (erase) {
+		sm->handleScoreFileNew();
+
+		QTextCursor cursor(sm->editWidget->textCursor());
+		cursor.insertText(job->output);
+	} else {
+		QTextCursor cursor(sm->editWidget->textCursor());
+		cursor.beginEditBlock();
+		cursor.insertText(job->output);
+		cursor.endEditBlock();
+	}
+
+	handle_compile();
+	handle_make_scores_visible(sm);
 }
 
 void
@@ -2771,7 +3078,6 @@ MppMainWindow :: handle_mxml_file_import(int view)
 		Mpp.HomeDirMXML,
 		QString("MusicXML file (*.xml *.XML)"));
 	QByteArray data;
-	MppMusicXmlImport *mxml;
 
 	diag->setAcceptMode(QFileDialog::AcceptOpen);
 	diag->setFileMode(QFileDialog::ExistingFile);
@@ -2792,17 +3098,38 @@ MppMainWindow :: handle_mxml_file_import(int view)
 			box.setWindowTitle(MppVersion);
 			box.exec();
 		} else {
-			goto load_file;
+			loader->queue(new MppLoaderJob(
+			    MPP_LOADER_MXML_PARSE, data, view));
 		}
 	}
 
-	goto done;
+	delete diag;
+}
 
-load_file:
+void
+MppMainWindow :: handle_mxml_file_parsed(MppLoaderJob *job)
+{
+	MppMusicXmlImport *mxml;
+	MppLoaderJob *next;
+
+	if (job->type == MPP_LOADER_MXML_PARSE && job->result != 0) {
+		mxml = new MppMusicXmlImport(this, job->result);
+
+		/* convert the selected parts in the loader thread */
+		next = new MppLoaderJob(MPP_LOADER_MXML_DUMP, QByteArray(), job->view);
+		next->mxml = job->mxml;
+		next->param[0] = mxml->flags;
+		next->param[1] = mxml->ipart;
+		next->param[2] = mxml->nmeasure;
+		next->result = mxml->cbx_erase->isChecked();
+		job->mxml = NULL;
 
-	mxml = new MppMusicXmlImport(this, data);
+		delete mxml;
 
-	if (mxml->output.isEmpty()) {
+		loader->queue(next);
+	} else if (job->type == MPP_LOADER_MXML_DUMP && !job->output.isEmpty()) {
+		handle_score_text_loaded(job, job->result);
+	} else {
 		QMessageBox box;
 		box.setText(tr("No parts found in Music XML file!"));
 		box.setStandardButtons(QMessageBox::Ok);
@@ -2810,28 +3137,30 @@ load_file:
 		box.setWindowIcon(QIcon(MppIconFile));
 		box.setWindowTitle(MppVersion);
 		box.exec();
-		goto done;
 	}
+}
 
-	if (mxml->cbx_erase->isChecked()) {
-		scores_main[view]->handleScoreFileNew();
-
-		QTextCursor cursor(scores_main[view]->editWidget->textCursor());
-		cursor.insertText(mxml->output);
-	} else {
-		QTextCursor cursor(scores_main[view]->editWidget->textCursor());
-		cursor.beginEditBlock();
-		cursor.insertText(mxml->output);
-		cursor.endEditBlock();
+/* called when the loader thread has completed a job */
+void
+MppMainWindow :: handle_loader_done(MppLoaderJob *job)
+{
+	switch (job->type) {
+	case MPP_LOADER_MIDI:
+		handle_midi_file_loaded(job);
+		break;
+	case MPP_LOADER_GPRO_PARSE:
+		handle_gpro_file_parsed(job);
+		break;
+	case MPP_LOADER_GPRO_DUMP:
+		handle_score_text_loaded(job, 0);
+		break;
+	case MPP_LOADER_MXML_PARSE:
+	case MPP_LOADER_MXML_DUMP:
+		handle_mxml_file_parsed(job);
+		break;
+	default:
+		break;
 	}
-
-	delete mxml;
-
-	handle_compile();
-	handle_make_scores_visible(scores_main[view]);
-
-done:
-	delete diag;
 }
 
 void
@@ -2865,6 +3194,10 @@ MppMainWindow :: MidiInit(void)
 		umidi20_song_track_add(song, NULL, track[n], 0);
 	}
 
+	update_out_plan();
+
+	engine->start();
+
 	for (n = 0; n != UMIDI20_N_DEVICES; n++) {
 		umidi20_set_record_event_callback(n, &MidiEventRxCallback, this);
 		umidi20_set_play_event_callback(n, &MidiEventTxCallback, this);
@@ -2897,6 +3230,9 @@ MppMainWindow :: MidiUnInit(void)
 
 	handle_rewind();
 
+	/* stop the engine thread, events are processed directly from now on */
+	engine->stop();
+
 	atomic_lock();
 
 	umidi20_song_free(song);
@@ -2968,27 +3304,18 @@ void
 MppMainWindow :: output_key(int index, int chan, int key, int vel, int delay, int dur)
 {
 	struct mid_data *d = &mid_data;
-	uint8_t n;
+	const struct MppOutputRoute *pr;
+	uint32_t now;
+	uint8_t num;
 
 	/* check for time scaling */
 	if (dlg_bpm->period_cur != 0 && dlg_bpm->bpm_other != 0)
 		delay = (dlg_bpm->period_ref * delay) / dlg_bpm->bpm_other;
 
-	/* output key to all playback device(s) */
-	if (check_play(index, chan, 0)) {
-		mid_delay(d, delay);
-		do_key_press(key, vel, dur);
-	}
-
-	/* output key to recording device(s) */
-	if (check_record(index, chan, 0)) {
-		mid_delay(d, delay);
-		do_key_press(key, vel, dur);
-	}
-
-	/* output key to loop recording, if any */
-	for (n = 0; n != MPP_LOOP_MAX; n++) {
-		if (tab_loop->check_record(index, chan, n)) {
+	/* output key to all precomputed destinations */
+	num = output_plan(index, &now);
+	for (pr = outRoute[index]; num--; pr++) {
+		if (output_route(pr, chan, now)) {
 			mid_delay(d, delay);
 			do_key_press(key, vel, dur);
 		}
@@ -3000,22 +3327,14 @@ void
 MppMainWindow :: output_key_pitch(int index, int chan, int key, int amount, uint32_t delay)
 {
 	struct mid_data *d = &mid_data;
-
-	/* output pitch to all playback device(s) */
-	if (check_play(index, chan, 0)) {
-		mid_delay(d, delay);
-		do_key_pitch(key, amount);
-	}
-
-	/* output pitch to recording device(s) */
-	if (check_record(index, chan, 0)) {
-		mid_delay(d, delay);
-		do_key_pitch(key, amount);
-	}
-
-	/* output pitch to loop recording, if any */
-	for (unsigned n = 0; n != MPP_LOOP_MAX; n++) {
-		if (tab_loop->check_record(index, chan, n)) {
+	const struct MppOutputRoute *pr;
+	uint32_t now;
+	uint8_t num;
+
+	/* output pitch to all precomputed destinations */
+	num = output_plan(index, &now);
+	for (pr = outRoute[index]; num--; pr++) {
+		if (output_route(pr, chan, now)) {
 			mid_delay(d, delay);
 			do_key_pitch(key, amount);
 		}
@@ -3027,22 +3346,14 @@ void
 MppMainWindow :: output_key_control(int index, int chan, int key, uint8_t control, int value, uint32_t delay)
 {
 	struct mid_data *d = &mid_data;
-
-	/* output control to all playback device(s) */
-	if (check_play(index, chan, 0)) {
-		mid_delay(d, delay);
-		do_key_control(key, control, value);
-	}
-
-	/* output control to recording device(s) */
-	if (check_record(index, chan, 0)) {
-		mid_delay(d, delay);
-		do_key_control(key, control, value);
-	}
-
-	/* output control to loop recording, if any */
-	for (unsigned n = 0; n != MPP_LOOP_MAX; n++) {
-		if (tab_loop->check_record(index, chan, n)) {
+	const struct MppOutputRoute *pr;
+	uint32_t now;
+	uint8_t num;
+
+	/* output control to all precomputed destinations */
+	num = output_plan(index, &now);
+	for (pr = outRoute[index]; num--; pr++) {
+		if (output_route(pr, chan, now)) {
 			mid_delay(d, delay);
 			do_key_control(key, control, value);
 		}
@@ -3054,22 +3365,14 @@ void
 MppMainWindow :: output_key_pressure(int index, int chan, int key, int pressure, uint32_t delay)
 {
 	struct mid_data *d = &mid_data;
-
-	/* output pressure to all playback device(s) */
-	if (check_play(index, chan, 0)) {
-		mid_delay(d, delay);
-		do_key_pressure(key, pressure);
-	}
-
-	/* output pressure to recording device(s) */
-	if (check_record(index, chan, 0)) {
-		mid_delay(d, delay);
-		do_key_pressure(key, pressure);
-	}
-
-	/* output pressure to loop recording, if any */
-	for (unsigned n = 0; n != MPP_LOOP_MAX; n++) {
-		if (tab_loop->check_record(index, chan, n)) {
+	const struct MppOutputRoute *pr;
+	uint32_t now;
+	uint8_t num;
+
+	/* output pressure to all precomputed destinations */
+	num = output_plan(index, &now);
+	for (pr = outRoute[index]; num--; pr++) {
+		if (output_route(pr, chan, now)) {
 			mid_delay(d, delay);
 			do_key_pressure(key, pressure);
 		}
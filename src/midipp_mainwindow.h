@@ -29,6 +29,7 @@
 #include "midipp.h"
 
 #include <QStackedLayout>
+#include <QAtomicInteger>
 
 class MppMainWindow : QObject
 {
@@ -50,6 +51,11 @@ public:
 	void closeEvent(QCloseEvent *event);
 	void handle_stop(int flag = 0);
 	void handle_midi_file_open(int);
+	void handle_midi_file_loaded(MppLoaderJob *);
+	void handle_gpro_file_parsed(MppLoaderJob *);
+	void handle_mxml_file_parsed(MppLoaderJob *);
+	void handle_score_text_loaded(MppLoaderJob *, int);
+	void handle_loader_done(MppLoaderJob *);
 	void handle_midi_file_clear_name(void);
 	void handle_midi_file_instr_prepend(void);
 	void handle_midi_file_instr_delete(void);
@@ -59,6 +65,7 @@ public:
 
 	QString get_midi_score_duration(uint32_t *psum);
 	int log_midi_score_duration();
+	int convert_midi_reserve(uint32_t);
 	int convert_midi_duration(struct umidi20_track *, uint32_t thres, uint32_t chan_mask);
 	void import_midi_track(struct umidi20_track *, uint32_t = 0, int = -1, int = 0);
 
@@ -81,8 +88,15 @@ public:
 	uint8_t do_instr_check(struct umidi20_event *event, int = 0);
 	bool check_play(uint8_t index, uint8_t chan, uint32_t off, uint8_t = MPP_MAGIC_DEVNO);
 	bool check_record(uint8_t index, uint8_t chan, uint32_t off);
+	uint8_t output_plan(uint8_t index, uint32_t *pnow);
+	bool output_route(const struct MppOutputRoute *, uint8_t chan, uint32_t now);
+	void update_out_plan();
+
+	void handle_rx_event_locked(uint8_t device_no, struct umidi20_event *);
+	void update_tx_plan();
 
 	void handle_watchdog_sub(MppScoreMain *, int);
+	void notify(uint32_t);
 
 	void send_song_stop_locked();
 	void send_song_trigger_locked();
@@ -105,6 +119,17 @@ public:
 	QTimer tim_config_init;
 	QTimer tim_config_apply;
 	QTimer watchdog;
+	QTimer tim_refresh;
+
+	/* pending GUI updates, see notify() */
+	QAtomicInteger<uint32_t> dirtyMask;
+#define	MPP_DIRTY_CURSOR	(1U << 0)
+#define	MPP_DIRTY_INSTR		(1U << 1)
+#define	MPP_DIRTY_KEY_MODE	(1U << 2)
+#define	MPP_DIRTY_OPERATION	(1U << 3)
+#define	MPP_DIRTY_LOOP		(1U << 4)
+#define	MPP_DIRTY_VIEW(n)	(1U << (8 + (n)))
+#define	MPP_DIRTY_VIEW_ALL	(((1U << MPP_MAX_VIEWS) - 1U) << 8)
 
 	uint8_t auto_zero_start[0];
 
@@ -112,8 +137,9 @@ public:
 
 	int extended_keys[128][2];
   
-	uint32_t convLineStart[MPP_MAX_LINES];
-	uint32_t convLineEnd[MPP_MAX_LINES];
+	uint32_t *convLineStart;
+	uint32_t *convLineEnd;
+	uint32_t convLineMax;
 	uint32_t convIndex;
 
 	uint32_t lastKeyPress;
@@ -137,17 +163,30 @@ public:
 	uint8_t muteAllControl[MPP_MAX_DEVS];
 	uint8_t muteAllNonChannel[MPP_MAX_DEVS];
 	uint8_t muteMap[MPP_MAX_DEVS][16];
-	uint8_t cursorUpdate;
+
+	/* output device masks, see update_tx_plan() */
+	uint32_t txPlayMask[MPP_MAX_TRACKS];
+	uint32_t txMuteChannel[16];
+	uint32_t txMutePedal;
+	uint32_t txMuteControl;
+	uint32_t txMuteProgram;
+	uint32_t txMuteNonChannel;
+
+	/* output destinations per track, see update_out_plan() */
+	struct MppOutputRoute outRoute[MPP_MAX_TRACKS][MPP_ROUTE_MAX];
+	uint8_t outRouteNum[MPP_MAX_TRACKS];
+
+	/* last values shown by do_clock_stats() */
+	uint32_t clockLastOffset;
+	uint32_t clockLastCount;
 
 	uint8_t scoreRecordOn;
 	uint8_t controlRecordOn;
-	uint8_t instrUpdated;
 	uint8_t midiRecordOff;
 	uint8_t midiPlayOff;
 	uint8_t midiTriggered;
 	uint8_t midiPaused;
 	uint8_t lastViewIndex;
-	uint8_t keyModeUpdated;
 	uint8_t doOperation;
 #define	MPP_OPERATION_PAUSE 0x01
 #define	MPP_OPERATION_REWIND 0x02
@@ -308,6 +347,8 @@ public:
 	QPlainTextEdit *tab_help;
 
 	/* MIDI stuff */
+	MppEngine *engine;
+	MppLoader *loader;
 	struct mid_data mid_data;
 	struct umidi20_song *song;
 	struct umidi20_track *track[MPP_MAX_TRACKS];
@@ -334,6 +375,8 @@ public slots:
 	void handle_sustain_press(int);
 	void handle_sustain_release(int);
 	void handle_watchdog();
+	void handle_dirty();
+	void handle_refresh();
 	void handle_midi_file_new();
 	void handle_midi_file_merge_single_open();
 	void handle_midi_file_new_single_open();
@@ -491,6 +491,7 @@ MppModeBase :: handle_changed()
 	sm->synthDevice = device;
 	sm->synthDeviceBase = deviceBase;
 	sm->synthDeviceTreb = deviceTreb;
+	sm->mainWindow->update_tx_plan();
 	sm->mainWindow->trackVolume[MPP_DEFAULT_TRACK(sm->unit)] = volume;
 	sm->mainWindow->trackVolume[MPP_BASS_TRACK(sm->unit)] = volumeBase;
 	sm->mainWindow->trackVolume[MPP_TREBLE_TRACK(sm->unit)] = volumeTreb;
@@ -27,9 +27,145 @@
 #include "midipp_checkbox.h"
 #include "midipp_chords.h"
 #include "midipp_decode.h"
+#include "midipp_loader.h"
 
 #define	MXML_MAX_TAGS 8
 
+enum {
+	MXML_TAG_NONE,
+	MXML_TAG_OTHER,
+	MXML_TAG_SCORE_PARTWISE,
+	MXML_TAG_WORK,
+	MXML_TAG_WORK_TITLE,
+	MXML_TAG_IDENTIFICATION,
+	MXML_TAG_CREATOR,
+	MXML_TAG_PART,
+	MXML_TAG_MEASURE,
+	MXML_TAG_PRINT,
+	MXML_TAG_HARMONY,
+	MXML_TAG_ROOT,
+	MXML_TAG_ROOT_STEP,
+	MXML_TAG_ROOT_ALTER,
+	MXML_TAG_KIND,
+	MXML_TAG_BASS,
+	MXML_TAG_BASS_STEP,
+	MXML_TAG_BASS_ALTER,
+	MXML_TAG_NOTE,
+	MXML_TAG_CHORD,
+	MXML_TAG_PITCH,
+	MXML_TAG_STEP,
+	MXML_TAG_ALTER,
+	MXML_TAG_OCTAVE,
+	MXML_TAG_LYRIC,
+	MXML_TAG_SYLLABIC,
+	MXML_TAG_TEXT,
+};
+
+static const struct {
+	const char *name;
+	uint8_t id;
+} MppMusicXMLTags[] = {
+	{ "score-partwise", MXML_TAG_SCORE_PARTWISE },
+	{ "work", MXML_TAG_WORK },
+	{ "work-title", MXML_TAG_WORK_TITLE },
+	{ "identification", MXML_TAG_IDENTIFICATION },
+	{ "creator", MXML_TAG_CREATOR },
+	{ "part", MXML_TAG_PART },
+	{ "measure", MXML_TAG_MEASURE },
+	{ "print", MXML_TAG_PRINT },
+	{ "harmony", MXML_TAG_HARMONY },
+	{ "root", MXML_TAG_ROOT },
+	{ "root-step", MXML_TAG_ROOT_STEP },
+	{ "root-alter", MXML_TAG_ROOT_ALTER },
+	{ "kind", MXML_TAG_KIND },
+	{ "bass", MXML_TAG_BASS },
+	{ "bass-step", MXML_TAG_BASS_STEP },
+	{ "bass-alter", MXML_TAG_BASS_ALTER },
+	{ "note", MXML_TAG_NOTE },
+	{ "chord", MXML_TAG_CHORD },
+	{ "pitch", MXML_TAG_PITCH },
+	{ "step", MXML_TAG_STEP },
+	{ "alter", MXML_TAG_ALTER },
+	{ "octave", MXML_TAG_OCTAVE },
+	{ "lyric", MXML_TAG_LYRIC },
+	{ "syllabic", MXML_TAG_SYLLABIC },
+	{ "text", MXML_TAG_TEXT },
+};
+
+/*
+ * Try to translate kind into something which
+ * MidiPlayerPro understands:
+ */
+static const struct {
+	const char *kind;
+	const char *str;
+} MppMusicXMLKinds[] = {
+	{ "major", "" },
+	{ "minor", "m" },
+	{ "augmented", "+" },
+	{ "diminished", "dim" },
+	{ "dominant", "7" },
+	{ "major-seventh", "M7" },
+	{ "minor-seventh", "m7" },
+	{ "diminished-seventh", "o7" },
+	{ "augmented-seventh", "+7" },
+	{ "half-diminished", "ø" },
+	{ "major-minor", "mM7" },
+	{ "major-sixth", "M6" },
+	{ "minor-sixth", "m6" },
+	{ "dominant-ninth", "dom9" },
+	{ "major-ninth", "M9" },
+	{ "minor-ninth", "m9" },
+	{ "dominant-11th", "dom11" },
+	{ "major-11th", "M11" },
+	{ "minor-11th", "m11" },
+	{ "dominant-13th", "dom13" },
+	{ "major-13th", "M13" },
+	{ "minor-13th", "m13" },
+	{ "suspended-second", "sus2" },
+	{ "suspended-fourth", "sus4" },
+	{ "power", "5" },
+};
+
+enum {
+	MXML_EV_NOTE,
+	MXML_EV_HARMONY,
+	MXML_EV_MEASURE,
+	MXML_EV_PAGE,
+	MXML_EV_PART,
+};
+
+#define	MXML_EV_FLAG_PITCH	(1U << 0)
+#define	MXML_EV_FLAG_CHORD	(1U << 1)
+#define	MXML_EV_FLAG_SPACE	(1U << 2)	/* single or end syllabic */
+#define	MXML_EV_FLAG_SPLIT	(1U << 3)	/* begin or middle syllabic */
+
+/*
+ * Compact record of a note, harmony or structural element. The text,
+ * if any, is stored in the string pool of the MusicXML file.
+ */
+struct mxml_event {
+	uint32_t text_off;
+	uint16_t text_len;
+	uint8_t type;
+	uint8_t flags;
+	uint8_t key;		/* note or chord root */
+	uint8_t bass;		/* chord bass */
+};
+
+struct mxml_file {
+	struct mxml_event *pev;
+	uint32_t num;
+	uint32_t max;
+	uint32_t nparts;
+	uint8_t complete;
+	QString pool;
+	QString title;
+	QString composer;
+	QString lyricist;
+	QString arranger;
+};
+
 static const QString
 MppReadStrFilter(const QString &str)
 {
@@ -43,6 +179,43 @@ MppReadStrFilter(const QString &str)
 	return (retval);
 }
 
+static QChar
+MppReadStrFilterChar(QChar ch)
+{
+	switch (ch.unicode()) {
+	case '\n':
+	case '.':
+		return (QChar(' '));
+	case '(':
+		return (QChar('['));
+	case ')':
+		return (QChar(']'));
+	default:
+		return (ch);
+	}
+}
+
+/* same as MppReadStrFilter(), but appends to the string pool */
+static void
+MppReadStrFilterAppend(QString &pool, QStringView str, uint32_t &off, uint16_t &len)
+{
+	int a = 0;
+	int b = str.size();
+
+	while (a != b && MppReadStrFilterChar(str[a]).isSpace())
+		a++;
+	while (b != a && MppReadStrFilterChar(str[b - 1]).isSpace())
+		b--;
+	if (b - a > 0xFFFF)
+		b = a + 0xFFFF;
+
+	off = pool.size();
+	len = b - a;
+
+	for (; a != b; a++)
+		pool += MppReadStrFilterChar(str[a]);
+}
+
 static const char *MppGetNoteString[12] = {
 	"C",
 	"Db",
@@ -58,32 +231,89 @@ static const char *MppGetNoteString[12] = {
 	"H",
 };
 
+static uint8_t
+MppMusicXMLTag(QStringView name)
+{
+	for (size_t x = 0; x != sizeof(MppMusicXMLTags) / sizeof(MppMusicXMLTags[0]); x++) {
+		if (name.compare(QLatin1String(MppMusicXMLTags[x].name)) == 0)
+			return (MppMusicXMLTags[x].id);
+	}
+	return (MXML_TAG_OTHER);
+}
+
 static int
-MppGetNoteNumber(const QString &step, const QString &alter, const QString &octave)
+MppGetNoteStep(QStringView step)
+{
+	step = step.trimmed();
+
+	if (step.size() != 1)
+		return (0);
+
+	switch (step[0].unicode()) {
+	case 'C':
+		return (C0);
+	case 'D':
+		return (D0);
+	case 'E':
+		return (E0);
+	case 'F':
+		return (F0);
+	case 'G':
+		return (G0);
+	case 'A':
+		return (A0);
+	case 'H':
+	case 'B':
+		return (H0);
+	default:
+		return (0);
+	}
+}
+
+static int
+MppGetNoteAlter(QStringView alter)
+{
+	alter = alter.trimmed();
+
+	if (alter.compare(QLatin1String("-1")) == 0)
+		return (-1);
+	else if (alter.compare(QLatin1String("1")) == 0 ||
+	    alter.compare(QLatin1String("+1")) == 0)
+		return (1);
+	else
+		return (0);
+}
+
+static int
+MppGetNoteOctave(QStringView octave)
 {
 	int retval = 0;
+	int sign = 1;
+	int x = 0;
+
+	octave = octave.trimmed();
 
-	if (step == "C")
-		retval += C0;
-	else if (step == "D")
-		retval += D0;
-	else if (step == "E")
-		retval += E0;
-	else if (step == "F")
-		retval += F0;
-	else if (step == "G")
-		retval += G0;
-	else if (step == "A")
-		retval += A0;
-	else if (step == "H" || step == "B")
-		retval += H0;
-
-	if (alter == "-1")
-		retval -= 1;
-	else if (alter == "1" || alter == "+1")
-		retval += 1;
-
-	retval += octave.toInt() * 12;
+	if (octave.size() != 0 && (octave[0] == '-' || octave[0] == '+')) {
+		if (octave[0] == '-')
+			sign = -1;
+		x++;
+	}
+	if (x == octave.size())
+		return (0);
+	for (; x != octave.size(); x++) {
+		if (octave[x] < '0' || octave[x] > '9')
+			return (0);
+		retval = (10 * retval) + (octave[x].unicode() - '0');
+		if (retval > 1000)
+			return (0);
+	}
+	return (sign * retval);
+}
+
+static int
+MppGetNoteNumber(int step, int alter, int octave)
+{
+	int retval = step + alter + octave * 12;
 
 	/* range check */
 	if (retval < 0) {
@@ -96,443 +326,324 @@ MppGetNoteNumber(const QString &step, const QString &alter, const QString &octav
 	return (retval);
 }
 
-static const QString
-MppReadMusicXML(const QByteArray &data, uint32_t flags, uint32_t ipart, uint32_t nmeasure)
+static void
+MppReadMusicXMLProgress(MppLoaderJob *job, const QXmlStreamReader &xml)
+{
+	job->progress.storeRelaxed((100ULL * xml.characterOffset()) /
+	    (job->data.size() + 1));
+}
+
+static struct mxml_event *
+mxml_alloc_event(struct mxml_file *pmf, uint8_t type)
+{
+	struct mxml_event *pev;
+
+	if (pmf->num == pmf->max) {
+		uint32_t max = pmf->max ? (2 * pmf->max) : 256;
+
+		pev = (struct mxml_event *)realloc(pmf->pev, sizeof(*pev) * max);
+		if (pev == NULL)
+			return (NULL);
+		pmf->pev = pev;
+		pmf->max = max;
+	}
+	pev = &pmf->pev[pmf->num++];
+	memset(pev, 0, sizeof(*pev));
+	pev->type = type;
+	return (pev);
+}
+
+/*
+ * Convert the harmony into a chord string which MidiPlayerPro
+ * understands and store it in the string pool.
+ */
+static void
+mxml_new_harmony(struct mxml_file *pmf, QString *harmony, int root, int bass)
+{
+	struct mxml_event *pev;
+	uint32_t rem;
+	uint32_t base;
+	MppChord_t mask;
+	uint8_t which;
+
+	harmony[0].prepend(QLatin1String(MppGetNoteString[root % 12]));
+	if (root != bass) {
+		harmony[0] += QChar('/');
+		harmony[0] += QLatin1String(MppGetNoteString[bass % 12]);
+	}
+
+	/* fallback to major */
+	harmony[1] = QLatin1String(MppGetNoteString[root % 12]);
+	if (root != bass) {
+		harmony[1] += QChar('/');
+		harmony[1] += QLatin1String(MppGetNoteString[bass % 12]);
+	}
+
+	for (which = 0; which != 2; which++) {
+		MppStringToChordGeneric(mask, rem, base,
+		    MPP_BAND_STEP_12, harmony[which]);
+		if (mask.test(0))
+			break;
+	}
+	if (which == 2 || harmony[which].size() > 0xFFFF)
+		return;
+
+	pev = mxml_alloc_event(pmf, MXML_EV_HARMONY);
+	if (pev == NULL)
+		return;
+
+	pev->key = rem % 12;
+	pev->bass = base % 12;
+	pev->text_off = pmf->pool.size();
+	pev->text_len = harmony[which].size();
+	pmf->pool += harmony[which];
+}
+
+/*
+ * Parse the MusicXML document in a single pass, converting all parts
+ * into a compact event list. The number of parts found is stored in
+ * the job result. Must be called from the loader thread.
+ */
+struct mxml_file *
+MppMusicXMLParse(MppLoaderJob *job)
 {
 	QXmlStreamReader::TokenType token = QXmlStreamReader::NoToken;
-	QXmlStreamReader xml(data);
-	QString output;
-	QString output_string;
-	QString output_scores;
-	QString title;
-	QString composer;
-	QString lyricist;
-	QString arranger;
-	QString text;
-	QString scores;
-	QString pitch_step;
-	QString pitch_alter;
-	QString pitch_octave;
-	QString note_duration;
-	QString bass_step;
-	QString bass_alter;
-	QString divisions;
-	QString root_step;
-	QString root_alter;
-	QString duration;
-	QString syllabic;
-	QString kind;
-	QString tags[MXML_MAX_TAGS];
-	uint32_t imeasure = 0;
-	uint8_t do_new_line = 0;
-	uint8_t is_chord = 0;
+	QXmlStreamReader xml(job->data);
+	struct mxml_file *pmf;
+	struct mxml_event note;
+	QString harmony[2];
+	uint8_t tags[MXML_MAX_TAGS] = {};
+	int root_step = 0;
+	int root_alter = 0;
+	int bass_step = -1;
+	int bass_alter = 0;
+	int pitch_step = 0;
+	int pitch_alter = 0;
+	int pitch_octave = 0;
 	size_t si = 0;
 
+	job->result = 0;
+
+	pmf = new struct mxml_file();
+
+	/* the string pool is typically much smaller than the input */
+	pmf->pool.reserve(job->data.size() / 64);
+
+	memset(&note, 0, sizeof(note));
+
 	while (!xml.atEnd()) {
-		if (token == QXmlStreamReader::NoToken)
+		if (job->cancel.loadRelaxed() != 0)
+			goto error;
+		if (token == QXmlStreamReader::NoToken) {
 			token = xml.readNext();
+			MppReadMusicXMLProgress(job, xml);
+		}
 
 		switch (token) {
 		case QXmlStreamReader::Invalid:
 			goto done;
 		case QXmlStreamReader::StartElement:
 			if (si < MXML_MAX_TAGS)
-				tags[si] = xml.name().toString();
+				tags[si] = MppMusicXMLTag(xml.name());
 			si++;
 
-			if (tags[0] == "score-partwise") {
-				if (si == 1) {
-					title = QString();
-					composer = QString();
-					lyricist = QString();
-					arranger = QString();
-				} else if (tags[1] == "work") {
-					if (si == 3 && tags[2] == "work-title") {
-						token = xml.readNext();
-						if (token != QXmlStreamReader::Characters)
-							continue;
-						title = MppReadStrFilter(xml.text().toString());
+			if (tags[0] != MXML_TAG_SCORE_PARTWISE)
+				break;
+
+			if (si == 1) {
+				pmf->title = QString();
+				pmf->composer = QString();
+				pmf->lyricist = QString();
+				pmf->arranger = QString();
+			} else if (tags[1] == MXML_TAG_WORK) {
+				if (si == 3 && tags[2] == MXML_TAG_WORK_TITLE) {
+					token = xml.readNext();
+					if (token != QXmlStreamReader::Characters)
+						continue;
+					pmf->title = MppReadStrFilter(xml.text().toString());
+				}
+			} else if (tags[1] == MXML_TAG_IDENTIFICATION) {
+				if (si == 3 && tags[2] == MXML_TAG_CREATOR) {
+					const auto type = xml.attributes().value(QLatin1String("type"));
+					QString *pstr;
+
+					if (type == QLatin1String("composer"))
+						pstr = &pmf->composer;
+					else if (type == QLatin1String("lyricist"))
+						pstr = &pmf->lyricist;
+					else if (type == QLatin1String("arranger"))
+						pstr = &pmf->arranger;
+					else
+						break;
+
+					token = xml.readNext();
+					if (token != QXmlStreamReader::Characters)
+						continue;
+					*pstr = MppReadStrFilter(xml.text().toString());
+				}
+			} else if (tags[1] != MXML_TAG_PART || tags[2] != MXML_TAG_MEASURE) {
+				/* not part of a measure */
+			} else if (si == 4) {
+				switch (tags[3]) {
+				case MXML_TAG_PRINT:
+					if (xml.attributes().value(QLatin1String("new-page")) ==
+					    QLatin1String("yes"))
+						mxml_alloc_event(pmf, MXML_EV_PAGE);
+					break;
+				case MXML_TAG_HARMONY:
+					root_step = 0;
+					root_alter = 0;
+					bass_step = -1;
+					bass_alter = 0;
+					harmony[0].truncate(0);
+					break;
+				case MXML_TAG_NOTE:
+					memset(&note, 0, sizeof(note));
+					note.type = MXML_EV_NOTE;
+					note.text_off = pmf->pool.size();
+					pitch_step = 0;
+					pitch_alter = 0;
+					pitch_octave = 0;
+					break;
+				default:
+					break;
+				}
+			} else if (tags[3] == MXML_TAG_HARMONY) {
+				if (si == 5 && tags[4] == MXML_TAG_KIND) {
+					const auto text = xml.attributes().value(QLatin1String("text"));
+					if (!text.isEmpty()) {
+						harmony[0] = text.toString();
+						break;
 					}
-				} else if (tags[1] == "identification") {
-					if (si == 3 && tags[2] == "creator") {
-						QString type = xml.attributes().value("type").toString();
-						if (type == "composer") {
-							token = xml.readNext();
-							if (token != QXmlStreamReader::Characters)
-								continue;
-							composer = MppReadStrFilter(xml.text().toString());
-						} else if (type == "lyricist") {
-							token = xml.readNext();
-							if (token != QXmlStreamReader::Characters)
-								continue;
-							lyricist = MppReadStrFilter(xml.text().toString());
-						} else if (type == "arranger") {
-							token = xml.readNext();
-							if (token != QXmlStreamReader::Characters)
-								continue;
-							arranger = MppReadStrFilter(xml.text().toString());
+					token = xml.readNext();
+					if (token != QXmlStreamReader::Characters)
+						continue;
+
+					QStringView kind = QStringView(xml.text()).trimmed();
+
+					harmony[0].truncate(0);
+					for (size_t x = 0; x != sizeof(MppMusicXMLKinds) / sizeof(MppMusicXMLKinds[0]); x++) {
+						if (kind.compare(QLatin1String(MppMusicXMLKinds[x].kind)) == 0) {
+							harmony[0] = QString::fromUtf8(MppMusicXMLKinds[x].str);
+							break;
 						}
 					}
-				} else if (tags[1] == "part") {
-					if (ipart != 0) {
-						/* wrong part number */
-					} else if (si == 2) {
-						divisions = QString();
-						imeasure = 0;
-					} else if (tags[2] == "measure") {
-						if (si == 3) {
-
-						} else if (tags[3] == "attributes" && tags[4] == "divisions") {
-							if (si == 5) {
-								token = xml.readNext();
-								if (token != QXmlStreamReader::Characters)
-									continue;
-								divisions = xml.text().toString().trimmed();
-							}
-						} else if (tags[3] == "print") {
-							if (si == 4) {
-								if (xml.attributes().value("new-page").toString() == "yes") {
-									if (!output.isEmpty())
-										output += "\nJP\n\n";
-								}
-							}
-						} else if (tags[3] == "harmony") {
-							if (si == 4) {
-								root_step = QString();
-								root_alter = QString();
-								kind = QString();
-								bass_step = QString();
-								bass_alter = QString();
-							} else if (si == 6 && tags[4] == "root" && tags[5] == "root-step") {
-								token = xml.readNext();
-								if (token != QXmlStreamReader::Characters)
-									continue;
-								root_step = xml.text().toString().trimmed();
-							} else if (si == 6 && tags[4] == "root" && tags[5] == "root-alter") {
-								token = xml.readNext();
-								if (token != QXmlStreamReader::Characters)
-									continue;
-								root_alter = xml.text().toString().trimmed();
-							} else if (si == 5 && tags[4] == "kind") {
-								kind = xml.attributes().value("text").toString();
-								if (kind.isEmpty()) {
-									token = xml.readNext();
-									if (token != QXmlStreamReader::Characters)
-										continue;
-									/*
-									 * Try to translate kind into something which
-									 * MidiPlayerPro understands:
-									 */
-									kind = xml.text().toString().trimmed();
-									if (kind == "major")
-										kind = "";
-									else if (kind == "minor")
-										kind = "m";
-									else if (kind == "augmented")
-										kind = "+";
-									else if (kind == "diminished")
-										kind = "dim";
-									else if (kind == "dominant")
-										kind = "7";
-									else if (kind == "major-seventh")
-										kind = "M7";
-									else if (kind == "minor-seventh")
-										kind = "m7";
-									else if (kind == "diminished-seventh")
-										kind = "o7";
-									else if (kind == "augmented-seventh")
-										kind = "+7";
-									else if (kind == "half-diminished")
-										kind = QString::fromUtf8("ø");
-									else if (kind == "major-minor")
-										kind = "mM7";
-									else if (kind == "major-sixth")
-										kind = "M6";
-									else if (kind == "minor-sixth")
-										kind = "m6";
-									else if (kind == "dominant-ninth")
-										kind = "dom9";
-									else if (kind == "major-ninth")
-										kind = "M9";
-									else if (kind == "minor-ninth")
-										kind = "m9";
-									else if (kind == "dominant-11th")
-										kind = "dom11";
-									else if (kind == "major-11th")
-										kind = "M11";
-									else if (kind == "minor-11th")
-										kind = "m11";
-									else if (kind == "dominant-13th")
-										kind = "dom13";
-									else if (kind == "major-13th")
-										kind = "M13";
-									else if (kind == "minor-13th")
-										kind = "m13";
-									else if (kind == "suspended-second")
-										kind = "sus2";
-									else if (kind == "suspended-fourth")
-										kind = "sus4";
-									else if (kind == "power")
-										kind = "5";
-									else
-										kind = "";	/* major */
-								}
-							} else if (si == 6 && tags[4] == "bass" && tags[5] == "bass-step") {
-								token = xml.readNext();
-								if (token != QXmlStreamReader::Characters)
-									continue;
-								bass_step = xml.text().toString().trimmed();
-							} else if (si == 6 && tags[4] == "bass" && tags[5] == "bass-alter") {
-								token = xml.readNext();
-								if (token != QXmlStreamReader::Characters)
-									continue;
-								bass_alter = xml.text().toString().trimmed();
-							}
-
-						} else if (tags[3] == "note") {
-							if (si == 4) {
-								pitch_step = QString();
-								pitch_alter = QString();
-								pitch_octave = QString();
-								note_duration = QString();
-								is_chord = 0;
-								text = QString();
-								syllabic = QString();
-								duration = QString();
-							} else if (tags[4] == "chord") {
-								if (si == 5) {
-									is_chord = 1;
-								}
-							} else if (tags[4] == "pitch") {
-								if (si == 5) {
-
-								} else if (tags[5] == "step") {
-									if (si == 6) {
-										token = xml.readNext();
-										if (token != QXmlStreamReader::Characters)
-											continue;
-										pitch_step = xml.text().toString().trimmed();
-									}
-								} else if (tags[5] == "alter") {
-									if (si == 6) {
-										token = xml.readNext();
-										if (token != QXmlStreamReader::Characters)
-											continue;
-										pitch_alter = xml.text().toString().trimmed();
-									}
-								} else if (tags[5] == "octave") {
-									if (si == 6) {
-										token = xml.readNext();
-										if (token != QXmlStreamReader::Characters)
-											continue;
-										pitch_octave = xml.text().toString().trimmed();
-									}
-								}
-							} else if (tags[4] == "duration") {
-								if (si == 5) {
-									token = xml.readNext();
-									if (token != QXmlStreamReader::Characters)
-										continue;
-									duration = xml.text().toString().trimmed();
-								}
-							} else if (tags[4] == "lyric") {
-								if (si == 5) {
-
-								} else if (tags[5] == "syllabic") {
-									if (si == 6) {
-										token = xml.readNext();
-										if (token != QXmlStreamReader::Characters)
-											continue;
-										syllabic = xml.text().toString().trimmed();
-									}
-								} else if (tags[5] == "text") {
-									if (si == 6) {
-										token = xml.readNext();
-										if (token != QXmlStreamReader::Characters)
-											continue;
-										text = MppReadStrFilter(xml.text().toString());
-									}
-								}
-							}
-						}
+				} else if (si == 6) {
+					int *pval;
+
+					if (tags[4] == MXML_TAG_ROOT && tags[5] == MXML_TAG_ROOT_STEP)
+						pval = &root_step;
+					else if (tags[4] == MXML_TAG_ROOT && tags[5] == MXML_TAG_ROOT_ALTER)
+						pval = &root_alter;
+					else if (tags[4] == MXML_TAG_BASS && tags[5] == MXML_TAG_BASS_STEP)
+						pval = &bass_step;
+					else if (tags[4] == MXML_TAG_BASS && tags[5] == MXML_TAG_BASS_ALTER)
+						pval = &bass_alter;
+					else
+						break;
+
+					token = xml.readNext();
+					if (token != QXmlStreamReader::Characters)
+						continue;
+					if (pval == &root_step || pval == &bass_step)
+						*pval = MppGetNoteStep(xml.text());
+					else
+						*pval = MppGetNoteAlter(xml.text());
+				}
+			} else if (tags[3] == MXML_TAG_NOTE) {
+				if (si == 5) {
+					if (tags[4] == MXML_TAG_CHORD)
+						note.flags |= MXML_EV_FLAG_CHORD;
+				} else if (si == 6 && tags[4] == MXML_TAG_PITCH) {
+					if (tags[5] != MXML_TAG_STEP &&
+					    tags[5] != MXML_TAG_ALTER &&
+					    tags[5] != MXML_TAG_OCTAVE)
+						break;
+
+					token = xml.readNext();
+					if (token != QXmlStreamReader::Characters)
+						continue;
+
+					QStringView text(xml.text());
+
+					switch (tags[5]) {
+					case MXML_TAG_STEP:
+						if (text.trimmed().isEmpty())
+							note.flags &= ~MXML_EV_FLAG_PITCH;
+						else
+							note.flags |= MXML_EV_FLAG_PITCH;
+						pitch_step = MppGetNoteStep(text);
+						break;
+					case MXML_TAG_ALTER:
+						pitch_alter = MppGetNoteAlter(text);
+						break;
+					default:
+						pitch_octave = MppGetNoteOctave(text);
+						break;
+					}
+				} else if (si == 6 && tags[4] == MXML_TAG_LYRIC) {
+					if (tags[5] != MXML_TAG_SYLLABIC &&
+					    tags[5] != MXML_TAG_TEXT)
+						break;
+
+					token = xml.readNext();
+					if (token != QXmlStreamReader::Characters)
+						continue;
+
+					QStringView text(xml.text());
+
+					if (tags[5] == MXML_TAG_SYLLABIC) {
+						text = text.trimmed();
+						note.flags &= ~(MXML_EV_FLAG_SPACE | MXML_EV_FLAG_SPLIT);
+						if (text.compare(QLatin1String("single")) == 0 ||
+						    text.compare(QLatin1String("end")) == 0)
+							note.flags |= MXML_EV_FLAG_SPACE;
+						else if (text.compare(QLatin1String("begin")) == 0 ||
+						    text.compare(QLatin1String("middle")) == 0)
+							note.flags |= MXML_EV_FLAG_SPLIT;
+					} else {
+						/* only the last lyric of a note is kept */
+						pmf->pool.truncate(note.text_off);
+						MppReadStrFilterAppend(pmf->pool, text,
+						    note.text_off, note.text_len);
 					}
 				}
 			}
 			break;
 		case QXmlStreamReader::EndElement:
-			if (tags[0] == "score-partwise") {
-				if (si == 1) {
-					QString creator = composer;
-					if (!lyricist.isEmpty()) {
-						creator += " // ";
-						creator += lyricist;
-					}
-					if (!arranger.isEmpty()) {
-						creator += " || ";
-						creator += arranger;
-					}
-					output = QString("S\"(") + title + QString(")") +
-					    creator + QString("\"\n\nL0:\n") + output;
-				} else if (tags[1] == "part") {
-					if (si == 2) {
-						/* end of part */
-						imeasure = 0;
-						ipart--;
-
-						if (output_string.isEmpty() == 0 ||
-						    output_scores.isEmpty() == 0) {
-							output += "\nS\"";
-							output += output_string;
-							output += "\"\n\n";
-							output += output_scores;
-							output_string = QString();
-							output_scores = QString();
-						}
-					} else if (ipart != 0) {
-						/* wrong part number */
-					} else if (tags[2] == "measure") {
-						if (si == 3) {
-							/* end of measure */
-							if (do_new_line != 0) {
-								do_new_line = 0;
-								output_scores += "\n";
-							}
-							imeasure++;
-
-							if ((imeasure % nmeasure) == (nmeasure - 1)) {
-								if (output_string.isEmpty() == 0 ||
-								    output_scores.isEmpty() == 0) {
-									/* check if the last syllabic is split */
-									if (flags & MXML_FLAG_KEEP_TEXT) {
-										if (syllabic == "begin" || syllabic == "middle")
-											output_string += "-";
-									}
-									output += "\nS\"";
-									output += output_string;
-									output += "\"\n\n";
-									output += output_scores;
-									output_string = QString();
-									output_scores = QString();
-								}
-							}
-						} else if (tags[3] == "harmony") {
-							if (si == 4) {
-								/* end of harmony */
-								QString harmony[2];
-								uint8_t x;
-								uint8_t which;
-								uint32_t bass;
-								uint32_t root;
-								MppChord_t mask;
-
-								root = MppGetNoteNumber(root_step, root_alter, "5");
-
-								if (bass_step.isEmpty())
-									bass = root;
-								else
-									bass = MppGetNoteNumber(bass_step, bass_alter, "5");
-
-								harmony[0] = QString(MppGetNoteString[root % 12]) + kind;
-								if (root != bass) {
-									harmony[0] += QString("/") +
-									    QString(MppGetNoteString[bass % 12]);
-								}
-
-								/* fallback to major */
-								harmony[1] = QString(MppGetNoteString[root % 12]);
-								if (root != bass) {
-									harmony[1] += QString("/") +
-									    QString(MppGetNoteString[bass % 12]);
-								}
-
-								for (which = 0; which != 2; which++) {
-									MppStringToChordGeneric(mask, root, bass,
-									    MPP_BAND_STEP_12, harmony[which]);
-									if (mask.test(0))
-										break;
-								}
-								if (which == 2)
-									goto skip_harmony;
-
-								if (do_new_line != 0) {
-									do_new_line = 0;
-									output_scores += "\n";
-								}
-
-								if (flags & MXML_FLAG_CONV_CHORDS)
-									output_string += ".";
-
-								if (flags & MXML_FLAG_KEEP_CHORDS) {
-									output_string += "(";
-									output_string += harmony[which];
-									output_string += ")";
-								}
-
-								if (flags & MXML_FLAG_CONV_CHORDS) {
-									output_scores += "U1 ";
-									output_scores += MppKeyStr((3 * 12 + (bass % 12)) * MPP_BAND_STEP_12);
-									output_scores += " ";
-									output_scores += MppKeyStr((4 * 12 + (bass % 12)) * MPP_BAND_STEP_12);
-									output_scores += " ";
-
-									for (x = 0; x != MPP_MAX_CHORD_BANDS; x++) {
-										if (mask.test(x) == 0)
-											continue;
-										output_scores += MppKeyStr(
-										    ((5 * 12 + (root % 12)) * MPP_BAND_STEP_12) +
-										    (x * MPP_BAND_STEP_CHORD));
-										output_scores += " ";
-									}
-									output_scores += QString("/* ") + harmony[which] + QString(" */\n");
-								}
-							skip_harmony:;
-							}
-						} else if (tags[3] == "note") {
-							if (si == 4) {
-								/* end of note */
-
-								if (flags & MXML_FLAG_KEEP_SCORES) {
-									if (do_new_line == 0) {
-										if (!pitch_step.isEmpty()) {
-											output_scores += "U1 ";
-											output_string += ".";
-										}
-									} else if (is_chord == 0) {
-										output_scores += "\n";
-										if (!pitch_step.isEmpty()) {
-											output_scores += "U1 ";
-											output_string += ".";
-										} else {
-											do_new_line = 0;
-										}
-									}
-								}
-								if (flags & MXML_FLAG_KEEP_TEXT) {
-									output_string += text;
-									if (syllabic == "single" || syllabic == "end")
-										output_string += " ";
-								}
-								if (flags & MXML_FLAG_KEEP_SCORES) {
-									if (!pitch_step.isEmpty()) {
-										uint8_t key;
-
-										key = MppGetNoteNumber(pitch_step, pitch_alter,
-										    pitch_octave);
-										output_scores += mid_key_str[key];
-										output_scores += " ";
-										do_new_line = 1;
-									}
-								}
-							}
-						}
-					}
+			if (si == 0)
+				goto error;
+
+			if (tags[0] != MXML_TAG_SCORE_PARTWISE) {
+				/* not a MusicXML score */
+			} else if (si == 1) {
+				pmf->complete = 1;
+			} else if (si == 2) {
+				if (tags[1] == MXML_TAG_PART) {
+					mxml_alloc_event(pmf, MXML_EV_PART);
+					pmf->nparts++;
+				}
+			} else if (tags[1] != MXML_TAG_PART || tags[2] != MXML_TAG_MEASURE) {
+				/* not part of a measure */
+			} else if (si == 3) {
+				mxml_alloc_event(pmf, MXML_EV_MEASURE);
+			} else if (si == 4 && tags[3] == MXML_TAG_HARMONY) {
+				mxml_new_harmony(pmf, harmony,
+				    MppGetNoteNumber(root_step, root_alter, 5),
+				    (bass_step < 0) ? MppGetNoteNumber(root_step, root_alter, 5) :
+				    MppGetNoteNumber(bass_step, bass_alter, 5));
+			} else if (si == 4 && tags[3] == MXML_TAG_NOTE) {
+				struct mxml_event *pev = mxml_alloc_event(pmf, MXML_EV_NOTE);
+
+				if (pev != NULL) {
+					*pev = note;
+					pev->key = MppGetNoteNumber(pitch_step,
+					    pitch_alter, pitch_octave);
 				}
 			}
-			if (si == 0)
-				break;
 			si--;
 			if (si < MXML_MAX_TAGS)
-				tags[si] = QString();
+				tags[si] = MXML_TAG_NONE;
 			break;
 		default:
 			break;
@@ -540,63 +651,209 @@ MppReadMusicXML(const QByteArray &data, uint32_t flags, uint32_t ipart, uint32_t
 		token = QXmlStreamReader::NoToken;
 	}
 done:
-	return (output);
+	if (xml.hasError())
+		goto error;
+	job->result = pmf->nparts;
+	return (pmf);
+error:
+	MppMusicXMLFree(pmf);
+	return (NULL);
 }
 
-static int
-MppReadMusicXMLParts(const QByteArray &data)
+static void
+mxml_flush_line(QString &output, QString &output_string, QString &output_scores)
 {
-	QXmlStreamReader::TokenType token =
-	    QXmlStreamReader::NoToken;
-	QXmlStreamReader xml(data);
-	QString tags[MXML_MAX_TAGS];
-	size_t si = 0;
-	int parts = 0;
+	if (output_string.isEmpty() && output_scores.isEmpty())
+		return;
 
-	while (!xml.atEnd()) {
-		if (token == QXmlStreamReader::NoToken)
-			token = xml.readNext();
+	output += QLatin1String("\nS\"");
+	output += output_string;
+	output += QLatin1String("\"\n\n");
+	output += output_scores;
+	output_string.truncate(0);
+	output_scores.truncate(0);
+}
 
-		switch (token) {
-		case QXmlStreamReader::Invalid:
-			goto done;
-		case QXmlStreamReader::StartElement:
-			if (si < MXML_MAX_TAGS)
-				tags[si] = xml.name().toString();
-			si++;
+/*
+ * Convert the selected part, or all parts, into scores according to
+ * the import flags. Must be called from the loader thread.
+ */
+void
+MppMusicXMLDump(MppLoaderJob *job)
+{
+	const struct mxml_file *pmf = job->mxml;
+	const uint32_t flags = job->param[0];
+	const uint32_t ipart = job->param[1];
+	const uint32_t nmeasure = job->param[2];
+	QString &output = job->output;
+	QString output_string;
+	QString output_scores;
+	uint32_t imeasure = 0;
+	uint32_t part = 0;
+	uint32_t x;
+	uint8_t do_new_line = 0;
+	uint8_t syllabic = 0;
+	int body;
+
+	if (pmf == NULL || nmeasure == 0)
+		return;
+
+	/* pre-size the output, assuming roughly one score per event */
+	output.reserve(pmf->pool.size() + 8 * pmf->num + 256);
+
+	if (pmf->complete) {
+		output += QLatin1String("S\"(");
+		output += pmf->title;
+		output += QLatin1String(")");
+		output += pmf->composer;
+		if (!pmf->lyricist.isEmpty()) {
+			output += QLatin1String(" // ");
+			output += pmf->lyricist;
+		}
+		if (!pmf->arranger.isEmpty()) {
+			output += QLatin1String(" || ");
+			output += pmf->arranger;
+		}
+		output += QLatin1String("\"\n\nL0:\n");
+	}
+	body = output.size();
+
+	for (x = 0; x != pmf->num; x++) {
+		const struct mxml_event *pev = pmf->pev + x;
+		const QChar *text = pmf->pool.constData() + pev->text_off;
+
+		if (pev->type == MXML_EV_PART) {
+			/* end of part */
+			imeasure = 0;
+			part++;
+			mxml_flush_line(output, output_string, output_scores);
+			continue;
+		} else if (ipart != MXML_PART_ALL && ipart != part) {
+			/* wrong part number */
+			continue;
+		}
+
+		switch (pev->type) {
+		case MXML_EV_PAGE:
+			if (output.size() != body)
+				output += QLatin1String("\nJP\n\n");
 			break;
-		case QXmlStreamReader::EndElement:
-			if (si == 2 && tags[0] == "score-partwise" && tags[1] == "part")
-				parts++;
-			if (si == 0 || parts < 0)
-				goto error;
-			si--;
-			if (si < MXML_MAX_TAGS)
-				tags[si] = QString();
+		case MXML_EV_MEASURE:
+			/* end of measure */
+			if (do_new_line != 0) {
+				do_new_line = 0;
+				output_scores += QChar('\n');
+			}
+			imeasure++;
+
+			if ((imeasure % nmeasure) == (nmeasure - 1)) {
+				if (output_string.isEmpty() == 0 ||
+				    output_scores.isEmpty() == 0) {
+					/* check if the last syllabic is split */
+					if ((flags & MXML_FLAG_KEEP_TEXT) &&
+					    (syllabic & MXML_EV_FLAG_SPLIT))
+						output_string += QChar('-');
+				}
+				mxml_flush_line(output, output_string, output_scores);
+			}
+			break;
+		case MXML_EV_HARMONY:
+			if (do_new_line != 0) {
+				do_new_line = 0;
+				output_scores += QChar('\n');
+			}
+
+			if (flags & MXML_FLAG_CONV_CHORDS)
+				output_string += QChar('.');
+
+			if (flags & MXML_FLAG_KEEP_CHORDS) {
+				output_string += QChar('(');
+				output_string.append(text, pev->text_len);
+				output_string += QChar(')');
+			}
+
+			if (flags & MXML_FLAG_CONV_CHORDS) {
+				const QString harmony =
+				    QString::fromRawData(text, pev->text_len);
+				MppChord_t mask;
+				uint32_t root;
+				uint32_t bass;
+				uint8_t y;
+
+				MppStringToChordGeneric(mask, root, bass,
+				    MPP_BAND_STEP_12, harmony);
+
+				output_scores += QLatin1String("U1 ");
+				output_scores += MppKeyStr((3 * 12 + pev->bass) * MPP_BAND_STEP_12);
+				output_scores += QChar(' ');
+				output_scores += MppKeyStr((4 * 12 + pev->bass) * MPP_BAND_STEP_12);
+				output_scores += QChar(' ');
+
+				for (y = 0; y != MPP_MAX_CHORD_BANDS; y++) {
+					if (mask.test(y) == 0)
+						continue;
+					output_scores += MppKeyStr(
+					    ((5 * 12 + pev->key) * MPP_BAND_STEP_12) +
+					    (y * MPP_BAND_STEP_CHORD));
+					output_scores += QChar(' ');
+				}
+				output_scores += QLatin1String("/* ");
+				output_scores += harmony;
+				output_scores += QLatin1String(" */\n");
+			}
+			break;
+		case MXML_EV_NOTE:
+			syllabic = pev->flags;
+
+			if (flags & MXML_FLAG_KEEP_SCORES) {
+				if (do_new_line == 0) {
+					if (pev->flags & MXML_EV_FLAG_PITCH) {
+						output_scores += QLatin1String("U1 ");
+						output_string += QChar('.');
+					}
+				} else if ((pev->flags & MXML_EV_FLAG_CHORD) == 0) {
+					output_scores += QChar('\n');
+					if (pev->flags & MXML_EV_FLAG_PITCH) {
+						output_scores += QLatin1String("U1 ");
+						output_string += QChar('.');
+					} else {
+						do_new_line = 0;
+					}
+				}
+			}
+			if (flags & MXML_FLAG_KEEP_TEXT) {
+				output_string.append(text, pev->text_len);
+				if (pev->flags & MXML_EV_FLAG_SPACE)
+					output_string += QChar(' ');
+			}
+			if (flags & MXML_FLAG_KEEP_SCORES) {
+				if (pev->flags & MXML_EV_FLAG_PITCH) {
+					output_scores += mid_key_str[pev->key];
+					output_scores += QChar(' ');
+					do_new_line = 1;
+				}
+			}
 			break;
 		default:
 			break;
 		}
-		token = QXmlStreamReader::NoToken;
 	}
-done:
-	if (xml.hasError())
-		goto error;
-	return (parts);
-error:
-	return (0);
 }
 
-MppMusicXmlImport :: MppMusicXmlImport(MppMainWindow *_mw, const QByteArray &data) :
+void
+MppMusicXMLFree(struct mxml_file *pmf)
+{
+	if (pmf == NULL)
+		return;
+	free(pmf->pev);
+	delete pmf;
+}
+
+MppMusicXmlImport :: MppMusicXmlImport(MppMainWindow *_mw, int nparts) :
     MppDialog(_mw, QObject::tr("MusicXML import"))
 {
 	MppDialog *d = this;
 
-	int nparts = MppReadMusicXMLParts(data);
-
-	if (nparts == 0)
-		return;
-
 	QLabel *lbl;
 	
 	lbl = new QLabel(tr("Keep melody scores"));
@@ -646,7 +903,9 @@ MppMusicXmlImport :: MppMusicXmlImport(MppMainWindow *_mw, const QByteArray &dat
 	addWidget(spn_nmeasure, 5,1,1,1, Qt::AlignCenter);
 
 	spn_partnumber = new QSpinBox();
-	spn_partnumber->setRange(1,nparts);
+	spn_partnumber->setRange(0,nparts);
+	spn_partnumber->setSpecialValueText(tr("All"));
+	spn_partnumber->setValue(1);
 	addWidget(spn_partnumber, 6,1,1,1, Qt::AlignCenter);
 
 	btn_done = new QPushButton(tr("Done"));
@@ -655,7 +914,7 @@ MppMusicXmlImport :: MppMusicXmlImport(MppMainWindow *_mw, const QByteArray &dat
 
 	exec();
 
-	uint32_t flags = 0;
+	flags = 0;
 
 	if (cbx_melody->isChecked())
 		flags |= MXML_FLAG_KEEP_SCORES;
@@ -666,6 +925,9 @@ MppMusicXmlImport :: MppMusicXmlImport(MppMainWindow *_mw, const QByteArray &dat
 	if (cbx_convert->isChecked())
 		flags |= MXML_FLAG_CONV_CHORDS;
 
-	output = MppReadMusicXML(data, flags,
-	    spn_partnumber->value() - 1, spn_nmeasure->value());
+	if (spn_partnumber->value() == 0)
+		ipart = MXML_PART_ALL;
+	else
+		ipart = spn_partnumber->value() - 1;
+	nmeasure = spn_nmeasure->value();
 }
@@ -33,14 +33,24 @@
 #define	MXML_FLAG_KEEP_CHORDS		(1U << 2)
 #define	MXML_FLAG_CONV_CHORDS		(1U << 3)
 
+#define	MXML_PART_ALL			0xFFFFFFFFU
+
+struct mxml_file;
+
+extern struct mxml_file *MppMusicXMLParse(MppLoaderJob *);
+extern void MppMusicXMLDump(MppLoaderJob *);
+extern void MppMusicXMLFree(struct mxml_file *);
+
 class MppMusicXmlImport : public MppDialog
 {
 	Q_OBJECT
 
 public:
-	MppMusicXmlImport(MppMainWindow *, const QByteArray &);
+	MppMusicXmlImport(MppMainWindow *, int);
 
-	QString output;
+	uint32_t flags;
+	uint32_t ipart;
+	uint32_t nmeasure;
 
 	MppCheckBox *cbx_melody;
 	MppCheckBox *cbx_text;
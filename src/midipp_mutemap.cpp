@@ -111,6 +111,7 @@ MppMuteMapChBase :: handle_apply_all()
 	mw->atomic_lock();
 	for (int n = 0; n != 16; n++)
 		mw->muteMap[devno][n] = mute_copy[n];
+	mw->update_tx_plan();
 	mw->atomic_unlock();
 }
 
@@ -225,6 +226,7 @@ MppMuteMapOtherBase :: handle_apply_all()
 	mw->disableLocalKeys[devno] = mute_local_disable_copy;
 	mw->muteAllNonChannel[devno] = mute_midi_non_channel_copy;
 	mw->muteAllControl[devno] = mute_control_copy;
+	mw->update_tx_plan();
 	mw->atomic_unlock();
 
 	if (apply)
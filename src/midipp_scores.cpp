@@ -39,6 +39,8 @@
 #include "midipp_gridlayout.h"
 #include "midipp_sheet.h"
 
+#include <QPixmapCache>
+
 static int
 MppCountNewline(const QString &str)
 {
@@ -59,6 +61,33 @@ MppCountNewline(const QString &str)
 	return (y);
 }
 
+/*
+ * Replace the text "old" found at "pos" in the document by "str".
+ * Only the characters in between the common prefix and suffix are
+ * replaced, so that the text layout and the incremental parser only
+ * see the lines which actually changed.
+ */
+static void
+MppReplaceText(QTextCursor &cursor, int pos, const QString &old, const QString &str)
+{
+	int max = (old.size() < str.size()) ? old.size() : str.size();
+	int prefix = 0;
+	int suffix = 0;
+
+	while (prefix != max && old[prefix] == str[prefix])
+		prefix++;
+	while (suffix != max - prefix &&
+	    old[old.size() - 1 - suffix] == str[str.size() - 1 - suffix])
+		suffix++;
+
+	if (prefix == old.size() && prefix == str.size())
+		return;		/* no change */
+
+	cursor.setPosition(pos + prefix, QTextCursor::MoveAnchor);
+	cursor.setPosition(pos + old.size() - suffix, QTextCursor::KeepAnchor);
+	cursor.insertText(str.mid(prefix, str.size() - prefix - suffix));
+}
+
 MppScoreView :: MppScoreView(MppScoreMain *parent)
 {
 	pScores = parent;
@@ -286,6 +315,13 @@ MppScoreMain :: MppScoreMain(MppMainWindow *parent, int _unit)
 	editWidget->setLineWrapMode(QPlainTextEdit::NoWrap);
 	editWidget->setTabChangesFocus(true);
 
+	/* the first compile is always a full one */
+	editDirtyPrefix = -1;
+	editDirtySuffix = -1;
+
+	connect(editWidget->document(), SIGNAL(contentsChange(int,int,int)),
+	    this, SLOT(handleContentsChange(int,int,int)));
+
 	/* GridLayout */
 
 	gl_view = new MppGridLayout();
@@ -617,6 +653,8 @@ MppScoreMain :: handlePrintSub(QPrinter *pd, QPoint orig)
 
 	if (pd != NULL)
 		paint.end();
+	else
+		visualSerial++;	/* invalidate cached view */
 }
 
 void
@@ -636,44 +674,26 @@ MppScoreMain :: viewMousePressEvent(QMouseEvent *e)
 	head.syncLast();
 	mainWindow->handle_stop();
 	mainWindow->atomic_unlock();
+
+	mainWindow->notify(MPP_DIRTY_VIEW(unit));
 }
 
 void
 MppScoreMain :: locateVisual(MppElement *ptr, int *pindex,
     int *pnext, MppVisualDot **ppdot)
 {
-	MppElement *start;
-	MppElement *stop;
-	MppElement *elem;
 	int x;
 	int y;
 
-	for (x = y = 0; x != visual_max; x++) {
-		if (ptr->compare(pVisual[x].start) < 0 ||
-		    ptr->compare(pVisual[x].stop) >= 0)
-			continue;
-
-		for (start = stop = pVisual[x].start;
-			head.foreachLine(&start, &stop); ) {
-
-			if (start->compare(pVisual[x].stop) >= 0)
-				break;
-			if (ptr->compare(start) >= 0 &&
-			    ptr->compare(stop) < 0)
-				break;
-
-			for (elem = start; elem != stop;
-			    elem = TAILQ_NEXT(elem, entry)) {
-				/* check if scores in line */
-				if (elem->type == MPP_T_SCORE_SUBDIV ||
-				    elem->type == MPP_T_MACRO) {
-					y++;
-					break;
-				}
-			}
-		}
-		break;
+	if (ptr != 0 && ptr->sequence >= 0 &&
+	    ptr->sequence < visualIndexMax) {
+		x = pVisualIndex[ptr->sequence].visual;
+		y = pVisualIndex[ptr->sequence].dot;
+	} else {
+		x = visual_max;
+		y = 0;
 	}
+
 	if (pindex != 0) {
 		*pindex = x;
 	}
@@ -692,15 +712,17 @@ MppScoreMain :: locateVisual(MppElement *ptr, int *pindex,
 	}
 }
 
+/*
+ * Compute the current scroll position and the rectangles of the
+ * current and last play position dots, if visible.
+ */
 void
-MppScoreMain :: viewPaintEvent(QPaintEvent *event)
+MppScoreMain :: viewOverlay(int &scroll, QRect &rcurr, QRect &rlast)
 {
-	QPainter paint(viewWidgetSub);
 	MppVisualDot *pcdot;
 	MppVisualDot *podot;
 	MppElement *curr;
 	MppElement *last;
-	int scroll;
 	int y_blocks;
 
 	int y_div;
@@ -712,10 +734,6 @@ MppScoreMain :: viewPaintEvent(QPaintEvent *event)
 	int yo_div;
 	int yo_rem;
 
-	int x;
-
-	paint.fillRect(event->rect(), Mpp.ColorWhite);
-
 	mainWindow->atomic_lock();
 	curr = head.state.curr_start;
 	last = head.state.last_start;
@@ -732,10 +750,6 @@ MppScoreMain :: viewPaintEvent(QPaintEvent *event)
 	/* locate last play position */
 	locateVisual(last, &yo_rem, 0, &podot);
 
-	y_div = 0;
-	yc_div = 0;
-	yo_div = 0;
-
 	/* compute scrollbar */
 
 	y_div = scroll / y_blocks;
@@ -763,43 +777,112 @@ MppScoreMain :: viewPaintEvent(QPaintEvent *event)
 		yo_rem = yo_rem % y_blocks;
 	}
 
-	/* paint pictures */
+	/* the pictures start at the scroll position */
+	scroll = (y_div * y_blocks) + y_rem;
 
-	for (x = 0; x != y_blocks; x++) {
-		int y = ((y_div * y_blocks) + y_rem + x);
-		if (y >= visual_max)
-			break;
-		paint.drawPicture(
-		    QPoint(0, x * visual_y_max),
-		    *(pVisual[y].pic));
+	if ((curr != last) && (yo_div == y_div) && (podot != 0)) {
+		rlast = QRect(podot->x_off,
+		    podot->y_off + (yo_rem * visual_y_max),
+		    MPP_VISUAL_R_MAX, MPP_VISUAL_R_MAX);
+	} else {
+		rlast = QRect();
+	}
+
+	if ((yc_div == y_div) && (pcdot != 0)) {
+		rcurr = QRect(pcdot->x_off,
+		    pcdot->y_off + (yc_rem * visual_y_max),
+		    MPP_VISUAL_R_MAX, MPP_VISUAL_R_MAX);
+	} else {
+		rcurr = QRect();
 	}
+}
+
+/* region covered by a play position dot, including the pen */
+static QRect
+MppOverlayRect(const QRect &rect)
+{
+	if (rect.isNull())
+		return (rect);
+	return (rect.adjusted(-4, -4, 4, 4));
+}
+
+void
+MppScoreMain :: viewPaintEvent(QPaintEvent *event)
+{
+	QPainter paint(viewWidgetSub);
+	const QSize size = viewWidgetSub->size();
+	const qreal dpr = viewWidgetSub->devicePixelRatioF();
+	QRect rcurr;
+	QRect rlast;
+	int scroll;
+	int y_blocks;
+	int x;
+
+	viewOverlay(scroll, rcurr, rlast);
+
+	/*
+	 * The score pictures are rasterized once per scroll position,
+	 * size and compiled score. Partial updates only repaint the
+	 * dirty region from the cached page:
+	 */
+	const QString key = QString("mpp-view-%1-%2-%3-%4x%5-%6")
+	    .arg(unit).arg(visualSerial).arg(scroll)
+	    .arg(size.width()).arg(size.height()).arg(dpr);
+
+	if (viewPageKey != key &&
+	    QPixmapCache::find(key, &viewPage) == false) {
+		viewPage = QPixmap(size * dpr);
+		viewPage.setDevicePixelRatio(dpr);
+		viewPage.fill(Mpp.ColorWhite);
+
+		QPainter pp(&viewPage);
+
+		y_blocks = (size.height() / visual_y_max);
+		if (y_blocks == 0)
+			y_blocks = 1;
+
+		/* paint pictures */
+
+		for (x = 0; x != y_blocks; x++) {
+			int y = scroll + x;
+			if (y >= visual_max)
+				break;
+			pp.drawPicture(
+			    QPoint(0, x * visual_y_max),
+			    *(pVisual[y].pic));
+		}
+		pp.end();
+
+		/* keep recently used pages around for scrolling */
+		QPixmapCache::insert(key, viewPage);
+	}
+	viewPageKey = key;
+
+	paint.drawPixmap(0, 0, viewPage);
 
 	/* overlay (last) */
 
-	if ((curr != last) && (yo_div == y_div) && (podot != 0)) {
+	if (rlast.isNull() == false &&
+	    event->rect().intersects(MppOverlayRect(rlast))) {
 		paint.setPen(QPen(Mpp.ColorGreen, 4));
 		paint.setBrush(QColor(Mpp.ColorGreen));
-		paint.drawEllipse(QRect(podot->x_off,
-		    podot->y_off + (yo_rem * visual_y_max),
-		    MPP_VISUAL_R_MAX, MPP_VISUAL_R_MAX));
-
+		paint.drawEllipse(rlast);
 	}
 
 	/* overlay (current) */
 
-	if ((yc_div == y_div) && (pcdot != 0)) {
+	if (rcurr.isNull() == false &&
+	    event->rect().intersects(MppOverlayRect(rcurr))) {
 		paint.setPen(QPen(Mpp.ColorLogo, 4));
 		paint.setBrush(QColor(Mpp.ColorLogo));
-		paint.drawEllipse(QRect(pcdot->x_off,
-		    pcdot->y_off + (yc_rem * visual_y_max),
-		    MPP_VISUAL_R_MAX, MPP_VISUAL_R_MAX));
+		paint.drawEllipse(rcurr);
 	}
 
 	/* overlay (active chord) */
 
 	if (keyMode == MM_PASS_NONE_CHORD_PIANO ||
 	    keyMode == MM_PASS_NONE_CHORD_AUX) {
-		int width = viewWidgetSub->width();
+		int width = size.width();
 		int mask;
 
 		mainWindow->atomic_lock();
@@ -819,12 +902,224 @@ MppScoreMain :: viewPaintEvent(QPaintEvent *event)
 		  }
 		}
 	}
+
+	/* store what is on the screen, see viewUpdate() */
+	viewPaintScroll = scroll;
+	viewPaintSerial = visualSerial;
+	viewPaintSize = size;
+	viewPaintCurr = rcurr;
+	viewPaintLast = rlast;
 }
 
-/* The following function must be called locked */
+/*
+ * Request a repaint of the score view. Unless the page itself has
+ * changed, only the play position dots which moved and the active
+ * chord overlay are invalidated.
+ */
+void
+MppScoreMain :: viewUpdate()
+{
+	QRegion region;
+	QRect rcurr;
+	QRect rlast;
+	int scroll;
+
+	viewOverlay(scroll, rcurr, rlast);
 
+	if (scroll != viewPaintScroll ||
+	    visualSerial != viewPaintSerial ||
+	    viewWidgetSub->size() != viewPaintSize) {
+		viewWidgetSub->update();
+		return;
+	}
+
+	if (rcurr != viewPaintCurr) {
+		region += MppOverlayRect(viewPaintCurr);
+		region += MppOverlayRect(rcurr);
+	}
+	if (rlast != viewPaintLast) {
+		region += MppOverlayRect(viewPaintLast);
+		region += MppOverlayRect(rlast);
+	}
+	if (keyMode == MM_PASS_NONE_CHORD_PIANO ||
+	    keyMode == MM_PASS_NONE_CHORD_AUX) {
+		region += QRect(viewPaintSize.width() - (2 * MPP_VISUAL_C_MAX), 0,
+		    2 * MPP_VISUAL_C_MAX, MPP_VISUAL_C_MAX);
+	}
+	if (region.isEmpty() == false)
+		viewWidgetSub->update(region);
+}
+
+/*
+ * The following function must be called unlocked. The new elements
+ * are built without holding the lock and are then published using a
+ * quick swap, so that the MIDI input path never waits for the parser.
+ */
 void
 MppScoreMain :: handleParse(const QString &pstr)
+{
+	MppHead temp;
+	MppElement *ptr;
+	int auto_utune = -1;
+
+	/* add string to input */
+	temp += pstr;
+
+	/* flush last element, if any */
+	temp.flush();
+
+	/* move dots before chords */
+	temp.dotReorder();
+
+	/* compile before auto-melody */
+	sheet->compile(temp);
+
+	TAILQ_FOREACH(ptr, &temp.head, entry) {
+		if (ptr->type == MPP_T_COMMAND &&
+		    ptr->value[0] == MPP_CMD_MICRO_TUNE)
+			auto_utune = ptr->value[1];
+	}
+
+	if (auto_utune > 0)
+		temp.tuneScore();
+
+	/* number all elements to make searching easier */
+	temp.sequence();
+
+	mainWindow->atomic_lock();
+	head.publish(&temp);
+	mainWindow->atomic_unlock();
+
+	handleParseSub();
+
+	/* the old elements are freed by the destructor of "temp" */
+}
+
+/*
+ * The following function must be called unlocked. It tries to only
+ * re-parse the lines which changed between "old" and "str", using the
+ * range of characters reported by the "contentsChange" signal. Returns
+ * zero on success.
+ */
+int
+MppScoreMain :: handleParseLines(const QString &old, const QString &str)
+{
+	MppHead temp;
+	MppElement *start;
+	MppElement *stop;
+	int prefix = editDirtyPrefix;
+	int suffix = editDirtySuffix;
+	int first;
+	int num;
+	int lines;
+	int x;
+
+	/* micro tuning is not incremental */
+	if (autoMicroTune > 0 || prefix < 0 || suffix < 0 ||
+	    prefix + suffix > old.size())
+		return (-1);
+
+	if (prefix > old.size())
+		prefix = old.size();
+	if (prefix > str.size())
+		prefix = str.size();
+	if (suffix > old.size() - prefix)
+		suffix = old.size() - prefix;
+	if (suffix > str.size() - prefix)
+		suffix = str.size() - prefix;
+
+	/* align the prefix to the start of a line */
+	while (prefix > 0 && str[prefix - 1] != '\n')
+		prefix--;
+
+	/*
+	 * Align the suffix to the start of a line. The newline ending
+	 * the previous line must itself be part of the unchanged tail,
+	 * else a newline which was just inserted or removed is taken as
+	 * an unchanged line boundary. For example splitting "abc" into
+	 * "ab\nc", or joining it back, must re-parse the whole line.
+	 */
+	if (suffix > 0)
+		suffix--;
+	while (suffix > 0 && (str[str.size() - suffix - 1] != '\n' ||
+	    old[old.size() - suffix - 1] != '\n'))
+		suffix--;
+
+	/* if the first line changed, just re-parse everything */
+	if (prefix == 0)
+		return (-1);
+
+	for (first = x = 0; x != prefix; x++) {
+		if (str[x] == '\n')
+			first++;
+	}
+
+	if (suffix == 0) {
+		num = -1;
+		lines = -1;
+	} else {
+		for (num = 0, x = prefix; x != old.size() - suffix; x++) {
+			if (old[x] == '\n')
+				num++;
+		}
+		for (lines = 0, x = prefix; x != str.size() - suffix; x++) {
+			if (str[x] == '\n')
+				lines++;
+		}
+	}
+
+	/* strings and comments must be complete in the old lines */
+	temp += old.mid(prefix, old.size() - suffix - prefix);
+	if (temp.state.comment != 0 || temp.state.string != 0)
+		return (-1);
+	temp.clear();
+
+	temp += str.mid(prefix, str.size() - suffix - prefix);
+
+	/* strings and comments must be complete in the new lines */
+	if (temp.state.comment != 0 || temp.state.string != 0)
+		return (-1);
+
+	temp.flush();
+	temp.dotReorder();
+
+	/* number the new elements and build their operations unlocked */
+	if (head.prepareLines(first, num, &temp, &start, &stop) != 0)
+		return (-1);
+
+	mainWindow->atomic_lock();
+	head.replaceLines(first, num, lines, &temp, start, stop);
+	mainWindow->atomic_unlock();
+
+	sheet->compile(head);
+
+	handleParseSub();
+
+	/* the old elements are freed by the destructor of "temp" */
+	return (0);
+}
+
+void
+MppScoreMain :: handleContentsChange(int pos, int removed, int added)
+{
+	int suffix;
+
+	suffix = editWidget->document()->characterCount() - 1 - pos - added;
+	if (suffix < 0)
+		suffix = 0;
+
+	if (editDirtyPrefix > pos)
+		editDirtyPrefix = pos;
+	if (editDirtySuffix > suffix)
+		editDirtySuffix = suffix;
+}
+
+/*
+ * The following function must be called unlocked. Only the GUI thread
+ * modifies the list of elements, so it can be read without the lock.
+ */
+void
+MppScoreMain :: handleParseSub()
 {
 	MppElement *start;
 	MppElement *stop;
@@ -834,18 +1129,10 @@ MppScoreMain :: handleParse(const QString &pstr)
 	int has_string;
 	int index;
 	int num_dot;
-
-	/* reset head structure */
-	head.clear();
-
-	/* add string to input */
-	head += pstr;
-
-	/* flush last element, if any */
-	head.flush();
+	uint32_t channels;
 
 	/* set initial mask for active channels */
-	active_channels = 1;
+	channels = 1;
 
 	/* no automatic micro tuning */
 	auto_utune = -1;
@@ -887,7 +1174,7 @@ MppScoreMain :: handleParse(const QString &pstr)
 				break;
 			case MPP_T_CHANNEL:
 				if (ptr->value[0] > -1 && ptr->value[0] < 16)
-					active_channels |= (1 << ptr->value[0]);
+					channels |= (1 << ptr->value[0]);
 				break;
 			case MPP_T_STRING_DESC:
 			case MPP_T_STRING_DOT:
@@ -914,8 +1201,6 @@ MppScoreMain :: handleParse(const QString &pstr)
 	if (visual_max != 0)
 		pVisual = new MppVisualScore [visual_max];
 
-	head.dotReorder();
-
 	index = 0;
 
 	for (start = stop = 0; head.foreachLine(&start, &stop); ) {
@@ -968,51 +1253,90 @@ MppScoreMain :: handleParse(const QString &pstr)
 
 	visual_max = index;
 
-	/* compile before auto-melody */
-	sheet->compile(head);
-	
-	if (auto_utune > 0)
-		head.tuneScore();
+	/* map sequence numbers to visual and dot indexes */
+	delete [] pVisualIndex;
+	pVisualIndex = 0;
+	visualIndexMax = 0;
+
+	ptr = TAILQ_LAST(&head.head, MppElementHead);
+	if (ptr != 0 && visual_max != 0) {
+		visualIndexMax = ptr->sequence + 1;
+		pVisualIndex = new MppVisualIndex [visualIndexMax];
+
+		for (index = 0; index != visualIndexMax; index++) {
+			pVisualIndex[index].visual = visual_max;
+			pVisualIndex[index].dot = 0;
+		}
+
+		for (index = 0; index != visual_max; index++) {
+			num_dot = 0;
+
+			for (start = stop = pVisual[index].start;
+			    head.foreachLine(&start, &stop); ) {
+
+				if (start->compare(pVisual[index].stop) >= 0)
+					break;
+
+				has_string = 0;
+
+				for (ptr = start; ptr != stop; ptr = ptr->next()) {
+					pVisualIndex[ptr->sequence].visual = index;
+					pVisualIndex[ptr->sequence].dot = num_dot;
+
+					/* check if scores in line */
+					if (ptr->type == MPP_T_SCORE_SUBDIV ||
+					    ptr->type == MPP_T_MACRO)
+						has_string = 1;
+				}
+				num_dot += has_string;
+			}
+		}
+	}
+
+	autoMicroTune = auto_utune;
+
+	mainWindow->atomic_lock();
+
+	active_channels = channels;
 
 	/* check if key-mode should be applied */
 	switch (key_mode) {
 	case 0:
 		keyMode = MM_PASS_ALL;
-		mainWindow->keyModeUpdated = 1;
+		mainWindow->notify(MPP_DIRTY_KEY_MODE);
 		break;
 	case 2:
 		keyMode = MM_PASS_NONE_FIXED;
-		mainWindow->keyModeUpdated = 1;
+		mainWindow->notify(MPP_DIRTY_KEY_MODE);
 		break;
 	case 3:
 		keyMode = MM_PASS_NONE_TRANS;
-		mainWindow->keyModeUpdated = 1;
+		mainWindow->notify(MPP_DIRTY_KEY_MODE);
 		break;
 	case 4:
 		keyMode = MM_PASS_NONE_CHORD_PIANO;
-		mainWindow->keyModeUpdated = 1;
+		mainWindow->notify(MPP_DIRTY_KEY_MODE);
 		break;
 	case 5:
 		keyMode = MM_PASS_NONE_CHORD_AUX;
-		mainWindow->keyModeUpdated = 1;
+		mainWindow->notify(MPP_DIRTY_KEY_MODE);
 		break;
 	case 6:
 		keyMode = MM_PASS_NONE_CHORD_TRANS;
-		mainWindow->keyModeUpdated = 1;
+		mainWindow->notify(MPP_DIRTY_KEY_MODE);
 		break;
 	default:
 		break;
 	}
 
-	/* number all elements to make searching easier */
-	head.sequence();
-
 	/* get first line */
 	head.currLine(&start, &stop);
 
 	/* sync last */
 	head.syncLast();
 
+	mainWindow->atomic_unlock();
+
 	/* create the graphics */
 	handlePrintSub(0, QPoint(0,0));
 
@@ -1156,7 +1480,7 @@ MppScoreMain :: handleLabelJump(int pos)
 	head.jumpLabel(pos);
 	head.syncLast();
 
-	mainWindow->cursorUpdate = 1;
+	mainWindow->notify(MPP_DIRTY_CURSOR);
 
 	mainWindow->handle_stop(1);
 
@@ -1302,9 +1626,10 @@ static const uint16_t mpp_piano_chord_all_map[MPP_MAX_CHORD_MAP] = {
 void
 MppScoreMain :: handleChordsLoad(void)
 {
+	const MppCompiledOp *pop;
+	const MppCompiledOp *pend;
 	MppElement *start;
 	MppElement *stop;
-	MppElement *ptr;
 	int duration;
 	uint8_t x;
 	uint8_t ns;
@@ -1323,17 +1648,18 @@ MppScoreMain :: handleChordsLoad(void)
 	duration = 1;
 
 	head.currLine(&start, &stop);
+	head.compiledRange(start, stop, &pop, &pend);
 
-	for (ptr = start; ptr != stop; ptr = ptr->next()) {
-		switch (ptr->type) {
+	for (; pop != pend; pop++) {
+		switch (pop->type) {
 		case MPP_T_DURATION:
-			duration = ptr->value[0];
+			duration = pop->value[0];
 			break;
 		case MPP_T_SCORE_SUBDIV:
 			if (duration == 0)
 				break;
 			if (ns < 24)
-				score[ns++] = ptr->value[0];
+				score[ns++] = pop->value[0];
 			break;
 		default:
 			break;
@@ -1378,7 +1704,7 @@ MppScoreMain :: handleChordsLoad(void)
 	head.syncLast();
 	head.stepLine(&start, &stop);
 
-	mainWindow->cursorUpdate = 1;
+	mainWindow->notify(MPP_DIRTY_CURSOR);
 
 	mainWindow->dlg_bpm->handle_beat_event_locked(unit);
 }
@@ -1526,7 +1852,7 @@ MppScoreMain :: handleKeyPressChord(int in_key, int vel, uint32_t key_delay)
 		mainWindow->output_key(mse.trackSec, mse.channelSec,
 		    mse.key, vel, key_delay, 0);
 	}
-	mainWindow->cursorUpdate = 1;
+	mainWindow->notify(MPP_DIRTY_CURSOR);
 }
 
 /* must be called locked */
@@ -1657,9 +1983,11 @@ void
 MppScoreMain :: handleKeyPressSub(int in_key, int vel,
     uint32_t key_delay, int key_trans, int allow_macro)
 {
+	const MppCompiledOp *pbegin;
+	const MppCompiledOp *pend;
+	const MppCompiledOp *pop;
 	MppElement *start;
 	MppElement *stop;
-	MppElement *ptr;
 	int t_pre;
 	int t_post;
 	int channel;
@@ -1681,15 +2009,17 @@ MppScoreMain :: handleKeyPressSub(int in_key, int vel,
 
 		decrementDuration(vel, 0);
 
-		for (ptr = start; ptr != stop; ptr = ptr->next()) {
-			switch (ptr->type) {
+		head.compiledRange(start, stop, &pbegin, &pend);
+
+		for (pop = pbegin; pop != pend; pop++) {
+			switch (pop->type) {
 			case MPP_T_SCORE_SUBDIV:
 				if (duration <= 0)
 					break;
 				nscore++;
 				break;
 			case MPP_T_DURATION:
-				duration = ptr->value[0];
+				duration = pop->value[0];
 				break;
 			default:
 				break;
@@ -1714,8 +2044,8 @@ MppScoreMain :: handleKeyPressSub(int in_key, int vel,
 
 		duration = 1;
 
-		for (ptr = start; ptr != stop; ptr = ptr->next()) {
-			switch (ptr->type) {
+		for (pop = pbegin; pop != pend; pop++) {
+			switch (pop->type) {
 			MppScoreMain *sm;
 			MppScoreEntry mse;
 			int ch;
@@ -1728,20 +2058,20 @@ MppScoreMain :: handleKeyPressSub(int in_key, int vel,
 				if (transpose == MPP_KEY_MIN)
 					break;
 
-				switch (ptr->value[1]) {
+				switch (pop->value[1]) {
 				case 1:
 				case 2:
 				case 3:
 				case 4:
 					sm = mainWindow->getCurrTransposeView();
-					temp = ptr->value[0] / MPP_BAND_STEP_12;
+					temp = pop->value[0] / MPP_BAND_STEP_12;
 
 					if (sm == 0 || temp < 0 || temp >= MPP_MAX_CHORD_FUTURE) {
 						transpose = MPP_KEY_MIN;
 						break;
 					}
 
-					switch (ptr->value[1]) {
+					switch (pop->value[1]) {
 					case 1:
 						mse = sm->score_future_base[temp];
 						break;
@@ -1767,7 +2097,7 @@ MppScoreMain :: handleKeyPressSub(int in_key, int vel,
 					transpose = mse.key + key_trans;
 					break;
 				default:
-					transpose = ptr->value[0] + key_trans;
+					transpose = pop->value[0] + key_trans;
 					break;
 				}
 				break;
@@ -1780,7 +2110,7 @@ MppScoreMain :: handleKeyPressSub(int in_key, int vel,
 				head.pushLine();
 
 				/* jump to target */
-				head.jumpLabel(ptr->value[0]);
+				head.jumpLabel(pop->value[0]);
 
 				/* set frozen keys */
 				memcpy(frozenKeys, pressedKeys, sizeof(frozenKeys));
@@ -1804,7 +2134,7 @@ MppScoreMain :: handleKeyPressSub(int in_key, int vel,
 				else
 					out_vel = vel_other;
 
-				out_key = ptr->value[0] + in_key + transpose;
+				out_key = pop->value[0] + in_key + transpose;
 
 				ch = (synthChannel + channel) & 0xF;
 
@@ -1821,16 +2151,16 @@ MppScoreMain :: handleKeyPressSub(int in_key, int vel,
 				break;
 
 			case MPP_T_DURATION:
-				duration = ptr->value[0];
+				duration = pop->value[0];
 				break;
 
 			case MPP_T_CHANNEL:
-				channel = ptr->value[0];
+				channel = pop->value[0];
 				break;
 
 			case MPP_T_TIMER:
-				t_pre += ptr->value[0];
-				t_post += ptr->value[1];
+				t_pre += pop->value[0];
+				t_post += pop->value[1];
 				break;
 
 			default:
@@ -1870,7 +2200,7 @@ MppScoreMain :: handleKeyPress(int in_key, int vel, uint32_t key_delay)
 
 	/* update cursor, if any */
 
-	mainWindow->cursorUpdate = 1;
+	mainWindow->notify(MPP_DIRTY_CURSOR);
 }
 
 /* must be called locked */
@@ -2026,11 +2356,12 @@ MppScoreMain :: handleCompile(int force)
 	temp = editWidget->toPlainText();
 
 	if (temp != editText || force != 0) {
-		editText = temp;
+		if (force != 0 || handleParseLines(editText, temp) != 0)
+			handleParse(temp);
 
-		mainWindow->atomic_lock();
-		handleParse(editText);
-		mainWindow->atomic_unlock();
+		editText = temp;
+		editDirtyPrefix = temp.size();
+		editDirtySuffix = temp.size();
 
 		return (1);
 	}
@@ -2100,24 +2431,31 @@ void
 MppScoreMain :: handleScoreFileEffect(int which, int parm, int flag)
 {
 	QTextCursor cursor(editWidget->textCursor());
+	QString text;
+	QString sel;
 	MppHead temp;
 	int re_select;
+	int start;
+	int end;
 	int pos;
 
-	cursor.beginEditBlock();
+	text = editWidget->toPlainText();
 
 	re_select = cursor.hasSelection();
 
-	if (re_select == 0) {
-		cursor.movePosition(QTextCursor::End, QTextCursor::MoveAnchor, 1);
-		cursor.movePosition(QTextCursor::Start, QTextCursor::KeepAnchor, 1);
+	if (re_select != 0) {
+		start = cursor.selectionStart();
+		end = cursor.selectionEnd();
+	} else {
+		start = 0;
+		end = text.size();
 	}
 
-	QString sel = cursor.selectedText();
-
-	if (sel.size() == 0)
+	if (start == end)
 		goto done;
 
+	sel = text.mid(start, end - start);
+
 	temp += sel;
 	temp.flush();
 
@@ -2141,21 +2479,20 @@ MppScoreMain :: handleScoreFileEffect(int which, int parm, int flag)
 		break;
 	}
 
-	sel = temp.toPlain();
+	pos = editWidget->document()->findBlock(start).blockNumber();
 
-	cursor.removeSelectedText();
-	pos = cursor.blockNumber();
-	cursor.insertText(sel);
+	cursor.beginEditBlock();
+	MppReplaceText(cursor, start, sel, temp.toPlain());
 
 	if (re_select != 0) {
 		cursor.movePosition(QTextCursor::Start, QTextCursor::MoveAnchor, 1);
 		cursor.movePosition(QTextCursor::Down, QTextCursor::MoveAnchor, pos);
-		cursor.movePosition(QTextCursor::Down, QTextCursor::KeepAnchor, MppCountNewline(sel));
+		cursor.movePosition(QTextCursor::Down, QTextCursor::KeepAnchor,
+		    MppCountNewline(temp.toPlain()));
 		editWidget->setTextCursor(cursor);
 	}
-done:
 	cursor.endEditBlock();
-
+done:
 	handleCompile();
 }
 
@@ -2270,7 +2607,6 @@ MppScoreMain :: handleScoreFileExportNoChords(void)
 void
 MppScoreMain :: handleEditLine(void)
 {
-	MppHead temp;
 	MppChordElement info;
 	QTextCursor cursor(editWidget->textCursor());
 	int row;
@@ -2284,11 +2620,14 @@ MppScoreMain :: handleEditLine(void)
 
 	row = cursor.blockNumber();
 
-	temp += editWidget->toPlainText();
-	temp.flush();
+	/* make sure the compiled scores are up to date */
+	handleCompile();
 
-	/* check if the chord is valid */
-	if (temp.getChord(row, &info) != 0) {
+	/*
+	 * Only the GUI thread modifies the elements, so the line
+	 * index can be used without locking:
+	 */
+	if (head.getChord(row, &info) != 0) {
 		MppMainWindow *mw = mainWindow;
 		if (mw->tab_chord_gl->parseScoreChord(&info) == 0) {
 			mw->main_tb->makeWidgetVisible(mw->tab_chord_gl, this->editWidget);
@@ -2301,24 +2640,42 @@ void
 MppScoreMain :: handleScoreFileReplaceAll(void)
 {
 	QTextCursor cursor(editWidget->textCursor());
+	QString text;
+	QString str;
+	int x;
+	int y;
 
 	MppReplace dlg(mainWindow, this, cursor.selectedText(),
 	    cursor.selectedText());
 
-	if (dlg.exec() == MppDialog::Accepted) {
+	if (dlg.exec() != MppDialog::Accepted || dlg.match.isEmpty())
+		return;
 
-		editWidget->moveCursor(QTextCursor::Start, QTextCursor::MoveAnchor);
+	text = editWidget->toPlainText();
 
-		while (editWidget->find(dlg.match)) {
+	/* compute all replacements in one pass */
+	for (x = 0; (y = text.indexOf(dlg.match, x, Qt::CaseInsensitive)) > -1;
+	     x = y + dlg.match.size()) {
+		if (str.isEmpty())
+			str.reserve(text.size());
+		str.append(text.constData() + x, y - x);
+		str.append(dlg.replace);
+	}
 
-			cursor = editWidget->textCursor();
+	/* check for no matches */
+	if (x == 0)
+		return;
 
-			cursor.beginEditBlock();
-			cursor.removeSelectedText();
-			cursor.insertText(dlg.replace);
-			cursor.endEditBlock();
-		}
-	}
+	str.append(text.constData() + x, text.size() - x);
+
+	/* apply them as a single edit */
+	cursor.beginEditBlock();
+	MppReplaceText(cursor, 0, text, str);
+	cursor.endEditBlock();
+
+	editWidget->setTextCursor(cursor);
+
+	handleCompile();
 }
 
 /* must be called locked */
@@ -2355,22 +2712,23 @@ MppScoreMain :: outputControl(uint8_t ctrl, uint8_t val)
 	struct mid_data *d = &mw->mid_data;
 	const unsigned off = unit * MPP_TRACKS_PER_VIEW;
 	uint16_t ChannelMask[MPP_TRACKS_PER_VIEW] = {};
+	uint32_t now;
 	uint8_t chan;
+	uint8_t num;
 
 	outputChannelMaskGet(ChannelMask);
 
 	/* the control event is distributed to all active channels */
-	for (chan = 0; chan != 16; chan++) {
-		for (unsigned x = 0; x != MPP_TRACKS_PER_VIEW; x++) {
-			if ((ChannelMask[x] >> chan) & 1) {
-				if (mw->check_play(off + x, chan, 0))
-					mid_control(d, ctrl, val);
-				if (mw->check_record(off + x, chan, 0))
+	for (unsigned x = 0; x != MPP_TRACKS_PER_VIEW; x++) {
+		if (ChannelMask[x] == 0)
+			continue;
+		num = mw->output_plan(off + x, &now);
+		for (chan = 0; chan != 16; chan++) {
+			if (((ChannelMask[x] >> chan) & 1) == 0)
+				continue;
+			for (uint8_t n = 0; n != num; n++) {
+				if (mw->output_route(&mw->outRoute[off + x][n], chan, now))
 					mid_control(d, ctrl, val);
-				for (unsigned n = 0; n != MPP_LOOP_MAX; n++) {
-					if (mw->tab_loop->check_record(off + x, chan, n))
-						mid_control(d, ctrl, val);
-				}
 			}
 		}
 	}
@@ -2384,7 +2742,9 @@ MppScoreMain :: outputChanPressure(uint8_t pressure)
 	struct mid_data *d = &mw->mid_data;
 	const unsigned off = unit * MPP_TRACKS_PER_VIEW;
 	uint16_t ChannelMask[MPP_TRACKS_PER_VIEW] = {};
+	uint32_t now;
 	uint8_t chan;
+	uint8_t num;
 	uint8_t buf[4];
 
 	outputChannelMaskGet(ChannelMask);
@@ -2395,17 +2755,16 @@ MppScoreMain :: outputChanPressure(uint8_t pressure)
 	buf[3] = 0;
 
 	/* the pressure event is distributed to all active channels */
-	for (chan = 0; chan != 16; chan++) {
-		for (unsigned x = 0; x != MPP_TRACKS_PER_VIEW; x++) {
-			if ((ChannelMask[x] >> chan) & 1) {
-				if (mw->check_play(off + x, chan, 0))
-					mid_add_raw(d, buf, 2, 0);
-				if (mw->check_record(off + x, chan, 0))
+	for (unsigned x = 0; x != MPP_TRACKS_PER_VIEW; x++) {
+		if (ChannelMask[x] == 0)
+			continue;
+		num = mw->output_plan(off + x, &now);
+		for (chan = 0; chan != 16; chan++) {
+			if (((ChannelMask[x] >> chan) & 1) == 0)
+				continue;
+			for (uint8_t n = 0; n != num; n++) {
+				if (mw->output_route(&mw->outRoute[off + x][n], chan, now))
 					mid_add_raw(d, buf, 2, 0);
-				for (unsigned n = 0; n != MPP_LOOP_MAX; n++) {
-					if (mw->tab_loop->check_record(off + x, chan, n))
-						mid_add_raw(d, buf, 2, 0);
-				}
 			}
 		}
 	}
@@ -2419,22 +2778,23 @@ MppScoreMain :: outputPitch(uint16_t val)
 	struct mid_data *d = &mw->mid_data;
 	const unsigned off = unit * MPP_TRACKS_PER_VIEW;
 	uint16_t ChannelMask[MPP_TRACKS_PER_VIEW] = {};
+	uint32_t now;
 	uint8_t chan;
+	uint8_t num;
 
 	outputChannelMaskGet(ChannelMask);
 
 	/* the pitch event is distributed to all active channels */
-	for (chan = 0; chan != 16; chan++) {
-		for (unsigned x = 0; x != MPP_TRACKS_PER_VIEW; x++) {
-			if ((ChannelMask[x] >> chan) & 1) {
-				if (mw->check_play(off + x, chan, 0))
-					mid_pitch_bend(d, val);
-				if (mw->check_record(off + x, chan, 0))
+	for (unsigned x = 0; x != MPP_TRACKS_PER_VIEW; x++) {
+		if (ChannelMask[x] == 0)
+			continue;
+		num = mw->output_plan(off + x, &now);
+		for (chan = 0; chan != 16; chan++) {
+			if (((ChannelMask[x] >> chan) & 1) == 0)
+				continue;
+			for (uint8_t n = 0; n != num; n++) {
+				if (mw->output_route(&mw->outRoute[off + x][n], chan, now))
 					mid_pitch_bend(d, val);
-				for (unsigned n = 0; n != MPP_LOOP_MAX; n++) {
-					if (mw->tab_loop->check_record(off + x, chan, n))
-						mid_pitch_bend(d, val);
-				}
 			}
 		}
 	}
@@ -2498,6 +2858,34 @@ MppScoreMain :: handleMidiKeyPressLocked(int key, int vel)
 	}
 }
 
+/*
+ * Record that the given MPE key is active on the given channel, so
+ * that expression events only need to visit the keys on their
+ * channel. Must be called locked.
+ */
+void
+MppScoreMain :: inputKeySet(uint8_t key, uint8_t chan)
+{
+	key &= 0x7F;
+	chan &= 0x0F;
+
+	inputKeyToChannel[key] = chan;
+	inputChannelKeys[chan][key / 32] |= 1U << (key % 32);
+}
+
+/* must be called locked */
+void
+MppScoreMain :: inputKeyClear(uint8_t key)
+{
+	uint8_t chan;
+
+	key &= 0x7F;
+	chan = inputKeyToChannel[key];
+
+	inputKeyToChannel[key] = 0;
+	inputChannelKeys[chan][key / 32] &= ~(1U << (key % 32));
+}
+
 void
 MppScoreMain :: handleMidiKeyReleaseLocked(int key, int vel)
 {
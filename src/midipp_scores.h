@@ -69,6 +69,8 @@ public:
 	void handleChordsLoad(void);
 	void handleMidiKeyPressLocked(int key, int vel);
 	void handleMidiKeyReleaseLocked(int key, int vel);
+	void inputKeySet(uint8_t key, uint8_t chan);
+	void inputKeyClear(uint8_t key);
 	void handleKeyPressChord(int key, int vel, uint32_t key_delay);
 	void handleKeyPitchChord(int in_key, int amount, uint32_t key_delay);
 	void handleKeyControlChord(int in_key, uint8_t control, int value, uint32_t key_delay);
@@ -78,6 +80,8 @@ public:
 	void handleKeyPress(int key, int vel, uint32_t key_delay);
 	void handleKeyRelease(int key, int vel, uint32_t key_delay);
 	void handleParse(const QString &ps);
+	int handleParseLines(const QString &, const QString &);
+	void handleParseSub(void);
 	uint8_t handleKeyRemovePast(MppScoreEntry *pn, int vel, uint32_t key_delay);
 	void handleScoreFileOpenRaw(char *, uint32_t);
 	void handlePrintSub(QPrinter *pd, QPoint orig);
@@ -91,6 +95,8 @@ public:
 	void handleEditLine(void);
 
 	void viewPaintEvent(QPaintEvent *event);
+	void viewOverlay(int &, QRect &, QRect &);
+	void viewUpdate();
 	void viewMousePressEvent(QMouseEvent *e);
 	void locateVisual(MppElement *, int *, int *, MppVisualDot **);
 
@@ -105,6 +111,7 @@ public:
 	uint8_t auto_zero_start[0];
 
 	MppVisualScore *pVisual;
+	MppVisualIndex *pVisualIndex;
 	MppSheet *sheet;
 	MppGridLayout *gl_view;
 	QScrollBar *viewScroll;
@@ -160,6 +167,8 @@ public:
 
 	int8_t inputChannel;
 	uint8_t inputKeyToChannel[128];
+	/* MPE keys active on each input channel, see inputKeySet() */
+	uint32_t inputChannelKeys[16][128 / 32];
 	uint8_t synthChannel;
 	int8_t synthChannelBase;
 	int8_t synthChannelTreb;
@@ -179,12 +188,27 @@ public:
 	uint8_t chordNormalize;
 	uint8_t songEventsOn;
 
+	int autoMicroTune;
+	int visualIndexMax;
+
+	uint32_t visualSerial;
+	uint32_t viewPaintSerial;
+	int viewPaintScroll;
+
 	uint8_t auto_zero_end[0];
 
 	int visual_y_max;
+	int editDirtyPrefix;
+	int editDirtySuffix;
 
 	QString editText;
 
+	QPixmap viewPage;
+	QString viewPageKey;
+	QSize viewPaintSize;
+	QRect viewPaintCurr;
+	QRect viewPaintLast;
+
 public slots:
 
 	int handleCompile(int force = 0);
@@ -206,6 +230,7 @@ public slots:
 	void handleScoreFileExportNoChords(void);
 	void handleScrollChanged(int value);
 	void handleScoreFileReplaceAll(void);
+	void handleContentsChange(int, int, int);
 };
 
 #endif		/* _MIDIPP_SCORES_H_ */
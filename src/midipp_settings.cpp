@@ -42,7 +42,7 @@
 #include "midipp_devsel.h"
 
 MppSettingsSub :: MppSettingsSub(MppMainWindow *_parent, const QString &fname) :
-    QSettings(fname), mw(_parent)
+    QSettings(fname), mw(_parent), name(fname)
 {
 	save.instruments = -1;
 	save.viewmode = -1;
@@ -143,6 +143,17 @@ MppSettingsSub :: byteArrayDefault(const QString &str, const QByteArray &n)
 	return (val);
 }
 
+/*
+ * The database is too big for the settings file and is stored in a
+ * separate file instead.
+ */
+QString
+MppSettingsSub :: databaseFile(void)
+{
+	return (QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) +
+	    QString("/") + name + QString("_database"));
+}
+
 QString
 MppSettingsSub :: concat(const char *fmt, int num, int sub)
 {
@@ -268,11 +279,8 @@ MppSettingsSub :: doSave(void)
 		setValue("location", mw->tab_database->location->text());
 		endGroup();
 	}
-	if (save.database_data) {
-		beginGroup("database_data");
-		setValue("array", mw->tab_database->input_data);
-		endGroup();
-	}
+	if (save.database_data)
+		mw->tab_database->save_file(databaseFile());
 	if (save.custom) {
 		beginGroup("custom_data");
 		for (x = 0; x != MPP_CUSTOM_MAX; x++)
@@ -425,6 +433,7 @@ MppSettingsSub :: doLoad(void)
 			mw->scores_main[x]->chordContrast = chordContrast;
 			mw->scores_main[x]->chordNormalize = chordNormalize;
 			mw->scores_main[x]->songEventsOn = songEvents;
+			mw->update_tx_plan();
 			mw->atomic_unlock();
 
 			mw->dlg_mode[x]->update_all();
@@ -480,6 +489,7 @@ MppSettingsSub :: doLoad(void)
 
 			for (x = 0; x != 16; x++)
 				mw->muteMap[y][x] = mute[x];
+			mw->update_tx_plan();
 			mw->atomic_unlock();
 		}
 	}
@@ -529,7 +539,9 @@ MppSettingsSub :: doLoad(void)
 		mw->tab_database->location->setText(
 		    stringDefault("database_url/location", MPP_DEFAULT_URL));
 	}
-	if (save.database_data > 0) {
+	if (save.database_data > 0 &&
+	    mw->tab_database->load_file(databaseFile()) == false) {
+		/* fallback to the database stored by older versions */
 		mw->tab_database->input_data =
 		  byteArrayDefault("database_data/array", QByteArray());
 		mw->tab_database->handle_download_finished_sub();
@@ -589,6 +601,9 @@ MppSettingsSub :: doClear()
 {
 	clear();
 
+	QFile::remove(databaseFile() + QString(".tar"));
+	QFile::remove(databaseFile() + QString(".idx"));
+
 	beginGroup("global");
 	setValue("save_instruments", 1);
 	setValue("save_viewmode", 1);
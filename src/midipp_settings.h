@@ -53,6 +53,7 @@ public:
 	int valueDefault(const QString &, int);
 
 	QString concat(const char *, int = 0, int = 0);
+	QString databaseFile(void);
 
 	void doSave(void);
 	void doLoad(void);
@@ -61,6 +62,8 @@ public:
 	MppMainWindow *mw;
 
 	MppSettingsSave save;
+
+	QString name;
 };
 
 class MppSettings : public QObject
@@ -39,7 +39,9 @@ MppSheet::MppSheet(MppMainWindow * parent, int _unit)
 	unit = _unit;
 	num_rows = 0;
 	num_cols = 0;
-	entries_ptr = 0;
+	num_cells = 0;
+	max_cells = 0;
+	entries_cells = 0;
 	entries_rows = 0;
 	entries_cols = 0;
 	mode = 0;
@@ -77,14 +79,16 @@ MppSheet::MppSheet(MppMainWindow * parent, int _unit)
 
 MppSheet::~MppSheet()
 {
-	free(entries_ptr);
-	entries_ptr = 0;
+	free(entries_cells);
+	entries_cells = 0;
 	free(entries_rows);
 	entries_rows = 0;
 	free(entries_cols);
 	entries_cols = 0;
 	num_rows = 0;
 	num_cols = 0;
+	num_cells = 0;
+	max_cells = 0;
 }
 
 void
@@ -219,11 +223,14 @@ MppSheet::outputColumn(ssize_t col)
 	int trans_mode = 0;
 	int any = 0;
 	ssize_t x;
+	ssize_t y;
 
-	for (x = 0; x != num_rows; x++) {
-		int ndur = entries_ptr[col + (x * num_cols)];
+	for (y = 0; y != entries_cols[col].num; y++) {
+		const MppSheetCell *pc = entries_cells + entries_cols[col].first + y;
+		int ndur = pc->dur;
 		if (ndur < 1)
 			continue;
+		x = pc->row;
 		switch (entries_rows[x].type) {
 		case MPP_T_MACRO:
 			if (chan != entries_rows[x].u.macro.chan) {
@@ -276,18 +283,21 @@ MppSheet::compile(MppHead & head)
 	MppElement *ptr;
 	MppElement *start;
 	MppElement *stop;
+	ssize_t first;
 	int label;
 	size_t n;
 	size_t x;
 
-	free(entries_ptr);
-	entries_ptr = 0;
+	free(entries_cells);
+	entries_cells = 0;
 	free(entries_rows);
 	entries_rows = 0;
 	free(entries_cols);
 	entries_cols = 0;
 	num_rows = 0;
 	num_cols = 0;
+	num_cells = 0;
+	max_cells = 0;
 	vs_horiz->setMaximum(0);
 	vs_vert->setMaximum(0);
 
@@ -312,8 +322,10 @@ MppSheet::compile(MppHead & head)
 		if (any)
 			num_cols++;
 	}
-	if (n == 0)
+	if (n == 0) {
+		num_cols = 0;
 		return;
+	}
 
 	x = n * sizeof(struct MppSheetRow);
 	ptemp = (struct MppSheetRow *)malloc(x);
@@ -393,37 +405,66 @@ MppSheet::compile(MppHead & head)
 
 	MppSort(ptemp, n, sizeof(ptemp[0]), &MppSheetRowCompare, 0);
 
+	for (x = 0; x != (size_t)num_cols; x++) {
+		entries_cols[x].first = 0;
+		entries_cols[x].num = 0;
+	}
+
+	/* count rows and the non-empty cells of each column */
 	num_rows = 0;
 	for (x = 0; x != n; x++) {
 		if (x == 0 ||
 		    MppSheetRowCompareType(0, ptemp + x - 1, ptemp + x))
 			num_rows++;
+		else if (ptemp[x - 1].col == ptemp[x].col)
+			continue;	/* same cell */
+		entries_cols[ptemp[x].col].num++;
+		num_cells++;
 	}
-	
+
+	/* compute column index */
+	for (first = x = 0; x != (size_t)num_cols; x++) {
+		entries_cols[x].first = first;
+		first += entries_cols[x].num;
+		entries_cols[x].num = 0;
+	}
+
 	x = num_rows * sizeof(struct MppSheetRow);
 	entries_rows = (struct MppSheetRow *)malloc(x);
 	memset(entries_rows, 0, x);
 
-	x = num_rows * num_cols * sizeof(int);
-	entries_ptr = (int *)malloc(x);
-	memset(entries_ptr, 0, x);
+	max_cells = num_cells;
+	entries_cells = (struct MppSheetCell *)malloc(num_cells * sizeof(struct MppSheetCell));
 
+	/* fill in the cells, which end up sorted by row in each column */
 	num_rows = 0;
 	for (x = 0; x != n; x++) {
+		MppSheetCol *pcol = entries_cols + ptemp[x].col;
+		MppSheetCell *pc;
+
 		if (x == 0 ||
 		    MppSheetRowCompareType(0, ptemp + x - 1, ptemp + x)) {
 			entries_rows[num_rows] = ptemp[x];
 			num_rows++;
+			pc = entries_cells + pcol->first + pcol->num++;
+		} else if (ptemp[x - 1].col == ptemp[x].col) {
+			/* last one wins */
+			pc = entries_cells + pcol->first + pcol->num - 1;
+		} else {
+			pc = entries_cells + pcol->first + pcol->num++;
 		}
+
+		pc->row = num_rows - 1;
+
 		switch (ptemp[x].type) {
 		case MPP_T_MACRO:
-			entries_ptr[ptemp[x].col + ((num_rows - 1) * num_cols)] = 1;
+			pc->dur = 1;
 			break;
 		case MPP_T_SCORE_SUBDIV:
-			entries_ptr[ptemp[x].col + ((num_rows - 1) * num_cols)] =
-			    ptemp[x].u.score.dur;
+			pc->dur = ptemp[x].u.score.dur;
 			break;
 		default:
+			pc->dur = 0;
 			break;
 		}
 	}	
@@ -435,6 +476,77 @@ MppSheet::compile(MppHead & head)
 	update();
 }
 
+/* returns the column of the given line or num_cols if not found */
+ssize_t
+MppSheet::findColumn(int line)
+{
+	ssize_t lo = 0;
+	ssize_t hi = num_cols;
+
+	/* columns are sorted by line */
+	while (lo < hi) {
+		ssize_t mid = (lo + hi) / 2;
+
+		if (entries_cols[mid].line < line)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo != num_cols && entries_cols[lo].line == line)
+		return (lo);
+	return (num_cols);
+}
+
+/*
+ * Returns a pointer to the duration of the given cell. If the cell
+ * is empty and "insert" is set, a new cell with zero duration is
+ * created. Else NULL is returned.
+ */
+int *
+MppSheet::findCell(ssize_t col, ssize_t row, int insert)
+{
+	MppSheetCol *pcol = entries_cols + col;
+	MppSheetCell *pc;
+	ssize_t lo = pcol->first;
+	ssize_t hi = pcol->first + pcol->num;
+	ssize_t x;
+
+	while (lo < hi) {
+		ssize_t mid = (lo + hi) / 2;
+
+		if (entries_cells[mid].row < row)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo != pcol->first + pcol->num && entries_cells[lo].row == row)
+		return (&entries_cells[lo].dur);
+	if (insert == 0)
+		return (NULL);
+
+	if (num_cells == max_cells) {
+		ssize_t max = max_cells ? (2 * max_cells) : 16;
+
+		pc = (struct MppSheetCell *)realloc(entries_cells, max * sizeof(*pc));
+		if (pc == NULL)
+			return (NULL);
+		entries_cells = pc;
+		max_cells = max;
+	}
+	pc = entries_cells + lo;
+	memmove(pc + 1, pc, (num_cells - lo) * sizeof(*pc));
+	num_cells++;
+
+	pc->row = row;
+	pc->dur = 0;
+	pcol->num++;
+
+	for (x = col + 1; x != num_cols; x++)
+		entries_cols[x].first++;
+
+	return (&pc->dur);
+}
+
 void
 MppSheet::paintEvent(QPaintEvent * event)
 {
@@ -456,7 +568,7 @@ MppSheet::paintEvent(QPaintEvent * event)
 
 	paint.fillRect(QRectF(0, 0, width(), height()), Mpp.ColorWhite);
 
-	if (entries_ptr == 0 || entries_rows == 0 ||
+	if (entries_cells == 0 || entries_rows == 0 ||
 	    entries_cols == 0 || num_cols == 0 || num_rows == 0)
 		return;
 
@@ -476,20 +588,10 @@ MppSheet::paintEvent(QPaintEvent * event)
 		last_line = -1;
 	mw->atomic_unlock();
 
-	if (curr_line > -1) {
-		for (x = 0; x != num_cols; x++) {
-			if (curr_line == entries_cols[x].line)
-				break;
-		}
-		curr_line = x;
-	}
-	if (last_line > -1) {
-		for (x = 0; x != num_cols; x++) {
-			if (last_line == entries_cols[x].line)
-				break;
-		}
-		last_line = x;
-	}
+	if (curr_line > -1)
+		curr_line = findColumn(curr_line);
+	if (last_line > -1)
+		last_line = findColumn(last_line);
 	paint.setRenderHints(QPainter::Antialiasing, 1);
 
 	xstart = vs_horiz->value();
@@ -548,10 +650,18 @@ MppSheet::paintEvent(QPaintEvent * event)
 	
 	/* draw filled boxes, if any */
 	for (x = xstart; x < xstop; x++) {
-		for (y = ystart; y < ystop; y++) {
-			int dur = entries_ptr[x + (y * num_cols)];
+		const MppSheetCell *pc = entries_cells + entries_cols[x].first;
+		const MppSheetCell *pe = pc + entries_cols[x].num;
+
+		/* skip cells above the visible window */
+		while (pc != pe && pc->row < ystart)
+			pc++;
+
+		for (; pc != pe && pc->row < ystop; pc++) {
+			int dur = pc->dur;
 			if (dur < 1)
 				continue;
+			y = pc->row;
 			ypos = boxs * (y - ystart);
 			xpos = xoff + boxs * (x - xstart);
 			paint.setPen(QPen(Mpp.ColorGrey, 0));
@@ -577,21 +687,21 @@ MppSheet::mousePressEvent(QMouseEvent * event)
 
 	if (x >= 0 && x < num_cols &&
 	    y >= 0 && y < num_rows) {
-		ssize_t z = x + y * num_cols;
+		int *pdur = findCell(x, y, mode == 0);
 
-		switch (mode) {
+		switch (pdur ? mode : -1) {
 		case 0:
-			entries_ptr[z] = -entries_ptr[z];
-			if (entries_ptr[z] == 0)
-				entries_ptr[z] = 1;
+			*pdur = -*pdur;
+			if (*pdur == 0)
+				*pdur = 1;
 			break;
 		case 1:
-			if (entries_ptr[z] > 0 && entries_ptr[z] < MPP_MAX_DURATION)
-				entries_ptr[z]++;
+			if (*pdur > 0 && *pdur < MPP_MAX_DURATION)
+				(*pdur)++;
 			break;
 		case 2:
-			if (entries_ptr[z] > 1)
-				entries_ptr[z]--;
+			if (*pdur > 1)
+				(*pdur)--;
 			break;
 		default:
 			break;
@@ -611,11 +721,13 @@ MppSheet::mousePressEvent(QMouseEvent * event)
 		update();
 	}
 	if (x >= 0 && x < num_cols) {
-		for (y = 0; y != num_rows; y++) {
+		for (ssize_t z = 0; z != entries_cols[x].num; z++) {
+			const MppSheetCell *pc = entries_cells + entries_cols[x].first + z;
 			int num;
 			int chan;
-			if (entries_ptr[x + (y * num_cols)] < 1)
+			if (pc->dur < 1)
 				continue;
+			y = pc->row;
 			switch (entries_rows[y].type) {
 			case MPP_T_SCORE_SUBDIV:
 				num = entries_rows[y].u.score.num +
@@ -742,11 +854,7 @@ MppSheet :: watchdog()
 		delta = 1;
 
 	if (curr != 0) {
-		int line = curr->line;
-		for (x = 0; x != num_cols; x++) {
-			if (entries_cols[x].line == line)
-				break;
-		}
+		x = findColumn(curr->line);
 		if (x != num_cols) {
 			y = vs_horiz->value();
 			if (x > y)
@@ -61,6 +61,14 @@ struct MppSheetCol {
 	int line;
 	int pre_timer;
 	int post_timer;
+	ssize_t first;		/* index of first cell */
+	ssize_t num;		/* number of cells */
+};
+
+/* non-empty cell of a column, sorted by row */
+struct MppSheetCell {
+	int	row;
+	int	dur;
 };
 
 class MppSheet : public QWidget
@@ -86,7 +94,11 @@ public:
 	ssize_t	num_cols;
 	MppSheetRow *entries_rows;
 	MppSheetCol *entries_cols;
-	int	*entries_ptr;
+	MppSheetCell *entries_cells;
+	ssize_t	num_cells;
+	ssize_t	max_cells;
+	ssize_t	findColumn(int);
+	int	*findCell(ssize_t, ssize_t, int);
 	void	sizeInit();
 	void	paintEvent(QPaintEvent *);	
 	void	mousePressEvent(QMouseEvent *);
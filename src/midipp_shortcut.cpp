@@ -209,27 +209,27 @@ MppShortcutTab :: handle_event_received_locked(MppScoreMain *sm,
 			break;
 		case MPP_SHORTCUT_ALL:
 			sm->keyMode = MM_PASS_ALL;
-			mw->keyModeUpdated = 1;
+			mw->notify(MPP_DIRTY_KEY_MODE);
 			break;
 		case MPP_SHORTCUT_TRANS:
 			sm->keyMode = MM_PASS_NONE_TRANS;
-			mw->keyModeUpdated = 1;
+			mw->notify(MPP_DIRTY_KEY_MODE);
 			break;
 		case MPP_SHORTCUT_FIXED:
 			sm->keyMode = MM_PASS_NONE_FIXED;
-			mw->keyModeUpdated = 1;
+			mw->notify(MPP_DIRTY_KEY_MODE);
 			break;
 		case MPP_SHORTCUT_CHORD_PIANO:
 			sm->keyMode = MM_PASS_NONE_CHORD_PIANO;
-			mw->keyModeUpdated = 1;
+			mw->notify(MPP_DIRTY_KEY_MODE);
 			break;
 		case MPP_SHORTCUT_CHORD_AUX:
 			sm->keyMode = MM_PASS_NONE_CHORD_AUX;
-			mw->keyModeUpdated = 1;
+			mw->notify(MPP_DIRTY_KEY_MODE);
 			break;
 		case MPP_SHORTCUT_CHORD_TRANS:
 			sm->keyMode = MM_PASS_NONE_CHORD_TRANS;
-			mw->keyModeUpdated = 1;
+			mw->notify(MPP_DIRTY_KEY_MODE);
 			break;
 		case MPP_SHORTCUT_TRIGGER:
 			mw->handle_midi_trigger();
@@ -238,15 +238,18 @@ MppShortcutTab :: handle_event_received_locked(MppScoreMain *sm,
 			break;
 		case MPP_SHORTCUT_PAUSE:
 			mw->doOperation |= MPP_OPERATION_PAUSE;
+			mw->notify(MPP_DIRTY_OPERATION);
 			break;
 		case MPP_SHORTCUT_REWIND:
 			mw->doOperation &= ~MPP_OPERATION_PAUSE;
 			mw->doOperation |= MPP_OPERATION_REWIND;
+			mw->notify(MPP_DIRTY_OPERATION);
 			break;
 		case MPP_SHORTCUT_BPM_TOGGLE:
 			mw->dlg_bpm->enabled ^= 1;
 			mw->dlg_bpm->handle_update(mw->dlg_bpm->enabled);
 			mw->doOperation |= MPP_OPERATION_BPM;
+			mw->notify(MPP_DIRTY_OPERATION);
 			break;
 		default:
 			break;